@@ -13,7 +13,7 @@ Key Features:
 Usage:
 To compile and run the benchmark with GCC, use the following commands:
 g++ -std=c++17 -O3 -o benchmark benchmark.cpp
-./benchmark <iterations> [--verify-8bit] [--verify-24bit] [--verify-predefined] [--verify-all] [--null] [--termcolor]
+./benchmark <iterations> [--verify-8bit] [--verify-24bit] [--verify-predefined] [--verify-theme-stream] [--verify-theme-parallel] [--verify-theme-binary] [--verify-static-theme] [--verify-canvas] [--verify-logger-order] [--verify-binary-log] [--verify-log-sinks] [--verify-rate-limit] [--verify-flight-recorder] [--verify-highlight] [--verify-all] [--null] [--termcolor] [--bench-logger] [--bench-logger-threads] [--bench-timestamp] [--bench-theme] [--bench-theme-threads] [--bench-highlight]
 
 To compile with clang++ using LLVM you can use the following commands:
 clang++ -std=c++17 -O3 -rtlib=compiler-rt -stdlib=libc++ -o benchmark benchmark.cpp \
@@ -27,9 +27,26 @@ Arguments:
 --verify-8bit: Verifies the full 8-bit color spectrum.
 --verify-24bit: Verifies the full 24-bit color spectrum.
 --verify-predefined: Verifies predefined color functions.
+--verify-theme-stream: Checks that ThemeStream output matches apply_theme for every way of splitting test inputs into two or three pieces.
+--verify-theme-parallel: Checks that apply_theme_parallel output matches apply_theme on random themes and inputs, at several thread counts and small chunk sizes.
+--verify-theme-binary: Checks that a theme saved as text or compiled and loaded back colours text as before, and that damaged compiled themes are rejected.
+--verify-static-theme: Checks that StaticTheme output matches a ColorMapping with the same entries on random inputs, including overridden and shared colours, ':' separators and invalid UTF-8.
+--verify-canvas: Checks Canvas::render() output against the exact redraw expected after known edits.
+--verify-logger-order: Checks that each thread's log lines come out in call order, sync and async, with plain, formatted, oversized and _HERE records mixed.
+--verify-binary-log: Checks that a binary log of sync, async, formatted and _HERE calls decodes to the text the Logger writes for the same calls.
+--verify-log-sinks: Checks size and interval rotation of a rotating file sink, and that plain and coloured sinks fed the same lines differ only by colour escapes.
+--verify-rate-limit: Checks the lines let through and the "message repeated N times" summaries under token-bucket and first-N limits, per message and per call site, including summaries for evicted keys and on reconfiguration.
+--verify-flight-recorder: Checks that the flight recorder dump after a fatal line lists each thread's lines in time order, formatted as the text logger wrote them, plus the lines filtered from the output.
+--verify-highlight: Checks the log highlighter's output on logfmt, JSON and plain-text lines whose tokens are known.
 --verify-all: Runs all verification tests.
 --null: Uses NullStream to discard output during benchmarking.
 --termcolor: Includes termcolor benchmarks if the library is available.
+--bench-logger: Logger cost per call on the calling thread, and lines per second including the drain to the output, for sync, async and async deferred formatting, with stderr discarded.
+--bench-logger-threads: Logger throughput from 1 to 64 threads, per-line writes versus thread-local staging.
+--bench-timestamp: Per-line cost of the cached timestamp formatter versus strftime on every line.
+--bench-theme: Theme application throughput in GB/s on log text: scalar versus vectorized scan for mapped bytes, ColorMapping::apply_to with and without multi-character tokens and with box-drawing glyphs mapped by code point, and the same theme compiled as a StaticTheme.
+--bench-theme-threads: Parallel theme application throughput on 64 MB of log text, from 1 thread to twice the core count.
+--bench-highlight: Structured log highlighter throughput in MB/s on one core, per corpus (logfmt, JSON, plain text) and mixed.
 
 Benchmark Example to compare colorterm and termcolor:
 ./benchmark 10000000 --termcolor --null
@@ -41,7 +58,12 @@ Standard Benchmark (recommend to use NullStream for accurate results and to avoi
 
 #include <iostream>
 #include <chrono>
+#include <cstddef>
+#include <filesystem>
 #include <iomanip>
+#include <random>
+#include <thread>
+#include <vector>
 #include "colorterm.hpp"
 
 #ifdef USE_TERMCOLOR
@@ -53,6 +75,9 @@ protected:
     int overflow(int c) override {
         return c;
     }
+    std::streamsize xsputn(const char*, std::streamsize n) override {
+        return n;
+    }
 };
 
 class NullStream : public std::ostream {
@@ -357,6 +382,1136 @@ void verify_color_functions() {
 
 }
 
+// Streams inputs mixing tokens, same-colour runs, code points and stray UTF-8 bytes through
+// ThemeStream split at every pair of points, and runs longer than a piece in pieces of
+// several sizes; returns the number of outputs that differ from apply_theme
+size_t verify_theme_stream() {
+    colorterm::create_theme("verify_stream");
+    colorterm::set_theme("verify_stream");
+    colorterm::insert_colormap("bracket", "[]", "\033[36m");
+    colorterm::insert_colormap("box", "│─", "\033[90m");
+    colorterm::insert_colormap("ERROR", "", "\033[31m", true);
+    colorterm::insert_colormap("timeout", "", "\033[33m", false, true);
+    const char* parts[] = {"[", "]", "│", "─", "ERROR", "timeout", ":", "\n", "x", "\xe2", "\x94", "\x82"};
+    std::mt19937 rng(42);
+    size_t mismatches = 0;
+    size_t checked = 0;
+    for (int n = 0; n < 300; ++n) {
+        std::string input;
+        for (int i = 0; i < 8; ++i) input += parts[rng() % (sizeof(parts) / sizeof(parts[0]))];
+        std::string expected = colorterm::apply_theme(input);
+        for (size_t i = 0; i <= input.size(); ++i) {
+            for (size_t j = i; j <= input.size(); ++j) {
+                std::string out;
+                colorterm::ThemeStream stream([&out](std::string_view piece) { out.append(piece); });
+                stream.write(std::string_view(input).substr(0, i));
+                stream.write(std::string_view(input).substr(i, j - i));
+                stream.write(std::string_view(input).substr(j));
+                stream.finish();
+                ++checked;
+                if (out != expected) ++mismatches;
+            }
+        }
+    }
+    // Same-colour runs much longer than a piece, in keys and values and next to tokens
+    std::string box;
+    for (int i = 0; i < 3000; ++i) box += "─";
+    const std::string long_inputs[] = {box, std::string(5000, '[') + "ERROR" + std::string(5000, ']'), "x" + box + ":" + box + "timeout" + box + "\n"};
+    for (const auto& input : long_inputs) {
+        std::string expected = colorterm::apply_theme(input);
+        for (size_t piece : {1, 7, 1000, 4096}) {
+            std::string out;
+            colorterm::ThemeStream stream([&out](std::string_view text) { out.append(text); });
+            for (size_t at = 0; at < input.size(); at += piece) stream.write(std::string_view(input).substr(at, piece));
+            stream.finish();
+            ++checked;
+            if (out != expected) {
+                ++mismatches;
+                std::cout << "ThemeStream: a " << input.size() << "-byte input in " << piece << "-byte pieces gives " << out.size() << " bytes instead of " << expected.size() << "\n";
+            }
+        }
+    }
+    colorterm::set_default_theme();
+    std::cout << "ThemeStream: " << checked - mismatches << " of " << checked << " split inputs match apply_theme\n";
+    return mismatches;
+}
+
+// Colours random themes of shared-colour characters, key and value tokens (some spanning a
+// newline) and code points, over inputs with and without newlines, with apply_theme_parallel
+// at several thread counts and small chunk sizes; returns the number of outputs that differ
+// from apply_theme
+size_t verify_theme_parallel() {
+    const char* colors[] = {"\033[31m", "\033[32m", "\033[36m"};
+    const char* singles[] = {"[", "]", "{", "}", "=", "\"", "│"};
+    const char* parts[] = {"[", "]", "{", "}", "=", "\"", "│", "ERROR", "timeout", "ok\nnext", ":", "x", "abc", "\n", "\n", "\xe2\x94"};
+    std::mt19937 rng(44);
+    size_t mismatches = 0;
+    size_t checked = 0;
+    colorterm::Logger::set_level(colorterm::LogLevel::warn);
+    for (int n = 0; n < 150; ++n) {
+        std::string name = "verify_parallel_" + std::to_string(n);
+        colorterm::create_theme(name);
+        colorterm::set_theme(name);
+        for (size_t i = 0; i < sizeof(singles) / sizeof(singles[0]); ++i) {
+            if (rng() % 2) colorterm::insert_colormap("single" + std::to_string(i), singles[i], colors[rng() % 3]);
+        }
+        if (rng() % 2) colorterm::insert_colormap("ERROR", "", colors[rng() % 3], true);
+        if (rng() % 2) colorterm::insert_colormap("timeout", "", colors[rng() % 3], false, true);
+        // A token holding '\n' rules out cutting the text at all
+        if (rng() % 4 == 0) colorterm::insert_colormap("ok\nnext", "", colors[rng() % 3], false, true);
+        for (int k = 0; k < 4; ++k) {
+            bool newlines = k != 0;
+            std::string input;
+            for (int i = 0; i < 60; ++i) {
+                std::string part = parts[rng() % (sizeof(parts) / sizeof(parts[0]))];
+                if (!newlines && part.find('\n') != std::string::npos) continue;
+                input += part;
+            }
+            std::string expected = colorterm::apply_theme(input);
+            for (size_t threads : {1, 2, 4}) {
+                for (size_t chunk_size : {1, 2, 3, 7, 16, 256}) {
+                    ++checked;
+                    if (colorterm::apply_theme_parallel(input, threads, chunk_size) != expected) ++mismatches;
+                }
+            }
+        }
+    }
+    colorterm::set_default_theme();
+    colorterm::Logger::set_level(colorterm::LogLevel::trace);
+    std::cout << "Parallel theme: " << checked - mismatches << " of " << checked << " outputs match apply_theme\n";
+    return mismatches;
+}
+
+// Saves one theme as text and as a compiled image, loads both back and compares their output
+// with the original's; then checks that truncated, corrupted, other-version and other-byte-order
+// images are rejected. Returns the number of failed checks.
+size_t verify_theme_binary() {
+    using colorterm::_internal::ThemeFileHeader;
+    std::string dir = std::filesystem::temp_directory_path().string() + "/colorterm_verify_" + std::to_string(std::random_device()());
+    std::filesystem::create_directories(dir);
+    colorterm::Logger::set_level(colorterm::LogLevel::fatal);
+    size_t failures = 0;
+    auto fail = [&](const std::string& what) {
+        std::cout << "Compiled theme: " << what << "\n";
+        ++failures;
+    };
+
+    colorterm::create_theme("verify_binary");
+    colorterm::set_theme("verify_binary");
+    colorterm::insert_colormap("bracket", "[]", "\033[36m");
+    colorterm::insert_colormap("quote", "\"=", "\033[36m");
+    colorterm::insert_colormap("box", "│─", "\033[90m");
+    colorterm::insert_colormap("tab", "\t", "\033[41m");
+    colorterm::insert_colormap("ERROR", "", "\033[31m", true);
+    colorterm::insert_colormap("timeout", "", "\033[33m", false, true);
+    colorterm::insert_colormap("two\nlines", "", "\033[35m", false, true);
+    colorterm::set_highlight_color("key", "\033[94m");
+    colorterm::set_highlight_color("uuid", "");
+    colorterm::save_theme("verify_binary", dir + "/theme.txt");
+    colorterm::save_theme_binary("verify_binary", dir + "/theme.ctt");
+    const std::string inputs[] = {
+        "[ERROR] \"a\"=[b] │── timeout\ttwo\nlines: x\n",
+        "no colon [x] ERROR timeout\n",
+        "level=warn id=123e4567-e89b-12d3-a456-426614174000 ip=10.0.0.1 msg=\"done\" ERROR: timeout\n",
+    };
+    std::vector<std::string> expected;
+    for (const auto& input : inputs) expected.push_back(colorterm::apply_theme(input) + colorterm::highlight_log(input));
+
+    for (const char* file : {"theme.txt", "theme.ctt"}) {
+        std::string name = std::string("verify_binary_") + file;
+        colorterm::load_theme(name, dir + "/" + file);
+        colorterm::set_theme(name);
+        for (size_t i = 0; i < expected.size(); ++i) {
+            if (colorterm::apply_theme(inputs[i]) + colorterm::highlight_log(inputs[i]) != expected[i]) {
+                fail(std::string("output after loading ") + file + " differs on input " + std::to_string(i));
+            }
+        }
+    }
+
+    std::string image;
+    {
+        std::ifstream in(dir + "/theme.ctt", std::ios::binary);
+        image.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    auto patched = [&](size_t offset, uint32_t value) {
+        std::string copy = image;
+        std::memcpy(&copy[offset], &value, sizeof(value));
+        return copy;
+    };
+    std::string flipped = image;
+    flipped.back() ^= 0x01;
+    const std::pair<const char*, std::string> corrupt[] = {
+        {"truncated by one byte", image.substr(0, image.size() - 1)},
+        {"truncated to its header", image.substr(0, sizeof(ThemeFileHeader))},
+        {"with a flipped byte", flipped},
+        {"of another version", patched(offsetof(ThemeFileHeader, version), colorterm::_internal::theme_file_version + 1)},
+        {"of the other byte order", patched(offsetof(ThemeFileHeader, byte_order), 0x04030201)},
+    };
+    int n = 0;
+    for (const auto& [what, bytes] : corrupt) {
+        std::string path = dir + "/corrupt" + std::to_string(n) + ".ctt";
+        std::ofstream(path, std::ios::binary).write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        try {
+            colorterm::load_theme("verify_binary_corrupt" + std::to_string(n++), path);
+            fail(std::string("a compiled theme ") + what + " was accepted");
+        } catch (const std::runtime_error&) {
+        }
+    }
+
+    colorterm::set_default_theme();
+    colorterm::Logger::set_level(colorterm::LogLevel::trace);
+    std::filesystem::remove_all(dir);
+    std::cout << "Compiled theme: " << (failures == 0 ? "text and binary round trips match, corrupt images rejected" : "checks failed") << "\n";
+    return failures;
+}
+
+// Control characters other than newlines as \033-style escapes, for printing terminal output
+// in mismatch reports
+std::string escape_control(std::string_view text) {
+    std::string out;
+    for (char c : text) {
+        if (static_cast<unsigned char>(c) < 0x20 && c != '\n') {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\%03o", static_cast<unsigned char>(c));
+            out += code;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+// StaticThemes for verify_static_theme(): entries overriding earlier ones, equal colours shared
+// between entries, mapped code points next to mapped bytes, and stray UTF-8 bytes as entries
+inline constexpr colorterm::ThemeEntry verify_static_overrides[] = {
+    {"[]{}", "\033[36m"}, {"=\"", "\033[90m"}, {"]}", "\033[31m"}, {"│─", "\033[90m"}, {"[", "\033[36m"}, {"─→", "\033[35m"}, {"=", "\033[33m"}};
+inline constexpr colorterm::ThemeEntry verify_static_shared[] = {
+    {"ab", "\033[32m"}, {"cd", "\033[32m"}, {":", "\033[33m"}, {"é│", "\033[32m"}, {"\x94", "\033[31m"}, {"x:", "\033[32m"}};
+inline constexpr colorterm::ThemeEntry verify_static_wide[] = {
+    {"│─┌┐", "\033[90m"}, {"→", "\033[1m"}, {"😀", "\033[33m"}, {"é", "\033[90m"}, {"\xe2", "\033[34m"}, {"┌a", "\033[1m"}, {"\xc3\xa9\x80", "\033[35m"}};
+
+// Colours `inputs` random inputs with StaticTheme<Entries> and with a ColorMapping holding the
+// same entries inserted in order; returns the number of outputs that differ
+template <const auto& Entries>
+size_t verify_static_theme_entries(const char* name, std::mt19937& rng, size_t inputs, size_t& checked) {
+    const char* parts[] = {"[", "]", "{", "}", "=", "\"", "a", "b", "c", "d", "x", " ", ":", ":", "\n", "ab", "cd", "│", "─", "→", "┌", "┐", "é", "😀",
+                           "\xe2", "\x94", "\x80", "\xe2\x94", "\xf0\x9f\x98", "\xc3", "\xff", "\xc0\xaf", "\xed\xa0\x80", "\xe2\x94\x82\x82"};
+    colorterm::_internal::ColorMapping mapping;
+    for (size_t i = 0; i < std::size(Entries); ++i) {
+        mapping.insert("entry" + std::to_string(i), std::string(Entries[i].characters), std::string(Entries[i].color));
+    }
+    size_t mismatches = 0;
+    for (size_t n = 0; n < inputs; ++n) {
+        std::string input;
+        for (size_t i = 1 + rng() % 40; i > 0; --i) input += parts[rng() % (sizeof(parts) / sizeof(parts[0]))];
+        std::string expected = mapping.apply(input);
+        std::string got = colorterm::StaticTheme<Entries>::apply(input);
+        ++checked;
+        if (got == expected) continue;
+        if (++mismatches <= 3) {
+            std::cout << "StaticTheme " << name << " on \"" << escape_control(input) << "\":\n  got      " << escape_control(got) << "\n  expected "
+                      << escape_control(expected) << "\n";
+        }
+    }
+    return mismatches;
+}
+
+// Compares StaticTheme with ColorMapping on 21000 random inputs mixing mapped and
+// unmapped bytes and code points, ':' separators, newlines and invalid or truncated UTF-8;
+// returns the number of outputs that differ
+size_t verify_static_theme() {
+    std::mt19937 rng(50);
+    size_t checked = 0;
+    size_t mismatches = verify_static_theme_entries<verify_static_overrides>("overrides", rng, 7000, checked);
+    mismatches += verify_static_theme_entries<verify_static_shared>("shared colours", rng, 7000, checked);
+    mismatches += verify_static_theme_entries<verify_static_wide>("code points", rng, 7000, checked);
+    std::cout << "StaticTheme: " << checked - mismatches << " of " << checked << " inputs match ColorMapping\n";
+    return mismatches;
+}
+
+// Highlights logfmt, JSON and plain-text lines whose tokens are known, with each class
+// coloured by a readable marker ("<ip>" ... "</>"), and compares the output; also checks
+// tokens longer than the highlighter's output block, colours too long to pad and an
+// uncoloured class. Returns the number of outputs that differ.
+size_t verify_highlight() {
+    using colorterm::_internal::ColorMapping;
+    using colorterm::_internal::LogHighlighter;
+    ColorMapping theme;
+    for (const char* role : colorterm::_internal::highlight_role_names) theme.set_highlight_color(role, std::string("<") + role + ">");
+    auto render = [](const ColorMapping& theme, const std::string& text) {
+        std::string out = LogHighlighter(theme).apply(text);
+        std::string marked;
+        for (size_t i = 0; i < out.size(); ++i) {
+            if (out.compare(i, 4, "\033[0m") == 0) {
+                marked += "</>";
+                i += 3;
+            } else {
+                marked += out[i];
+            }
+        }
+        return marked;
+    };
+    size_t failures = 0;
+    size_t checked = 0;
+    auto expect = [&](const ColorMapping& theme, const std::string& text, const std::string& expected) {
+        ++checked;
+        std::string got = render(theme, text);
+        if (got == expected) return;
+        std::cout << "Highlight \"" << escape_control(text.substr(0, 80)) << "\":\n  got      " << escape_control(got.substr(0, 200)) << "\n  expected "
+                  << escape_control(expected.substr(0, 200)) << "\n";
+        ++failures;
+    };
+    const std::string logfmt = "ts=2024-05-17T14:03:10.123Z level=info msg=\"request served\" status=200 duration=12ms remote=10.0.0.7:443 id=123e4567-e89b-12d3-a456-426614174000\n";
+    const std::string logfmt_marked =
+        "<key>ts</>=<timestamp>2024-05-17T14:03:10.123Z</> <key>level</>=<info>info</> <key>msg</>=<string>\"request served\"</> <key>status</>=<number>200</> "
+        "<key>duration</>=<number>12ms</> <key>remote</>=<ip>10.0.0.7:443</> <key>id</>=<uuid>123e4567-e89b-12d3-a456-426614174000</>\n";
+    expect(theme, logfmt, logfmt_marked);
+    expect(theme, "level=Error user=bob code=-42 note=\"unterminated\n", "<key>level</>=<error>Error</> <key>user</>=bob <key>code</>=<number>-42</> <key>note</>=\"unterminated\n");
+    expect(theme, "{\"time\":\"2024-05-17T14:03:10+02:00\",\"level\":\"WARN\",\"msg\":\"disk at 91%\",\"free\":1.5e9,\"peer\":\"fe80::1ff:fe23:4567:890a\",\"ok\":true}\n",
+           "{<key>\"time\"</>:<timestamp>\"2024-05-17T14:03:10+02:00\"</>,<key>\"level\"</>:<warning>\"WARN\"</>,<key>\"msg\"</>:<string>\"disk at 91%\"</>,"
+           "<key>\"free\"</>:<number>1.5e9</>,<key>\"peer\"</>:<ip>\"fe80::1ff:fe23:4567:890a\"</>,<key>\"ok\"</>:true}\n");
+    expect(theme, "2024-05-17 14:03:10,456 [ERROR] worker-3: it's 'alice' from 192.168.1.20, retry 3/5 after 0x1F.\n",
+           "<timestamp>2024-05-17 14:03:10,456</> [<error>ERROR</>] worker-3: it's <string>'alice'</> from <ip>192.168.1.20</>, retry <number>3</>/<number>5</> after <number>0x1F</>.\n");
+    expect(theme, "DEBUG info: 07:15:00 cache fe80::1 warm, 1.2.3 not an ip, 123e4567-e89b-12d3-a456-42661417400g not a uuid",
+           "<debug>DEBUG</> info: <timestamp>07:15:00</> cache <ip>fe80::1</> warm, 1.2.3 not an ip, 123e4567-e89b-12d3-a456-42661417400g not a uuid");
+
+    // Output well past one block, and single tokens bigger than a block
+    std::string many, many_marked;
+    for (int i = 0; i < 200; ++i) many += logfmt, many_marked += logfmt_marked;
+    expect(theme, many, many_marked);
+    std::string long_value(10000, 'x');
+    expect(theme, "msg=\"" + long_value + "\" n=7", "<key>msg</>=<string>\"" + long_value + "\"</> <key>n</>=<number>7</>");
+    expect(theme, long_value + " 7", long_value + " <number>7</>");
+
+    // A colour longer than the padded copy, and a class left uncoloured
+    ColorMapping long_color = theme;
+    const std::string marker = "<number with a colour code longer than 32 bytes>";
+    long_color.set_highlight_color("number", marker);
+    long_color.set_highlight_color("key", "");
+    expect(long_color, "status=200 bytes=1.5GB", "status=" + marker + "200</> bytes=" + marker + "1.5GB</>");
+
+    // A highlighter used after the theme it was built from is gone
+    auto outlived = std::make_unique<LogHighlighter>(ColorMapping(long_color));
+    ++checked;
+    std::string kept = outlived->apply("n=7");
+    if (kept != "n=" + marker + "7\033[0m") {
+        std::cout << "Highlight after theme freed: got " << escape_control(kept) << "\n";
+        ++failures;
+    }
+
+    std::cout << "Highlight: " << checked - failures << " of " << checked << " inputs highlighted as expected\n";
+    return failures;
+}
+
+// Renders Canvas frames after known edits and compares each with the exact escape stream
+// expected; returns the number of frames that differ
+size_t verify_canvas() {
+    using colorterm::Canvas;
+    colorterm::enable_global_color();
+    colorterm::enable_global_theme();
+    size_t failures = 0;
+    auto expect = [&](const char* what, const std::string& frame, const std::string& expected) {
+        if (frame == expected) return;
+        std::cout << "Canvas, " << what << ": got \"" << escape_control(frame) << "\", expected \"" << escape_control(expected) << "\"\n";
+        ++failures;
+    };
+    const uint32_t red = Canvas::pack(255, 0, 0);
+    Canvas canvas(10, 3);
+    canvas.clear();
+    if (canvas.render().empty()) {
+        std::cout << "Canvas, first frame: empty, expected a full repaint\n";
+        ++failures;
+    }
+    expect("unchanged frame", canvas.render(), "");
+
+    canvas.set(4, 1, 'A', red);
+    expect("one changed cell", canvas.render(), "\033[2;5H\033[38;2;255;000;000mA\033[0m");
+    expect("unchanged after a change", canvas.render(), "");
+
+    // Same row: the second cell is reached by a relative move and reuses the pen
+    canvas.set(2, 2, 'X', red);
+    canvas.set(5, 2, 'Y', red);
+    expect("two cells on one row", canvas.render(), "\033[3;3H\033[38;2;255;000;000mX\033[2CY\033[0m");
+
+    // After the last column the cursor position is unknown, so the next cell is addressed absolutely
+    canvas.set(9, 0, 'B');
+    canvas.set(1, 1, 'C');
+    expect("last column", canvas.render(), "\033[1;10HB\033[2;2HC");
+
+    // Adding an attribute is one SGR; dropping one needs a reset first
+    canvas.set(0, 0, 'Z', Canvas::default_color, Canvas::default_color, Canvas::attr_bold);
+    expect("attribute added", canvas.render(), "\033[1;1H\033[1mZ\033[0m");
+    canvas.set(0, 0, 'Z', Canvas::default_color, Canvas::default_color, Canvas::attr_bold | Canvas::attr_underline);
+    canvas.set(1, 0, 'Z', Canvas::default_color, Canvas::default_color, Canvas::attr_underline);
+    expect("attribute removed", canvas.render(), "\033[1;1H\033[1m\033[4mZ\033[0m\033[4mZ\033[0m");
+
+    std::cout << "Canvas: " << (failures == 0 ? "every frame matches the expected redraw" : "frames differ") << "\n";
+    return failures;
+}
+
+// The same Logger calls for each pass of verify_binary_log()
+void log_binary_log_calls() {
+    using colorterm::Logger;
+    std::string name = "alice";
+    Logger::info("plain message with {braces} kept as written");
+    Logger::warn("benchmark.cpp", 42, "explicit file and line");
+    Logger::error(COLORTERM_FMT("ints {} {} {}, double {}, bool {}, char {}"), -17, 42u, int64_t(-9000000000), 2.5, true, 'x');
+    Logger::info(COLORTERM_FMT("strings {} {} {} and {{literal}} braces"), name, std::string_view("view"), "literal");
+    Logger::info(COLORTERM_FMT("streamed {}"), std::this_thread::get_id());
+    COLORTERM_INFO_HERE("located plain message");
+    COLORTERM_WARN_HERE(COLORTERM_FMT("located {} of {}"), 1, 2);
+    COLORTERM_ERROR_HERE([&] { return "located lazy message for " + name; });
+}
+
+// Writes the same sync, async, deferred-format and _HERE calls as text and as a binary log,
+// decodes the binary log and compares it with the text, without the decoder's timestamps;
+// returns the number of lines that differ
+size_t verify_binary_log() {
+    using colorterm::Logger;
+    auto memory = std::make_shared<colorterm::LogMemory>();
+    Logger::set_timestamp(colorterm::LogTimestamp::none);
+    size_t failures = 0;
+    for (bool colored : {false, true}) {
+        memory->clear();
+        Logger::set_sinks({colorterm::make_memory_sink(memory, colored ? colorterm::ColorPolicy::always : colorterm::ColorPolicy::never)});
+        log_binary_log_calls();
+        Logger::flush();
+        std::string text = memory->contents();
+        if (std::count(text.begin(), text.end(), '\n') != 8) {
+            ++failures;
+            std::cout << "Binary log: the text logger wrote " << std::count(text.begin(), text.end(), '\n') << " lines instead of 8\n";
+        }
+        for (bool async : {false, true}) {
+            std::stringstream binary;
+            if (async) Logger::enable_async();
+            Logger::set_binary_output(binary);
+            log_binary_log_calls();
+            Logger::disable_binary_output();
+            Logger::disable_async();
+            std::ostringstream decoded;
+            colorterm::decode_binary_log(binary, decoded, colored);
+            // Decoded lines start with a "YYYY-MM-DD HH:MM:SS.mmm " wall-clock time
+            std::istringstream lines(decoded.str());
+            std::string stripped;
+            for (std::string line; std::getline(lines, line);) {
+                if (line.size() < 24 || line[4] != '-' || line[10] != ' ' || line[19] != '.' || line[23] != ' ') {
+                    ++failures;
+                    std::cout << "Binary log: no timestamp on \"" << escape_control(line) << "\"\n";
+                    continue;
+                }
+                stripped += line.substr(24) + "\n";
+            }
+            if (stripped != text) {
+                ++failures;
+                std::cout << "Binary log (" << (async ? "async" : "sync") << (colored ? ", coloured" : "") << ") decodes to\n"
+                          << escape_control(stripped) << "instead of\n" << escape_control(text);
+            }
+        }
+    }
+    Logger::set_sinks({colorterm::make_stream_sink(std::cerr)});
+    std::cout << "Binary log: " << (failures == 0 ? "decoded output matches the text logger" : "decoded output differs") << "\n";
+    return failures;
+}
+
+// Logs storms under each rate limit mode and key and compares the output with the lines
+// expected through, including the "message repeated N times" summaries: on flush, before the
+// key's next line, when a full set evicts the key and when the limit is replaced. Returns the
+// number of failed checks.
+size_t verify_rate_limit() {
+    using colorterm::Logger;
+    using colorterm::RateLimit;
+    using colorterm::RateLimitKey;
+    using colorterm::RateLimitMode;
+    auto memory = std::make_shared<colorterm::LogMemory>();
+    Logger::set_sinks({colorterm::make_memory_sink(memory)});
+    Logger::set_timestamp(colorterm::LogTimestamp::none);
+    size_t failures = 0;
+    auto check = [&](const char* what, const std::string& expected) {
+        std::string text = memory->contents();
+        memory->clear();
+        if (text == expected) return;
+        ++failures;
+        std::cout << "Rate limit (" << what << ") wrote\n" << escape_control(text) << "instead of\n" << escape_control(expected);
+    };
+    // Long intervals keep the background summaries out of the way unless a check waits for them
+    auto limit = [](RateLimitMode mode, RateLimitKey key, std::chrono::milliseconds interval) {
+        RateLimit limit;
+        limit.mode = mode;
+        limit.key = key;
+        limit.per_second = 0.001;
+        limit.burst = 3;
+        limit.first_n = 2;
+        limit.interval = interval;
+        return limit;
+    };
+    const std::chrono::milliseconds hour(3600 * 1000);
+
+    Logger::set_rate_limit(limit(RateLimitMode::token_bucket, RateLimitKey::message, hour));
+    uint64_t suppressed = Logger::suppressed_count();
+    for (int n = 0; n < 10; ++n) Logger::info("storm");
+    Logger::warn("other");
+    Logger::fatal("fatal");
+    Logger::fatal("fatal");
+    Logger::fatal("fatal");
+    Logger::fatal("fatal");
+    if (Logger::suppressed_count() - suppressed != 7) {
+        ++failures;
+        std::cout << "Rate limit (token bucket) counted " << Logger::suppressed_count() - suppressed << " suppressed lines instead of 7\n";
+    }
+    Logger::flush();
+    check("token bucket", "[INFO] storm\n[INFO] storm\n[INFO] storm\n[WARNING] other\n"
+                          "[FATAL] fatal\n[FATAL] fatal\n[FATAL] fatal\n[FATAL] fatal\n"
+                          "[INFO] message repeated 7 times: storm\n");
+
+    // Call-site keys share one budget across different messages; the summary quotes the first
+    // suppressed one
+    Logger::set_rate_limit(limit(RateLimitMode::token_bucket, RateLimitKey::call_site, hour));
+    for (int n = 0; n < 6; ++n) COLORTERM_INFO_HERE("site " + std::to_string(n));
+    Logger::flush();
+    std::string text = memory->contents();
+    memory->clear();
+    size_t through = static_cast<size_t>(std::count(text.begin(), text.end(), '\n')) - 1;
+    const std::string summary = "message repeated 3 times: site 3\n";
+    if (through != 3 || text.find("site 2\n") == std::string::npos || text.find("site 3\n") != text.rfind("site 3\n")
+        || text.size() < summary.size() || text.compare(text.size() - summary.size(), summary.size(), summary) != 0) {
+        ++failures;
+        std::cout << "Rate limit (call site) wrote\n" << escape_control(text);
+    }
+
+    // first_n reopens after the interval, and the key's next line reports the window's repeats
+    Logger::set_rate_limit(limit(RateLimitMode::first_n, RateLimitKey::message, std::chrono::milliseconds(300)));
+    for (int n = 0; n < 5; ++n) Logger::info("window");
+    std::this_thread::sleep_for(std::chrono::milliseconds(350));
+    Logger::info("window");
+    Logger::flush();
+    check("first n", "[INFO] window\n[INFO] window\n[INFO] message repeated 3 times: window\n[INFO] window\n");
+
+    // Five messages of one 4-way set: the fifth evicts the least recently seen, which reports
+    // its pending repeat first
+    Logger::set_rate_limit(limit(RateLimitMode::token_bucket, RateLimitKey::message, hour));
+    std::vector<std::string> same_set;
+    const size_t sets = colorterm::_internal::LogRateLimiter::set_count;
+    for (int n = 0; same_set.size() < 5; ++n) {
+        std::string msg = "evict " + std::to_string(n);
+        if (same_set.empty() || colorterm::_internal::hash_log_key(msg) % sets == colorterm::_internal::hash_log_key(same_set[0]) % sets) same_set.push_back(msg);
+    }
+    for (int n = 0; n < 4; ++n) Logger::info(same_set[0]);
+    for (size_t i = 1; i < 5; ++i) Logger::info(same_set[i]);
+    Logger::info(same_set[0]);
+    Logger::flush();
+    std::string expected;
+    for (int n = 0; n < 3; ++n) expected += "[INFO] " + same_set[0] + "\n";
+    for (size_t i = 1; i < 4; ++i) expected += "[INFO] " + same_set[i] + "\n";
+    expected += "[INFO] message repeated 1 times: " + same_set[0] + "\n[INFO] " + same_set[4] + "\n[INFO] " + same_set[0] + "\n";
+    check("eviction", expected);
+
+    // Replacing the limit reports what the old one still held
+    for (int n = 0; n < 5; ++n) Logger::info("pending");
+    Logger::set_rate_limit(RateLimit());
+    Logger::info("pending");
+    check("reconfigure", "[INFO] pending\n[INFO] pending\n[INFO] pending\n[INFO] message repeated 2 times: pending\n[INFO] pending\n");
+
+    Logger::set_sinks({colorterm::make_stream_sink(std::cerr)});
+    std::cout << "Rate limit: " << (failures == 0 ? "suppressed lines and repeat summaries match the limits" : "checks failed") << "\n";
+    return failures;
+}
+
+// Logs plain, formatted and _HERE lines, including doubles and debug lines below the output
+// level, from four threads into a four-shard flight recorder, then a fatal line, which dumps
+// it. Checks that the dump is in time order, that it holds each thread's lines in call order
+// as the text logger wrote them (with a custom level label), plus the filtered debug lines,
+// and that it ends with the fatal line. Returns the number of failed checks.
+size_t verify_flight_recorder() {
+    using colorterm::Logger;
+    std::string dir = std::filesystem::temp_directory_path().string() + "/colorterm_verify_" + std::to_string(std::random_device()());
+    std::filesystem::create_directories(dir);
+    auto memory = std::make_shared<colorterm::LogMemory>();
+    Logger::set_sinks({colorterm::make_memory_sink(memory)});
+    Logger::set_timestamp(colorterm::LogTimestamp::none);
+    Logger::set_level(colorterm::LogLevel::info);
+    colorterm::_internal::setLogLevelMessage(colorterm::LogLevel::info, "NOTE");
+    Logger::set_flight_recorder_output(dir + "/dump.txt");
+    Logger::enable_flight_recorder(4096, 256, 4);
+    size_t failures = 0;
+    auto fail = [&](const std::string& what) {
+        std::cout << "Flight recorder: " << what << "\n";
+        ++failures;
+    };
+
+    const unsigned threads = 4;
+    const int per_thread = 200;
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([t] {
+            for (int n = 0; n < per_thread; ++n) {
+                switch (n % 5) {
+                    case 0: Logger::info("thread" + std::to_string(t) + " plain " + std::to_string(n)); break;
+                    case 1: Logger::warn(COLORTERM_FMT("thread{} fmt {} {} {}"), t, n, 1.5 * n + 0.25, -7); break;
+                    case 2: Logger::error(COLORTERM_FMT("thread{} exp {} {} {}"), t, 1e-7 * n, 123456789.0 + n, 999999.5); break;
+                    case 3: COLORTERM_INFO_HERE(COLORTERM_FMT("thread{} here {} {}"), t, n, std::string("s")); break;
+                    case 4: Logger::debug(COLORTERM_FMT("thread{} debug {} {}"), t, n, 0.1); break;
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    Logger::fatal("verify fatal");
+
+    std::ifstream in(dir + "/dump.txt", std::ios::binary);
+    std::vector<std::string> dumped;
+    bool banner = false;
+    bool footer = false;
+    int64_t last_time = -1;
+    for (std::string line; std::getline(in, line);) {
+        if (line == "---- flight recorder ----") {
+            banner = true;
+        } else if (line == "---- end of flight recorder ----") {
+            footer = true;
+        } else if (banner && !footer) {
+            // "+<seconds>.<microseconds> " precedes the line as the text logger writes it
+            size_t space = line.find(' ');
+            size_t dot = line.find('.');
+            if (line[0] != '+' || dot == std::string::npos || space != dot + 7) {
+                fail("no uptime on \"" + escape_control(line) + "\"");
+                continue;
+            }
+            int64_t time = std::stoll(line.substr(1, dot - 1)) * 1000000 + std::stoll(line.substr(dot + 1, 6));
+            if (time < last_time) fail("\"" + escape_control(line) + "\" is dumped after a later record");
+            last_time = std::max(last_time, time);
+            dumped.push_back(line.substr(space + 1));
+        }
+    }
+    if (!banner || !footer) fail("the dump after the fatal line is missing or incomplete");
+    if (dumped.empty() || dumped.back() != "[FATAL] verify fatal") fail("the dump does not end with the fatal line");
+
+    // Each thread's dumped lines, less the debug ones, must be what the text logger wrote for it
+    std::vector<std::string> written;
+    std::istringstream text(memory->contents());
+    for (std::string line; std::getline(text, line);) written.push_back(line);
+    for (unsigned t = 0; t < threads; ++t) {
+        std::string tag = "thread" + std::to_string(t) + " ";
+        std::vector<std::string> from_dump, from_text;
+        size_t debug = 0;
+        for (const auto& line : dumped) {
+            if (line.find(tag) == std::string::npos) continue;
+            if (line.rfind("[DEBUG] ", 0) == 0) ++debug;
+            else from_dump.push_back(line);
+        }
+        for (const auto& line : written) {
+            if (line.find(tag) != std::string::npos) from_text.push_back(line);
+        }
+        if (debug != per_thread / 5) fail(tag + "has " + std::to_string(debug) + " debug lines in the dump instead of " + std::to_string(per_thread / 5));
+        if (from_text.size() != per_thread / 5 * 4 || from_dump != from_text) {
+            std::string report = tag + "is dumped as\n";
+            for (const auto& line : from_dump) report += escape_control(line) + "\n";
+            report += "but written as\n";
+            for (const auto& line : from_text) report += escape_control(line) + "\n";
+            fail(report);
+        }
+    }
+    if (memory->contents().find("[NOTE] thread0 plain 0\n") == std::string::npos) fail("the custom info label is not used");
+
+    Logger::disable_flight_recorder();
+    Logger::set_flight_recorder_output(2);
+    colorterm::_internal::setLogLevelMessage(colorterm::LogLevel::info, "INFO");
+    Logger::set_level(colorterm::LogLevel::trace);
+    Logger::set_sinks({colorterm::make_stream_sink(std::cerr)});
+    std::filesystem::remove_all(dir);
+    std::cout << "Flight recorder: " << (failures == 0 ? "the dump after a fatal line matches the logged lines in time order" : "checks failed") << "\n";
+    return failures;
+}
+
+// Logs through a size-rotated file sink next to plain and coloured memory sinks, then an
+// interval-rotated one; checks that the rotated files hold the plain text in order, split on
+// whole lines, and that the coloured sink differs from the plain one only by colour escapes.
+// Returns the number of failed checks.
+size_t verify_log_sinks() {
+    using colorterm::Logger;
+    std::string dir = std::filesystem::temp_directory_path().string() + "/colorterm_verify_" + std::to_string(std::random_device()());
+    std::filesystem::create_directories(dir);
+    size_t failures = 0;
+    auto fail = [&](const std::string& what) {
+        std::cout << "Log sinks: " << what << "\n";
+        ++failures;
+    };
+    auto read = [](const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        std::ostringstream text;
+        text << in.rdbuf();
+        return text.str();
+    };
+    auto exists = [](const std::string& path) { return std::filesystem::exists(path); };
+    Logger::set_timestamp(colorterm::LogTimestamp::none);
+
+    // 60 lines of 22 to 25 bytes rotate a 200-byte file about a dozen times, more than max_files
+    const std::string path = dir + "/size.log";
+    colorterm::LogRotation by_size;
+    by_size.max_bytes = 200;
+    by_size.max_files = 3;
+    auto plain = std::make_shared<colorterm::LogMemory>();
+    auto colored = std::make_shared<colorterm::LogMemory>();
+    Logger::set_sinks({colorterm::make_rotating_file_sink(path, by_size),
+                       colorterm::make_memory_sink(plain),
+                       colorterm::make_memory_sink(colored, colorterm::ColorPolicy::always)});
+    for (int n = 0; n < 60; ++n) {
+        if (n % 3 == 0) Logger::info("line " + std::to_string(n));
+        else if (n % 3 == 1) Logger::warn(COLORTERM_FMT("line {}"), n);
+        else Logger::error("line " + std::to_string(n));
+    }
+    Logger::flush();
+    Logger::set_sinks({colorterm::make_stream_sink(std::cerr)});
+
+    std::string expected;
+    for (int n = 0; n < 60; ++n) {
+        expected += std::string(n % 3 == 0 ? "[INFO] " : n % 3 == 1 ? "[WARNING] " : "[ERROR] ") + "line " + std::to_string(n) + "\n";
+    }
+    if (plain->contents() != expected) fail("plain sink wrote\n" + escape_control(plain->contents()) + "instead of\n" + escape_control(expected));
+
+    std::string stripped;
+    std::string text = colored->contents();
+    for (size_t i = 0; i < text.size();) {
+        if (text[i] == '\033') {
+            size_t end = text.find('m', i);
+            if (end == std::string::npos) break;
+            i = end + 1;
+        } else {
+            stripped.push_back(text[i++]);
+        }
+    }
+    if (stripped != expected || std::count(text.begin(), text.end(), '\033') < 2 * 60) {
+        fail("coloured sink wrote\n" + escape_control(text) + "which is not the plain text with colour escapes added");
+    }
+
+    std::string rotated;
+    for (size_t i = by_size.max_files; i >= 1; --i) {
+        std::string file = read(path + "." + std::to_string(i));
+        if (file.empty()) fail(path + "." + std::to_string(i) + " is missing or empty");
+        if (file.size() > by_size.max_bytes) fail(path + "." + std::to_string(i) + " holds " + std::to_string(file.size()) + " bytes, over the limit");
+        if (!file.empty() && file.back() != '\n') fail(path + "." + std::to_string(i) + " does not end on a whole line");
+        rotated += file;
+    }
+    rotated += read(path);
+    if (exists(path + "." + std::to_string(by_size.max_files + 1))) fail("more than max_files rotated files were kept");
+    if (rotated.size() > expected.size() || expected.compare(expected.size() - rotated.size(), rotated.size(), rotated) != 0 || rotated.find("[INFO] line 0\n") != std::string::npos) {
+        fail("the rotated files hold\n" + escape_control(rotated) + "which is not the end of the plain text");
+    }
+
+    // A line logged after the interval has passed goes to a new file
+    const std::string timed = dir + "/interval.log";
+    colorterm::LogRotation by_time;
+    by_time.max_bytes = 0;
+    by_time.interval = std::chrono::seconds(1);
+    Logger::set_sinks({colorterm::make_rotating_file_sink(timed, by_time)});
+    Logger::info("before");
+    Logger::info("still before");
+    Logger::flush();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    Logger::info("after");
+    Logger::flush();
+    Logger::set_sinks({colorterm::make_stream_sink(std::cerr)});
+    if (read(timed + ".1") != "[INFO] before\n[INFO] still before\n" || read(timed) != "[INFO] after\n" || exists(timed + ".2")) {
+        fail("interval rotation left \"" + escape_control(read(timed + ".1")) + "\" and \"" + escape_control(read(timed)) + "\"");
+    }
+
+    std::filesystem::remove_all(dir);
+    std::cout << "Log sinks: " << (failures == 0 ? "rotated files and per-sink colour output match the logged lines" : "checks failed") << "\n";
+    return failures;
+}
+
+// Logs plain, formatted, oversized and _HERE records from several threads into a sink that
+// stalls on every write, in sync mode and under each async overflow policy; returns the
+// number of lines found out of their thread's call order. Also checks that a small async
+// capacity makes the drop policies discard records, and that none goes missing uncounted.
+size_t verify_logger_order() {
+    using colorterm::Logger;
+    using colorterm::OverflowPolicy;
+    auto memory = std::make_shared<colorterm::LogMemory>();
+    Logger::set_sinks({colorterm::LogSink{[memory](std::string_view text) {
+        memory->append(text);
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }, nullptr, false}});
+    const std::string padding(20000, 'x');
+    const unsigned threads = 4;
+    const size_t per_thread = 300;
+    auto log_thread = [&](unsigned t) {
+        for (size_t n = 0; n < per_thread; ++n) {
+            switch (n % 6) {
+                case 0: Logger::info("seq " + std::to_string(t) + " " + std::to_string(n)); break;
+                case 1: Logger::info(COLORTERM_FMT("seq {} {}"), t, n); break;
+                case 2: Logger::info(COLORTERM_FMT("seq {} {} {}"), t, n, padding); break;
+                case 3: Logger::info("seq " + std::to_string(t) + " " + std::to_string(n) + " " + padding); break;
+                case 4: COLORTERM_INFO_HERE(COLORTERM_FMT("seq {} {}"), t, n); break;
+                case 5: COLORTERM_INFO_HERE("seq " + std::to_string(t) + " " + std::to_string(n)); break;
+            }
+        }
+    };
+    size_t out_of_order = 0;
+    const char* modes[] = {"sync", "async block", "async drop", "async drop_oldest"};
+    for (int mode = 0; mode < 4; ++mode) {
+        memory->clear();
+        if (mode == 1) Logger::enable_async(1 << 16, OverflowPolicy::block);
+        if (mode == 2) Logger::enable_async(1 << 16, OverflowPolicy::drop);
+        if (mode == 3) Logger::enable_async(1 << 16, OverflowPolicy::drop_oldest);
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; ++t) workers.emplace_back(log_thread, t);
+        for (auto& worker : workers) worker.join();
+        Logger::flush();
+        Logger::disable_async();
+        std::vector<long> last(threads, -1);
+        size_t lines = 0;
+        size_t misplaced = 0;
+        std::istringstream text(memory->contents());
+        for (std::string line; std::getline(text, line);) {
+            size_t at = line.find("seq ");
+            if (at == std::string::npos) continue;
+            unsigned t = 0;
+            long n = 0;
+            std::istringstream(line.substr(at + 4, 32)) >> t >> n;
+            if (t >= threads || n <= last[t]) ++misplaced;
+            if (t < threads) last[t] = n;
+            ++lines;
+        }
+        // The drop policies may discard records, but never reorder the ones they keep
+        size_t expected = threads * per_thread;
+        if (misplaced != 0 || (mode < 2 && lines != expected)) {
+            std::cout << "Logger order (" << modes[mode] << "): " << misplaced << " lines out of order, " << lines << " of " << expected << " written\n";
+        }
+        out_of_order += misplaced + (mode < 2 ? expected - std::min(lines, expected) : 0);
+    }
+    for (OverflowPolicy policy : {OverflowPolicy::drop, OverflowPolicy::drop_oldest}) {
+        memory->clear();
+        uint64_t dropped = Logger::dropped_count();
+        Logger::enable_async(16, policy);
+        for (size_t n = 0; n < 1000; ++n) Logger::info(COLORTERM_FMT("bounded {}"), n);
+        Logger::flush();
+        Logger::disable_async();
+        dropped = Logger::dropped_count() - dropped;
+        std::string text = memory->contents();
+        size_t lines = static_cast<size_t>(std::count(text.begin(), text.end(), '\n'));
+        if (dropped == 0 || lines + dropped != 1000) {
+            std::cout << "Logger capacity (" << (policy == OverflowPolicy::drop ? "drop" : "drop_oldest") << "): " << lines << " lines written and " << dropped
+                      << " dropped of 1000 at capacity 16\n";
+            ++out_of_order;
+        }
+    }
+    Logger::set_sinks({colorterm::make_stream_sink(std::cerr)});
+    std::cout << "Logger order: " << (out_of_order == 0 ? "every thread's lines in call order" : "lines out of order") << "\n";
+    return out_of_order;
+}
+
+struct LoggerTiming {
+    double caller_ns = 0;       // per call, as seen by the logging thread
+    double lines_per_second = 0; // calls plus draining everything to the output
+};
+
+// Caller cost is timed over bursts of 256 calls, each followed by an untimed flush, so in
+// async mode it never includes waiting for a full buffer; throughput is timed over one
+// run of all the calls plus the final flush
+template <typename Func>
+LoggerTiming time_logger(size_t iterations, Func fn) {
+    using namespace std::chrono;
+    constexpr size_t burst = 256;
+    LoggerTiming timing;
+    int64_t caller = 0;
+    for (size_t done = 0; done < iterations; done += burst) {
+        size_t end = std::min(iterations, done + burst);
+        auto start = steady_clock::now();
+        for (size_t i = done; i < end; ++i) fn(i);
+        caller += duration_cast<nanoseconds>(steady_clock::now() - start).count();
+        colorterm::Logger::flush();
+    }
+    timing.caller_ns = caller / (double)iterations;
+    auto start = steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) fn(i);
+    colorterm::Logger::flush();
+    timing.lines_per_second = iterations / duration<double>(steady_clock::now() - start).count();
+    return timing;
+}
+
+void logger_benchmark(size_t iterations) {
+    using colorterm::Logger;
+    NullBuffer null_buffer;
+    std::streambuf* saved = std::cerr.rdbuf(&null_buffer);
+    auto string_message = [](size_t i) { Logger::info("request " + std::to_string(i) + " took " + std::to_string(i % 100) + " ms"); };
+    auto format_message = [](size_t i) { Logger::info(COLORTERM_FMT("request {} took {} ms"), i, i % 100); };
+
+    LoggerTiming sync_string = time_logger(iterations, string_message);
+    LoggerTiming sync_deferred = time_logger(iterations, format_message);
+    Logger::enable_async(1 << 16);
+    LoggerTiming async_string = time_logger(iterations, string_message);
+    LoggerTiming async_deferred = time_logger(iterations, format_message);
+    Logger::disable_async();
+
+    std::cerr.rdbuf(saved);
+    auto report = [](const char* name, const LoggerTiming& timing) {
+        std::cout << name << std::setw(8) << timing.caller_ns << " ns/call" << std::setw(10) << timing.lines_per_second / 1e6 << " M lines/s\n";
+    };
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "                                 caller      drained\n";
+    report("Logger sync, string message:   ", sync_string);
+    report("Logger sync, format arguments: ", sync_deferred);
+    report("Logger async, string message:  ", async_string);
+    report("Logger async, deferred format: ", async_deferred);
+}
+
+// Total lines per second with `threads` threads sharing `iterations` log calls
+double logger_throughput(size_t iterations, unsigned threads) {
+    using namespace std::chrono;
+    std::vector<std::thread> workers;
+    size_t per_thread = iterations / threads;
+    auto start = steady_clock::now();
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([per_thread] {
+            for (size_t i = 0; i < per_thread; ++i) colorterm::Logger::info(COLORTERM_FMT("request {} took {} ms"), i, i % 100);
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    colorterm::Logger::flush();
+    double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+    return per_thread * threads / seconds;
+}
+
+void logger_thread_benchmark(size_t iterations) {
+    using colorterm::Logger;
+    NullBuffer null_buffer;
+    std::streambuf* saved = std::cerr.rdbuf(&null_buffer);
+
+    std::vector<std::string> rows;
+    for (unsigned threads = 1; threads <= 64; threads *= 2) {
+        double per_line = logger_throughput(iterations, threads);
+        Logger::enable_staging();
+        double staged = logger_throughput(iterations, threads);
+        Logger::disable_staging();
+        std::ostringstream row;
+        row << std::fixed << std::setprecision(2) << std::setw(7) << threads << std::setw(16) << per_line / 1e6 << std::setw(16) << staged / 1e6;
+        rows.push_back(row.str());
+    }
+
+    std::cerr.rdbuf(saved);
+    std::cout << "Logger throughput (million lines/s)\n";
+    std::cout << "threads        per-line          staged\n";
+    for (const auto& row : rows) std::cout << row << "\n";
+}
+
+void timestamp_benchmark(size_t iterations) {
+    using namespace std::chrono;
+    using colorterm::TimestampPrecision;
+    std::string out;
+    int64_t base = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+    // Lines 1 µs apart, so the cache re-renders once every million lines
+    auto run = [&](auto&& format) {
+        auto start = steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            out.clear();
+            format(base + static_cast<int64_t>(i) * 1000);
+        }
+        return duration_cast<nanoseconds>(steady_clock::now() - start).count() / (double)iterations;
+    };
+
+    colorterm::_internal::TimestampCache cache;
+    double cached_ms = run([&](int64_t ns) { cache.append(out, ns, TimestampPrecision::milliseconds); });
+    double cached_us = run([&](int64_t ns) { cache.append(out, ns, TimestampPrecision::microseconds); });
+    double naive = run([&](int64_t ns) {
+        std::time_t t = static_cast<std::time_t>(ns / 1000000000);
+        std::tm tm{};
+        localtime_r(&t, &tm);
+        char text[40];
+        size_t n = std::strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm);
+        n += std::snprintf(text + n, sizeof(text) - n, ".%03d", static_cast<int>(ns % 1000000000 / 1000000));
+        out.append(text, n);
+    });
+    double clock_read = run([&](int64_t) { out.push_back(static_cast<char>(steady_clock::now().time_since_epoch().count())); });
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "Cached timestamp (ms):      " << cached_ms << " ns/line\n";
+    std::cout << "Cached timestamp (us):      " << cached_us << " ns/line\n";
+    std::cout << "strftime every line:        " << naive << " ns/line\n";
+    std::cout << "steady_clock::now() capture: " << clock_read << " ns/line\n";
+}
+
+// Access-log style text of at least `bytes` bytes
+std::string make_log_text(size_t bytes) {
+    const char* levels[] = {"INFO", "DEBUG", "WARN", "INFO", "ERROR"};
+    std::string text;
+    for (size_t i = 0; text.size() < bytes; ++i) {
+        text += "2024-05-17 14:03:" + std::to_string(10 + i % 50) + ".123 [" + levels[i % 5] + "] http.server: request_id=" +
+                std::to_string(100000 + i * 7) + " method=GET path=\"/api/v1/items/" + std::to_string(i % 977) +
+                "\" status=200 latency_ms=" + std::to_string(i % 250) + " user_agent=\"curl/8.4.0\" {cache: hit}\n";
+    }
+    return text;
+}
+
+// Only brackets, braces, quotes and '=' are mapped, as with a typical log theme
+colorterm::_internal::ColorMapping make_log_theme() {
+    colorterm::_internal::ColorMapping theme;
+    theme.insert("brackets", "[]", "\033[36m");
+    theme.insert("braces", "{}", "\033[35m");
+    theme.insert("quotes", "\"", "\033[33m");
+    theme.insert("equals", "=", "\033[90m");
+    return theme;
+}
+
+// make_log_theme() as a compile-time theme
+inline constexpr colorterm::ThemeEntry static_log_theme[] = {{"[]", "\033[36m"}, {"{}", "\033[35m"}, {"\"", "\033[33m"}, {"=", "\033[90m"}};
+
+// Theme application over ~1 MB of log text per iteration
+void theme_benchmark(size_t iterations) {
+    using namespace std::chrono;
+    using colorterm::_internal::ByteClass;
+    std::string text = make_log_text(1 << 20);
+    colorterm::_internal::ColorMapping theme = make_log_theme();
+    // Plus multi-character tokens: levels before the first ':', words after it
+    colorterm::_internal::ColorMapping token_theme = theme;
+    token_theme.insert("ERROR", "", "\033[31m", true);
+    token_theme.insert("WARN", "", "\033[33m", true);
+    token_theme.insert("GET", "", "\033[32m", false, true);
+    token_theme.insert("status=200", "", "\033[32m", false, true);
+    token_theme.insert("timeout", "", "\033[31m", false, true);
+    // TUI output with box-drawing and arrow glyphs, mapped by code point
+    std::string tui;
+    while (tui.size() < text.size()) tui += "│ 14:03:10 → worker-3 ── ok │ [INFO] queue=12 ├──┤ done\n";
+    tui.resize(text.size());
+    colorterm::_internal::ColorMapping glyph_theme = theme;
+    glyph_theme.insert("box", "│─├┤", "\033[90m");
+    glyph_theme.insert("arrow", "→", "\033[33m");
+    ByteClass mapped;
+    for (char c : std::string("[]{}\"=")) mapped.add(static_cast<unsigned char>(c));
+    ByteClass sparse;
+    for (char c : std::string("[]")) sparse.add(static_cast<unsigned char>(c));
+
+    size_t sink = 0;
+    auto run = [&](auto&& pass) {
+        auto start = steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) pass();
+        double seconds = duration<double>(steady_clock::now() - start).count();
+        return static_cast<double>(text.size()) * static_cast<double>(iterations) / seconds / 1e9;
+    };
+    auto scan = [&](auto&& find, const ByteClass& set) {
+        const char* end = text.data() + text.size();
+        for (const char* p = text.data(); p != end; ++p) {
+            p = find(p, end, set);
+            if (p == end) break;
+            ++sink;
+        }
+    };
+    double scalar = run([&] { scan(colorterm::_internal::find_byte_class_scalar, mapped); });
+    double vector = run([&] { scan(colorterm::_internal::find_byte_class, mapped); });
+    double sparse_scalar = run([&] { scan(colorterm::_internal::find_byte_class_scalar, sparse); });
+    double sparse_vector = run([&] { scan(colorterm::_internal::find_byte_class, sparse); });
+    std::string out;
+    double apply = run([&] {
+        out.clear();
+        theme.apply_to(out, text);
+        sink += out.size();
+    });
+    double fixed = run([&] {
+        out.clear();
+        colorterm::StaticTheme<static_log_theme>::apply_to(out, text);
+        sink += out.size();
+    });
+    double tokens = run([&] {
+        out.clear();
+        token_theme.apply_to(out, text);
+        sink += out.size();
+    });
+    double glyphs = run([&] {
+        out.clear();
+        glyph_theme.apply_to(out, tui);
+        sink += out.size();
+    });
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Scan for theme bytes (scalar):   " << scalar << " GB/s\n";
+    std::cout << "Scan for theme bytes (vector):   " << vector << " GB/s\n";
+    std::cout << "Scan for '[' and ']' (scalar):   " << sparse_scalar << " GB/s\n";
+    std::cout << "Scan for '[' and ']' (vector):   " << sparse_vector << " GB/s\n";
+    std::cout << "ColorMapping::apply_to (theme):  " << apply << " GB/s\n";
+    std::cout << "StaticTheme::apply_to (theme):   " << fixed << " GB/s\n";
+    std::cout << "... with multi-char tokens:      " << tokens << " GB/s\n";
+    std::cout << "... on TUI text, UTF-8 glyphs:   " << glyphs << " GB/s\n";
+    if (sink == 0) std::cout << "\n";
+}
+
+// ColorMapping::apply_parallel over 64 MB of log text per iteration, from 1 thread up to
+// twice the core count
+void theme_thread_benchmark(size_t iterations) {
+    using namespace std::chrono;
+    std::string text = make_log_text(64 << 20);
+    colorterm::_internal::ColorMapping theme = make_log_theme();
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    double base = 0;
+    std::cout << std::fixed << std::setprecision(2);
+    for (size_t threads = 1; threads <= 2 * cores; threads *= 2) {
+        size_t bytes = 0;
+        auto start = steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            theme.apply_parallel(text, [&](std::string_view piece) { bytes += piece.size(); }, threads);
+        }
+        double rate = static_cast<double>(text.size()) * static_cast<double>(iterations) / duration<double>(steady_clock::now() - start).count() / 1e9;
+        if (threads == 1) base = rate;
+        std::cout << std::setw(3) << threads << " threads: " << rate << " GB/s (" << rate / base << "x)" << (bytes == 0 ? " " : "") << "\n";
+    }
+}
+
+// Highlighter corpora of at least `bytes` bytes each: logfmt, JSON lines and free-form
+// text with IPs and UUIDs, in the shapes common service logs have
+std::vector<std::pair<std::string, std::string>> make_highlight_corpus(size_t bytes) {
+    const char* levels[] = {"info", "debug", "warn", "info", "error"};
+    const char* upper[] = {"INFO", "DEBUG", "WARN", "INFO", "ERROR"};
+    auto uuid = [](size_t i) {
+        char buffer[40];
+        std::snprintf(buffer, sizeof(buffer), "%08zx-%04zx-4%03zx-a%03zx-%012zx", i * 2654435761u % 0xffffffffu, i % 0xffff, i % 0xfff, (i * 7) % 0xfff, i * 40503);
+        return std::string(buffer);
+    };
+    std::string logfmt, json, text;
+    for (size_t i = 0; logfmt.size() < bytes; ++i) {
+        logfmt += "ts=2024-05-17T14:03:" + std::to_string(10 + i % 50) + ".123Z level=" + levels[i % 5] + " msg=\"request served\" method=GET path=/api/v1/items/" +
+                  std::to_string(i % 977) + " status=200 duration=" + std::to_string(i % 250) + "ms bytes=" + std::to_string(1000 + i * 13 % 90000) +
+                  " remote=10.0." + std::to_string(i % 256) + "." + std::to_string(i * 7 % 256) + ":443 trace_id=" + uuid(i) + "\n";
+    }
+    for (size_t i = 0; json.size() < bytes; ++i) {
+        json += "{\"time\":\"2024-05-17T14:03:" + std::to_string(10 + i % 50) + ".123+02:00\",\"level\":\"" + levels[i % 5] +
+                "\",\"msg\":\"cache lookup finished\",\"hit\":true,\"keys\":" + std::to_string(i % 64) + ",\"ratio\":0." + std::to_string(i % 1000) +
+                ",\"request\":\"" + uuid(i) + "\",\"peer\":\"fe80::" + std::to_string(i % 9999) + ":1ff:fe23\"}\n";
+    }
+    for (size_t i = 0; text.size() < bytes; ++i) {
+        text += "2024-05-17 14:03:" + std::to_string(10 + i % 50) + ".123 [" + upper[i % 5] + "] worker-" + std::to_string(i % 16) +
+                ": accepted connection from 192.168." + std::to_string(i % 256) + "." + std::to_string(i * 3 % 256) +
+                " after " + std::to_string(i % 30) + " retries, it's queued behind session " + uuid(i) + " for user 'alice'\n";
+    }
+    std::string mixed;
+    for (size_t offset = 0; offset < bytes; offset += 4096) {
+        for (const std::string* corpus : {&logfmt, &json, &text}) {
+            size_t from = corpus->find('\n', offset) + 1;
+            size_t to = corpus->find('\n', offset + 4096) + 1;
+            if (from != 0 && to != 0) mixed.append(*corpus, from, to - from);
+        }
+    }
+    return {{"logfmt", logfmt}, {"JSON", json}, {"plain text", text}, {"mixed", mixed}};
+}
+
+// LogHighlighter::apply_to over ~16 MB of each corpus per iteration, default colours
+void highlight_benchmark(size_t iterations) {
+    using namespace std::chrono;
+    colorterm::_internal::ColorMapping theme;
+    colorterm::_internal::LogHighlighter highlighter(theme);
+    std::string out;
+    size_t sink = 0;
+    std::cout << std::fixed << std::setprecision(1);
+    for (const auto& [name, text] : make_highlight_corpus(16 << 20)) {
+        auto start = steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            out.clear();
+            highlighter.apply_to(out, text);
+            sink += out.size();
+        }
+        double seconds = duration<double>(steady_clock::now() - start).count();
+        double rate = static_cast<double>(text.size()) * static_cast<double>(iterations) / seconds / 1e6;
+        std::cout << std::left << std::setw(12) << name << std::right << rate << " MB/s (" << static_cast<double>(out.size()) / static_cast<double>(text.size()) << "x output)\n";
+    }
+    if (sink == 0) std::cout << "\n";
+}
+
 void print_comparison(const std::string& name, long long colorterm_duration, long long termcolor_duration) {
 #ifdef USE_TERMCOLOR
     double percentage_diff;
@@ -376,7 +1531,7 @@ void print_comparison(const std::string& name, long long colorterm_duration, lon
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <iterations> [--verify-8bit] [--verify-24bit] [--verify-predefined] [--verify-all] [--null] [--termcolor]\n";
+        std::cerr << "Usage: " << argv[0] << " <iterations> [--verify-8bit] [--verify-24bit] [--verify-predefined] [--verify-theme-stream] [--verify-theme-parallel] [--verify-theme-binary] [--verify-static-theme] [--verify-canvas] [--verify-logger-order] [--verify-binary-log] [--verify-log-sinks] [--verify-rate-limit] [--verify-flight-recorder] [--verify-highlight] [--verify-all] [--null] [--termcolor] [--bench-logger] [--bench-logger-threads] [--bench-timestamp] [--bench-theme] [--bench-theme-threads] [--bench-highlight]\n";
         return 1;
     }
 
@@ -391,11 +1546,44 @@ int main(int argc, char* argv[]) {
         } else if (option == "--verify-predefined") {
             verify_color_functions();
             return 0;
+        } else if (option == "--verify-theme-stream") {
+            return verify_theme_stream() == 0 ? 0 : 1;
+        } else if (option == "--verify-theme-parallel") {
+            return verify_theme_parallel() == 0 ? 0 : 1;
+        } else if (option == "--verify-theme-binary") {
+            return verify_theme_binary() == 0 ? 0 : 1;
+        } else if (option == "--verify-static-theme") {
+            return verify_static_theme() == 0 ? 0 : 1;
+        } else if (option == "--verify-canvas") {
+            return verify_canvas() == 0 ? 0 : 1;
+        } else if (option == "--verify-binary-log") {
+            return verify_binary_log() == 0 ? 0 : 1;
+        } else if (option == "--verify-logger-order") {
+            return verify_logger_order() == 0 ? 0 : 1;
+        } else if (option == "--verify-log-sinks") {
+            return verify_log_sinks() == 0 ? 0 : 1;
+        } else if (option == "--verify-rate-limit") {
+            return verify_rate_limit() == 0 ? 0 : 1;
+        } else if (option == "--verify-flight-recorder") {
+            return verify_flight_recorder() == 0 ? 0 : 1;
+        } else if (option == "--verify-highlight") {
+            return verify_highlight() == 0 ? 0 : 1;
         } else if (option == "--verify-all") {
             verify_full_8bit_spectrum();
             verify_full_24bit_spectrum();
             verify_color_functions();
-            return 0;
+            size_t failures = verify_theme_stream();
+            failures += verify_theme_parallel();
+            failures += verify_theme_binary();
+            failures += verify_static_theme();
+            failures += verify_canvas();
+            failures += verify_logger_order();
+            failures += verify_binary_log();
+            failures += verify_log_sinks();
+            failures += verify_rate_limit();
+            failures += verify_flight_recorder();
+            failures += verify_highlight();
+            return failures == 0 ? 0 : 1;
         } else {
             std::cerr << "Unknown verification option: " << option << "\n";
             return 1;
@@ -411,6 +1599,12 @@ int main(int argc, char* argv[]) {
     }
 
     bool compare_with_termcolor = false;
+    bool bench_logger = false;
+    bool bench_logger_threads = false;
+    bool bench_timestamp = false;
+    bool bench_theme = false;
+    bool bench_theme_threads = false;
+    bool bench_highlight = false;
     NullStream null_stream;
     std::ostream* output_stream = &std::cout;
 
@@ -420,9 +1614,51 @@ int main(int argc, char* argv[]) {
             output_stream = &null_stream;
         } else if (arg == "--termcolor") {
             compare_with_termcolor = true;
+        } else if (arg == "--bench-logger") {
+            bench_logger = true;
+        } else if (arg == "--bench-logger-threads") {
+            bench_logger_threads = true;
+        } else if (arg == "--bench-timestamp") {
+            bench_timestamp = true;
+        } else if (arg == "--bench-theme") {
+            bench_theme = true;
+        } else if (arg == "--bench-theme-threads") {
+            bench_theme_threads = true;
+        } else if (arg == "--bench-highlight") {
+            bench_highlight = true;
         }
     }
 
+    if (bench_logger) {
+        logger_benchmark(iterations);
+        return 0;
+    }
+
+    if (bench_logger_threads) {
+        logger_thread_benchmark(iterations);
+        return 0;
+    }
+
+    if (bench_timestamp) {
+        timestamp_benchmark(iterations);
+        return 0;
+    }
+
+    if (bench_theme) {
+        theme_benchmark(iterations);
+        return 0;
+    }
+
+    if (bench_theme_threads) {
+        theme_thread_benchmark(iterations);
+        return 0;
+    }
+
+    if (bench_highlight) {
+        highlight_benchmark(iterations);
+        return 0;
+    }
+
     long long colorterm_set_color_duration = run_benchmark([](size_t iter, std::ostream& os){ colorterm_color_benchmark(iter, os, 0); }, iterations, *output_stream);
     long long colorterm_named_color_duration = run_benchmark([](size_t iter, std::ostream& os){ colorterm_color_benchmark(iter, os, 1); }, iterations, *output_stream);
     long long colorterm_color_8bit_duration = run_benchmark([](size_t iter, std::ostream& os){ colorterm_color_benchmark(iter, os, 2); }, iterations, *output_stream);
@@ -264,6 +264,9 @@ int main() {
 #define COLORTERM_HPP_
 
 #include <cstdint>
+#include <charconv>
+#include <cmath>
+#include <limits>
 #include <string_view>
 #include <vector>
 #include <algorithm>
@@ -276,6 +279,17 @@ int main() {
 #include <sstream>
 #include <fstream>
 #include <unordered_map>
+#include <map>
+#include <iterator>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
 
 
 // Global flags for color and theme
@@ -292,9 +306,25 @@ bool is_stream_themed = true;
     #define ISATTY(fd) _isatty(_fileno(fd))
 #else
     #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #if defined(__linux__)
+        #include <sys/inotify.h>
+        #include <poll.h>
+    #endif
     #define ISATTY(fd) ::isatty(fileno(fd))
 #endif
 
+// Vector units for the theme byte scanner (find_byte_class). The x86 versions are compiled
+// with target attributes and chosen at runtime, so no -m flags are needed.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #define COLORTERM_SIMD_X86 1
+    #include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    #define COLORTERM_SIMD_NEON 1
+    #include <arm_neon.h>
+#endif
+
 #define CHECK_COLOR_AND_THEME(stream) (is_global_colored && is_global_themed)
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -428,6 +458,73 @@ inline void write_to_streambuf(StreamType& stream, const std::string& str) {
     }
 }
 
+// Minimal writer so the APPLY_*_MACRO helpers can append escapes straight into a std::string
+struct StringWriter {
+    std::string& out;
+    void write(const char* data, std::streamsize size) { out.append(data, static_cast<size_t>(size)); }
+};
+
+template <typename Out>
+inline void append_uint(Out& out, uint64_t value) {
+    char buf[20]; char* p = buf + sizeof(buf);
+    do { *--p = static_cast<char>('0' + value % 10); value /= 10; } while (value != 0);
+    out.append(p, buf + sizeof(buf) - p);
+}
+
+inline void append_utf8(std::string& out, char32_t cp) {
+    if (cp < 0x80) {
+        out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+}
+
+// Decodes the code point at p; returns its length in bytes, or 0 if the sequence is
+// truncated, overlong, a surrogate or otherwise malformed
+inline constexpr size_t decode_utf8(const char* p, const char* end, char32_t& cp) {
+    if (p == end) return 0;
+    unsigned char lead = static_cast<unsigned char>(*p);
+    size_t length = 0;
+    char32_t min = 0;
+    if (lead < 0x80) {
+        cp = lead;
+        return 1;
+    } else if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2, min = 0x80, cp = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3, min = 0x800, cp = lead & 0x0F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4, min = 0x10000, cp = lead & 0x07;
+    } else {
+        return 0;
+    }
+    if (static_cast<size_t>(end - p) < length) return 0;
+    for (size_t i = 1; i < length; ++i) {
+        unsigned char next = static_cast<unsigned char>(p[i]);
+        if ((next & 0xC0) != 0x80) return 0;
+        cp = (cp << 6) | (next & 0x3F);
+    }
+    if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return 0;
+    return length;
+}
+
+// Backs p up to the first byte of the code point it falls inside, so text cut at the
+// result does not end in a partial sequence; stops at begin
+inline const char* utf8_sequence_start(const char* begin, const char* p) {
+    for (int i = 0; i < 3 && p > begin && (static_cast<unsigned char>(*p) & 0xC0) == 0x80; ++i) --p;
+    return p;
+}
+
 template <typename StreamType>
 inline StreamType& operator<<(StreamType& stream, const std::wstring& wstr) {
     if constexpr (std::is_same_v<StreamType, std::basic_ostream<wchar_t>>) {
@@ -917,6 +1014,56 @@ namespace colorterm {
 // LogLevel enum definition
 enum class LogLevel { debug, info, warn, error, fatal, trace, unknown };
 
+// Severity values for COLORTERM_MIN_LOG_LEVEL
+#define COLORTERM_LEVEL_TRACE 0
+#define COLORTERM_LEVEL_DEBUG 1
+#define COLORTERM_LEVEL_INFO 2
+#define COLORTERM_LEVEL_WARN 3
+#define COLORTERM_LEVEL_ERROR 4
+#define COLORTERM_LEVEL_FATAL 5
+
+// Logger calls below this severity compile to nothing
+#ifndef COLORTERM_MIN_LOG_LEVEL
+#define COLORTERM_MIN_LOG_LEVEL COLORTERM_LEVEL_TRACE
+#endif
+
+// What an asynchronous Logger does when its ring buffer is full
+enum class OverflowPolicy { block, drop, drop_oldest };
+
+// When buffered Logger output is flushed to the stream
+enum class FlushPolicy { always, never, on_error, every_bytes, every_interval, explicit_flush };
+
+// Timestamp shown at the start of each log line: local wall-clock time, time since the
+// logger started, or both
+enum class LogTimestamp { none, wall_clock, uptime, both };
+enum class TimestampPrecision { milliseconds, microseconds };
+
+// Rate limiting for repeated log lines, keyed by call site or by message. token_bucket lets
+// `burst` lines through at once and refills at `per_second`; first_n lets the first `first_n`
+// lines of each `interval` through. Fatal lines are never limited.
+enum class RateLimitMode { off, token_bucket, first_n };
+enum class RateLimitKey { call_site, message };
+
+struct RateLimit {
+    RateLimitMode mode = RateLimitMode::off;
+    RateLimitKey key = RateLimitKey::message;
+    double per_second = 10;
+    double burst = 20;
+    uint32_t first_n = 10;
+    std::chrono::milliseconds interval{1000};
+};
+
+// Whether a log sink receives coloured lines; automatic asks is_atty once, when the sink is made
+enum class ColorPolicy { automatic, always, never };
+
+// Destination for formatted log text. write() receives whole lines, already rendered with or
+// without colour escapes according to `colored`; calls are serialized by the Logger.
+struct LogSink {
+    std::function<void(std::string_view)> write;
+    std::function<void()> flush;
+    bool colored = false;
+};
+
 // Configuration storage class
 class Config {
 public:
@@ -1055,293 +1202,4716 @@ inline std::ostream& applyLogLevelColor(std::ostream& os, LogLevel level) {
     return colorterm::_internal::apply_code(os, defaultColors[level].code);
 }
 
+// Fully rendered per-level prefix: "[" colour label reset "] ", or with colorFull the colour
+// opens before the bracket and suffix closes it after the message
+struct LogPrefix {
+    std::string colored;
+    std::string plain;
+    std::string colored_suffix;
+};
+
+inline constexpr size_t log_level_count = static_cast<size_t>(LogLevel::unknown) + 1;
+
+// Immutable once published; indexed by LogLevel
+struct LogPrefixTable {
+    std::array<LogPrefix, log_level_count> levels;
+
+    const LogPrefix& operator[](LogLevel level) const { return levels[static_cast<size_t>(level)]; }
+};
+
+inline LogPrefixTable build_log_prefix_table() {
+    static const ColorDefinition defaultColors[log_level_count] = {
+        colorterm::cyan_def, colorterm::green_def, colorterm::yellow_def, colorterm::red_def,
+        colorterm::magenta_def, colorterm::blue_def, colorterm::white_def
+    };
+    auto& colorConfig = UserColorConfig_Logger();
+    auto& userConfig = UserConfig_Logger();
+    LogPrefixTable table;
+    for (size_t i = 0; i < log_level_count; ++i) {
+        LogLevel level = static_cast<LogLevel>(i);
+        std::string code = defaultColors[i].code;
+        auto colorIt = colorConfig.find(level);
+        if (colorIt != colorConfig.end() && !colorIt->second.code.empty()) {
+            code = colorIt->second.code;
+        }
+        bool colorFull = false;
+        auto it = userConfig.find(level);
+        if (it != userConfig.end()) {
+            auto subIt = it->second.find("colorFull");
+            colorFull = subIt != it->second.end() && subIt->second == "true";
+        }
+        std::string label = logLevelToString(level);
+        LogPrefix& prefix = table.levels[i];
+        prefix.plain = "[" + label + "] ";
+        if (colorFull) {
+            prefix.colored = code + prefix.plain;
+            prefix.colored_suffix = reset_def.code;
+        } else {
+            prefix.colored = "[" + code + label + reset_def.code + "] ";
+        }
+    }
+    return table;
+}
+
+// The current prefix table and a version bumped whenever it is replaced. Never destroyed,
+// so that logging from static destructors still finds it.
+struct LogPrefixTables {
+    std::shared_ptr<const LogPrefixTable> current;
+    std::atomic<uint64_t> version{0};
+};
+
+inline LogPrefixTables& log_prefix_tables() {
+    static LogPrefixTables* tables = new LogPrefixTables;
+    return *tables;
+}
+
+// Guards the level colour and message maps along with the table built from them
+inline std::mutex& log_prefix_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+// Rebuilds and publishes the prefix table; the caller holds log_prefix_mutex()
+inline void rebuild_log_prefix_table_locked() {
+    auto& tables = log_prefix_tables();
+    tables.current = std::make_shared<const LogPrefixTable>(build_log_prefix_table());
+    tables.version.fetch_add(1, std::memory_order_release);
+}
+
+// Each thread caches a reference to the current table and checks it against the version,
+// so a log line costs one atomic load while nothing changes. A replaced table is freed once
+// no thread caches it.
+inline const LogPrefixTable& log_prefix_table() {
+    thread_local bool cache_gone = false;
+    struct Cache {
+        uint64_t version = 0;
+        std::shared_ptr<const LogPrefixTable> table;
+        ~Cache() { cache_gone = true; }
+    };
+    thread_local Cache cache;
+    auto& tables = log_prefix_tables();
+    uint64_t version = tables.version.load(std::memory_order_acquire);
+    if (cache_gone || cache.table == nullptr || cache.version != version) {
+        std::lock_guard<std::mutex> lock(log_prefix_mutex());
+        if (tables.current == nullptr) rebuild_log_prefix_table_locked();
+        // Logging after this thread's cache was destroyed uses the current table directly;
+        // nothing replaces it that late in the thread's life
+        if (cache_gone) return *tables.current;
+        cache.table = tables.current;
+        cache.version = tables.version.load(std::memory_order_relaxed);
+    }
+    return *cache.table;
+}
+
 inline void setLogLevelColor(LogLevel level, ColorDefinition colorDef) {
+    std::lock_guard<std::mutex> lock(log_prefix_mutex());
     UserColorConfig_Logger().insert_or_assign(level, colorDef);
+    rebuild_log_prefix_table_locked();
 }
 
 inline void setLogLevelMessage(LogLevel level, const std::string& message) {
+    std::lock_guard<std::mutex> lock(log_prefix_mutex());
     UserConfig_Logger()[level].insert_or_assign("message", message);
+    rebuild_log_prefix_table_locked();
 }
 
 inline void setColorFullMessage(bool colorFull) {
+    std::lock_guard<std::mutex> lock(log_prefix_mutex());
     auto& userConfig = UserConfig_Logger();
     for (auto level : {LogLevel::debug, LogLevel::info, LogLevel::warn, LogLevel::error, LogLevel::fatal, LogLevel::trace, LogLevel::unknown}) {
         userConfig[level].insert_or_assign("colorFull", colorFull ? "true" : "false");
     }
+    rebuild_log_prefix_table_locked();
 }
-    } // namespace _internal
 
-// Logging class to manage log messages
-class Logger {
-public:
-    // Define logging functions using a macro
-    #define DEFINE_LOG_FUNCTION(level) \
-    static void level(const std::string& msg) { \
-        log(LogLevel::level, msg); \
-    } \
-    static void level(const std::string& file, int line, const std::string& msg) { \
-        log(LogLevel::level, file, line, msg); \
+inline std::atomic<LogTimestamp> log_timestamp_mode{LogTimestamp::none};
+inline std::atomic<TimestampPrecision> log_timestamp_precision{TimestampPrecision::milliseconds};
+// Binary log records always carry a time, whatever the text timestamp mode
+inline std::atomic<bool> binary_log_enabled{false};
+
+// Records carry steady-clock nanoseconds taken at the call; wall-clock time is derived from
+// an offset sampled once, so formatting never has to call the system clock
+struct LogClock {
+    int64_t start_ns;
+    int64_t wall_offset_ns;
+
+    LogClock() {
+        using namespace std::chrono;
+        start_ns = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+        wall_offset_ns = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count() - start_ns;
     }
+};
 
-    DEFINE_LOG_FUNCTION(info)
-    DEFINE_LOG_FUNCTION(debug)
-    DEFINE_LOG_FUNCTION(warn)
-    DEFINE_LOG_FUNCTION(error)
-    DEFINE_LOG_FUNCTION(fatal)
-    DEFINE_LOG_FUNCTION(trace)
+inline const LogClock& log_clock() {
+    static LogClock clock;
+    return clock;
+}
 
-    #undef DEFINE_LOG_FUNCTION
+// Capture time for a record, or 0 when timestamps are off
+inline int64_t log_time_now() {
+    if (log_timestamp_mode.load(std::memory_order_relaxed) == LogTimestamp::none && !binary_log_enabled.load(std::memory_order_relaxed)) return 0;
+    log_clock();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-private:
-    static void log(LogLevel level, const std::string& msg) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        auto& userConfig = _internal::UserConfig_Logger();
-        auto it = userConfig.find(level);
-        bool colorFull = false;
-        
-        if (it != userConfig.end()) {
-            auto subIt = it->second.find("colorFull");
-            if (subIt != it->second.end()) {
-                colorFull = subIt->second == "true";
-            }
-        }
+// Writes value as exactly `width` zero-padded digits ending just before end
+inline void patch_digits(char* end, uint64_t value, int width) {
+    for (int i = 0; i < width; ++i) {
+        *--end = static_cast<char>('0' + value % 10);
+        value /= 10;
+    }
+}
 
-        if (colorFull && CHECK_COLOR_AND_THEME(std::cerr)) {
-            _internal::applyLogLevelColor(std::cerr, level);
-            std::cerr << "[" << _internal::logLevelToString(level) << "] " << msg << colorterm::reset << std::endl;
+// "YYYY-MM-DD HH:MM:SS.mmm[uuu]" formatter; the date and time part is re-rendered only when
+// the second changes, otherwise just the fraction digits are patched in place
+class TimestampCache {
+public:
+    void append(std::string& out, int64_t wall_ns, TimestampPrecision precision) {
+        int64_t second = wall_ns / 1000000000;
+        int64_t fraction = wall_ns % 1000000000;
+        if (fraction < 0) {
+            fraction += 1000000000;
+            --second;
+        }
+        if (second != second_) {
+            std::time_t t = static_cast<std::time_t>(second);
+            std::tm tm{};
+#if defined(_WIN32) || defined(_WIN64)
+            localtime_s(&tm, &t);
+#else
+            localtime_r(&t, &tm);
+#endif
+            std::strftime(text_, sizeof(text_), "%Y-%m-%d %H:%M:%S", &tm);
+            text_[19] = '.';
+            second_ = second;
+        }
+        if (precision == TimestampPrecision::microseconds) {
+            patch_digits(text_ + 26, static_cast<uint64_t>(fraction / 1000), 6);
+            out.append(text_, 26);
         } else {
-            std::cerr << "[";
-            if (CHECK_COLOR_AND_THEME(std::cerr)) {
-                _internal::applyLogLevelColor(std::cerr, level);
-            }
-            std::cerr << _internal::logLevelToString(level) << colorterm::reset << "] " << msg << std::endl;
+            patch_digits(text_ + 23, static_cast<uint64_t>(fraction / 1000000), 3);
+            out.append(text_, 23);
         }
     }
 
-    static void log(LogLevel level, const std::string& file, int line, const std::string& msg) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        auto& userConfig = _internal::UserConfig_Logger();
-        auto it = userConfig.find(level);
-        bool colorFull = false;
-
-        if (it != userConfig.end()) {
-            auto subIt = it->second.find("colorFull");
-            if (subIt != it->second.end()) {
-                colorFull = subIt->second == "true";
-            }
-        }
+private:
+    int64_t second_ = INT64_MIN;
+    char text_[32] = {};
+};
 
-        if (colorFull && CHECK_COLOR_AND_THEME(std::cerr)) {
-            _internal::applyLogLevelColor(std::cerr, level);
-            std::cerr << "[" << _internal::logLevelToString(level) << "] " << file << ":" << line << " " << msg << colorterm::reset << std::endl;
+// Appends the configured timestamp(s) and a trailing space; uptime is "+<seconds>.<fraction>"
+inline void append_log_timestamp(std::string& out, int64_t time_ns) {
+    LogTimestamp mode = log_timestamp_mode.load(std::memory_order_relaxed);
+    if (mode == LogTimestamp::none || time_ns == 0) return;
+    TimestampPrecision precision = log_timestamp_precision.load(std::memory_order_relaxed);
+    const LogClock& clock = log_clock();
+    if (mode == LogTimestamp::wall_clock || mode == LogTimestamp::both) {
+        thread_local TimestampCache cache;
+        cache.append(out, time_ns + clock.wall_offset_ns, precision);
+        out.push_back(' ');
+    }
+    if (mode == LogTimestamp::uptime || mode == LogTimestamp::both) {
+        uint64_t uptime = static_cast<uint64_t>(std::max<int64_t>(time_ns - clock.start_ns, 0));
+        char digits[6];
+        out.push_back('+');
+        append_uint(out, uptime / 1000000000);
+        out.push_back('.');
+        if (precision == TimestampPrecision::microseconds) {
+            patch_digits(digits + 6, uptime % 1000000000 / 1000, 6);
+            out.append(digits, 6);
         } else {
-            std::cerr << "[";
-            if (CHECK_COLOR_AND_THEME(std::cerr)) {
-                _internal::applyLogLevelColor(std::cerr, level);
-            }
-            std::cerr << _internal::logLevelToString(level) << colorterm::reset << "] " << file << ":" << line << " " << msg << std::endl;
+            patch_digits(digits + 3, uptime % 1000000000 / 1000000, 3);
+            out.append(digits, 3);
         }
+        out.push_back(' ');
     }
+}
 
-    static std::mutex mutex_;
-};
+// Renders the "file:line " location text, or nothing when file is empty
+inline void append_log_location(std::string& out, std::string_view file, int line) {
+    if (file.empty()) return;
+    out.append(file);
+    out.push_back(':');
+    append_uint(out, static_cast<uint32_t>(line));
+    out.push_back(' ');
+}
 
-std::mutex Logger::mutex_;
+// Keeps call-site location text for the life of the process. Deferred records and the
+// binary log point at it, and the final drain at exit runs after static objects, the
+// LogSites among them, have been destroyed, so the pool itself is never freed.
+inline std::string_view intern_log_site_text(std::string text) {
+    struct Pool {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<const std::string>> texts;
+    };
+    static Pool* pool = new Pool;
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->texts.push_back(std::make_unique<const std::string>(std::move(text)));
+    return *pool->texts.back();
+}
 
-} // namespace colorterm
+// Appends the timestamp, level prefix and pre-rendered location. The caller fetches the
+// table once per line and passes the same one to append_log_suffix, so a concurrent colour
+// change cannot pair one table's prefix with another's suffix.
+inline void append_log_prefix(std::string& out, const LogPrefixTable& table, LogLevel level, std::string_view location, bool colored, int64_t time_ns) {
+    append_log_timestamp(out, time_ns);
+    const LogPrefix& prefix = table[level];
+    out.append(colored ? prefix.colored : prefix.plain);
+    out.append(location);
+}
 
+inline void append_log_suffix(std::string& out, const LogPrefixTable& table, LogLevel level, bool colored) {
+    if (colored) out.append(table[level].colored_suffix);
+    out.push_back('\n');
+}
 
+// Renders one complete log line, including the trailing newline, into out
+inline void format_log_line(std::string& out, LogLevel level, std::string_view location, std::string_view msg, bool colored, int64_t time_ns) {
+    const LogPrefixTable& table = log_prefix_table();
+    append_log_prefix(out, table, level, location, colored, time_ns);
+    out.append(msg);
+    append_log_suffix(out, table, level, colored);
+}
 
-namespace colorterm {
-namespace _internal {
+// Log text rendered once for each colour policy some sink uses; unused variants stay empty
+struct LogText {
+    std::string colored;
+    std::string plain;
 
+    void clear() {
+        colored.clear();
+        plain.clear();
+    }
 
+    bool empty() const { return colored.empty() && plain.empty(); }
+    size_t size() const { return std::max(colored.size(), plain.size()); }
+};
 
-// custom_regex_replace function to replace all occurrences of a substring in a string
-inline std::string custom_regex_replace(const std::string& str, const std::string& from, const std::string& to) {
-    std::string result = str;
-    size_t start_pos = 0;
-    while ((start_pos = result.find(from, start_pos)) != std::string::npos) {
-        result.replace(start_pos, from.length(), to);
-        start_pos += to.length(); // In case 'to' contains 'from', like replacing 'x' with 'yx'
+constexpr unsigned render_colored = 1;
+constexpr unsigned render_plain = 2;
+
+// Which LogText variants the current sinks need; only the stderr default (coloured) at start
+inline std::atomic<unsigned> log_render_modes{render_colored};
+
+// Calls render(out, colored) for each variant currently needed
+template <typename Render>
+inline void render_log_text(LogText& text, Render&& render) {
+    unsigned modes = log_render_modes.load(std::memory_order_acquire);
+    if (modes & render_colored) render(text.colored, CHECK_COLOR_AND_THEME(std::cerr));
+    if (modes & render_plain) render(text.plain, false);
+}
+
+// Orders levels by severity; LogLevel's declaration order puts trace after fatal
+constexpr int log_severity(LogLevel level) {
+    switch (level) {
+        case LogLevel::trace: return 0;
+        case LogLevel::debug: return 1;
+        case LogLevel::info: return 2;
+        case LogLevel::warn: return 3;
+        case LogLevel::error: return 4;
+        case LogLevel::fatal: return 5;
+        default: return 2;
     }
-    return result;
 }
 
+// Fixed lower-case level names for machine-readable output (labels can be customized)
+constexpr const char* log_level_name(LogLevel level) {
+    switch (level) {
+        case LogLevel::trace: return "trace";
+        case LogLevel::debug: return "debug";
+        case LogLevel::info: return "info";
+        case LogLevel::warn: return "warn";
+        case LogLevel::error: return "error";
+        case LogLevel::fatal: return "fatal";
+        default: return "unknown";
+    }
+}
 
+// Runtime severity floor for output
+inline std::atomic<int> log_threshold{COLORTERM_MIN_LOG_LEVEL};
 
-struct ThemeRGB {
-    uint8_t r, g, b;
-};
+// Lowest severity a call must be evaluated for: log_threshold, or every level while the flight
+// recorder captures them, so that the check before any logging work is a single relaxed load
+inline std::atomic<int> log_active_threshold{COLORTERM_MIN_LOG_LEVEL};
 
-class ColorMapping {
-private:
-    std::unordered_map<char, std::string> charToColorCode;
-    std::unordered_map<std::string, std::string> keyToColorCode;
-    std::unordered_map<std::string, std::string> valueToColorCode;
+inline std::mutex& log_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+// Logger metrics. Per-call counters and the latency histogram live in cache-line-aligned
+// slots shared by a few threads each and are only summed when a snapshot is taken.
+inline std::atomic<bool> log_metrics_enabled{false};
+
+inline size_t bit_width64(uint64_t value) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    return _BitScanReverse64(&index, value) ? index + 1 : 0;
+#else
+    return value == 0 ? 0 : 64 - static_cast<size_t>(__builtin_clzll(value));
+#endif
+}
+
+// HDR-style log-linear buckets: exact below 8 ns, then 8 sub-buckets per power of two,
+// which keeps every bucket within 12.5% of the values it holds
+constexpr size_t latency_bucket_count = 496;
+
+inline size_t latency_bucket(uint64_t ns) {
+    if (ns < 8) return static_cast<size_t>(ns);
+    size_t msb = bit_width64(ns) - 1;
+    return (msb - 2) * 8 + static_cast<size_t>((ns >> (msb - 3)) & 7);
+}
+
+inline uint64_t latency_bucket_upper(size_t bucket) {
+    if (bucket < 8) return bucket;
+    size_t msb = bucket / 8 + 2;
+    uint64_t width = uint64_t{1} << (msb - 3);
+    return ((8 + bucket % 8) << (msb - 3)) + width - 1;
+}
 
+struct alignas(64) LogMetricsSlot {
+    std::array<std::atomic<uint64_t>, log_level_count> messages{};
+    std::array<std::atomic<uint64_t>, latency_bucket_count> latency{};
+    std::atomic<uint64_t> latency_max{0};
+};
+
+class LogMetricsRegistry {
 public:
-    void insert(const std::string& name, const std::string& characters, const std::string& colorCode, bool isKey = false, bool isValue = false) {
-        if (isKey) {
-            keyToColorCode[name] = colorCode;
-        } else if (isValue) {
-            valueToColorCode[name] = colorCode;
-        } else {
-            for (char ch : characters) {
-                charToColorCode[ch] = colorCode;
-            }
-        }
+    static constexpr size_t slot_count = 16;
+
+    LogMetricsSlot& slot() {
+        thread_local size_t index = next_slot_.fetch_add(1, std::memory_order_relaxed) % slot_count;
+        return slots_[index];
     }
 
-    std::string apply(const std::string& text) const {
-        std::ostringstream oss;
-        bool isKey = true;
-        for (char ch : text) {
-            if (ch == ':') isKey = false;
-            auto it = charToColorCode.find(ch);
-            if (it != charToColorCode.end()) {
-                oss << it->second << ch << "\033[0m";
-            } else if (isKey) {
-                oss << apply_key_color(std::string(1, ch));
-            } else {
-                oss << apply_value_color(std::string(1, ch));
-            }
-        }
-        return oss.str();
+    void record_call(LogLevel level, uint64_t ns) {
+        LogMetricsSlot& s = slot();
+        s.messages[static_cast<size_t>(level)].fetch_add(1, std::memory_order_relaxed);
+        s.latency[latency_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = s.latency_max.load(std::memory_order_relaxed);
+        while (ns > max && !s.latency_max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
     }
 
-    std::string apply_key_color(const std::string& key) const {
-        auto it = keyToColorCode.find(key);
-        if (it != keyToColorCode.end()) {
-            return it->second + key + "\033[0m";
-        }
-        return key;
+    void record_mutex_wait(uint64_t ns) {
+        mutex_waits.fetch_add(1, std::memory_order_relaxed);
+        mutex_wait_ns.fetch_add(ns, std::memory_order_relaxed);
     }
 
-    std::string apply_value_color(const std::string& value) const {
-        auto it = valueToColorCode.find(value);
-        if (it != valueToColorCode.end()) {
-            return it->second + value + "\033[0m";
+    void reset() {
+        for (auto& s : slots_) {
+            for (auto& count : s.messages) count.store(0, std::memory_order_relaxed);
+            for (auto& count : s.latency) count.store(0, std::memory_order_relaxed);
+            s.latency_max.store(0, std::memory_order_relaxed);
         }
-        return value;
+        bytes_written.store(0, std::memory_order_relaxed);
+        mutex_waits.store(0, std::memory_order_relaxed);
+        mutex_wait_ns.store(0, std::memory_order_relaxed);
     }
 
-    std::unordered_map<char, std::string> get() const {
-        return charToColorCode;
-    }
+    const std::array<LogMetricsSlot, slot_count>& slots() const { return slots_; }
 
-    std::unordered_map<std::string, std::string> get_key_map() const {
-        return keyToColorCode;
-    }
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> mutex_waits{0};
+    std::atomic<uint64_t> mutex_wait_ns{0};
 
-    std::unordered_map<std::string, std::string> get_value_map() const {
-        return valueToColorCode;
-    }
+private:
+    std::array<LogMetricsSlot, slot_count> slots_;
+    std::atomic<size_t> next_slot_{0};
+};
 
-    const std::string* inspect_color(char character) const {
-        auto it = charToColorCode.find(character);
-        if (it != charToColorCode.end()) {
-            return &it->second;
-        }
-        return nullptr;
-    }
+inline LogMetricsRegistry& log_metrics() {
+    static LogMetricsRegistry registry;
+    return registry;
+}
 
-    const std::string* inspect_key_color(const std::string& key) const {
-        auto it = keyToColorCode.find(key);
-        if (it != keyToColorCode.end()) {
-            return &it->second;
-        }
-        return nullptr;
+inline int64_t steady_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Times one Logger call when metrics are on
+class LogCallTimer {
+public:
+    explicit LogCallTimer(LogLevel level) : level_(level), start_(log_metrics_enabled.load(std::memory_order_relaxed) ? steady_now_ns() : 0) {}
+    ~LogCallTimer() {
+        if (start_ != 0) log_metrics().record_call(level_, static_cast<uint64_t>(steady_now_ns() - start_));
     }
 
-    const std::string* inspect_value_color(const std::string& value) const {
-        auto it = valueToColorCode.find(value);
-        if (it != valueToColorCode.end()) {
-            return &it->second;
-        }
-        return nullptr;
+private:
+    LogLevel level_;
+    int64_t start_;
+};
+
+// Takes log_mutex(), recording how long the caller waited when it was contended
+inline std::unique_lock<std::mutex> lock_log_mutex() {
+    std::unique_lock<std::mutex> lock(log_mutex(), std::try_to_lock);
+    if (!lock.owns_lock()) {
+        int64_t start = steady_now_ns();
+        lock.lock();
+        log_metrics().record_mutex_wait(static_cast<uint64_t>(steady_now_ns() - start));
     }
+    return lock;
+}
 
-    void replace(const std::string& characters, const std::string& colorCode) {
-        for (char ch : characters) {
-            charToColorCode[ch] = colorCode;
-        }
+// Buffers formatted log text in front of the sinks and decides, per the flush policy, when
+// it is handed to them and flushed. Writers serialize on log_mutex() so lines never interleave.
+class LogOutput {
+public:
+    LogOutput() {
+        log_metrics();
+        sinks_.push_back(LogSink{
+            [](std::string_view text) { std::cerr.write(text.data(), static_cast<std::streamsize>(text.size())); },
+            [] { std::cerr.flush(); },
+            true});
     }
 
-    void erase(const std::string& characters) {
-        for (char ch : characters) {
-            charToColorCode.erase(ch);
-        }
+    ~LogOutput() {
+        std::lock_guard<std::mutex> lock(log_mutex());
+        flush_locked();
     }
-};
 
-class ThemeManager {
-private:
-    ThemeManager() : currentTheme(&defaultTheme), color_enabled(true) {
-        themes["default"] = defaultTheme;
+    void set_policy(FlushPolicy policy, size_t bytes, std::chrono::milliseconds interval) {
+        std::lock_guard<std::mutex> lock(log_mutex());
+        flush_locked();
+        policy_ = policy;
+        bytes_ = std::max<size_t>(bytes, 1);
+        interval_ = interval;
     }
 
-    ColorMapping defaultTheme;
-    ColorMapping* currentTheme;
-    std::unordered_map<std::string, ColorMapping> themes;
-    bool color_enabled;
+    FlushPolicy policy() const { return policy_; }
 
-public:
-    static ThemeManager& instance() {
-        static ThemeManager instance;
-        return instance;
+    void set_sinks(std::vector<LogSink> sinks) {
+        std::lock_guard<std::mutex> lock(log_mutex());
+        flush_locked();
+        sinks_ = std::move(sinks);
+        update_render_modes_locked();
     }
 
-    void create(const std::string& themeName) {
-        if (themes.find(themeName) != themes.end()) {
-            std::string error_msg = "Theme already exists: " + themeName;
-            Logger::error(error_msg);
-            throw std::runtime_error(error_msg);
-        }
-        themes[themeName] = ColorMapping();
-        Logger::info("Created theme: " + themeName);
+    void add_sink(LogSink sink) {
+        std::lock_guard<std::mutex> lock(log_mutex());
+        flush_locked();
+        sinks_.push_back(std::move(sink));
+        update_render_modes_locked();
     }
 
-    void set(const std::string& themeName) {
-        if (themes.find(themeName) == themes.end()) {
-            std::string error_msg = "Theme does not exist: " + themeName;
-            Logger::error(error_msg);
-            throw std::runtime_error(error_msg);
+    // most_severe is the highest-severity level contained in text
+    void write(const LogText& text, LogLevel most_severe) {
+        auto lock = lock_log_mutex();
+        pending_.colored.append(text.colored);
+        pending_.plain.append(text.plain);
+        if (most_severe == LogLevel::fatal || should_flush(most_severe)) {
+            flush_locked();
+        } else if (pending_.size() >= std::max(bytes_, max_pending)) {
+            write_pending_locked();
         }
-        currentTheme = &themes[themeName];
-        Logger::info("Set current theme to: " + themeName);
     }
 
-    void insert(const std::string& name, const std::string& characters, const std::string& colorCode, bool isKey = false, bool isValue = false) {
-        currentTheme->insert(name, characters, colorCode, isKey, isValue);
-        Logger::info("Inserted color mapping for " + name + " in current theme");
+    void flush() {
+        auto lock = lock_log_mutex();
+        flush_locked();
     }
 
-    std::string apply(const std::string& text) const {
-        if (color_enabled) {
-            return currentTheme->apply(text);
-        } else {
-            return text;
-        }
+    // Called by the log ticker so an every_interval flush is not left waiting for the next line
+    void tick() {
+        std::lock_guard<std::mutex> lock(log_mutex());
+        if (policy_ == FlushPolicy::every_interval && std::chrono::steady_clock::now() - last_flush_ >= interval_) flush_locked();
     }
 
-    std::unordered_map<char, std::string> inspect() const {
-        return currentTheme->get();
+private:
+    static constexpr size_t max_pending = 64 * 1024;
+
+    bool should_flush(LogLevel level) const {
+        switch (policy_) {
+            case FlushPolicy::always: return true;
+            case FlushPolicy::on_error: return log_severity(level) >= log_severity(LogLevel::error);
+            case FlushPolicy::every_bytes: return pending_.size() >= bytes_;
+            case FlushPolicy::every_interval: return std::chrono::steady_clock::now() - last_flush_ >= interval_;
+            default: return false;
+        }
     }
 
-    const std::string* inspect_color(char character) const {
-        return currentTheme->inspect_color(character);
+    void update_render_modes_locked() {
+        unsigned modes = 0;
+        for (const auto& sink : sinks_) modes |= sink.colored ? render_colored : render_plain;
+        log_render_modes.store(modes, std::memory_order_release);
     }
 
-    const std::string* inspect_key_color(const std::string& key) const {
-        return currentTheme->inspect_key_color(key);
+    void write_pending_locked() {
+        if (pending_.empty()) return;
+        log_metrics().bytes_written.fetch_add(pending_.size(), std::memory_order_relaxed);
+        for (const auto& sink : sinks_) {
+            // Text rendered before the sinks changed may lack this sink's variant
+            const std::string& text = sink.colored ? (pending_.colored.empty() ? pending_.plain : pending_.colored)
+                                                   : (pending_.plain.empty() ? pending_.colored : pending_.plain);
+            if (sink.write) sink.write(text);
+        }
+        pending_.clear();
     }
 
-    const std::string* inspect_value_color(const std::string& value) const {
-        return currentTheme->inspect_value_color(value);
+    void flush_locked() {
+        write_pending_locked();
+        for (const auto& sink : sinks_) {
+            if (sink.flush) sink.flush();
+        }
+        if (policy_ == FlushPolicy::every_interval) last_flush_ = std::chrono::steady_clock::now();
     }
 
-    std::vector<std::string> list() const {
+    LogText pending_;
+    std::vector<LogSink> sinks_;
+    FlushPolicy policy_ = FlushPolicy::always;
+    size_t bytes_ = max_pending;
+    std::chrono::milliseconds interval_{1000};
+    std::chrono::steady_clock::time_point last_flush_ = std::chrono::steady_clock::now();
+};
+
+inline LogOutput& log_output() {
+    static LogOutput output;
+    return output;
+}
+
+// One slot of the shared queue: an encoded record (a DeferredRecordHeader and its
+// arguments) written in place, or for a larger record a spilled record pointing at a heap copy
+struct LogRecord {
+    static constexpr size_t slot_size = 128;
+    alignas(8) char bytes[slot_size];
+};
+
+// Bounded lock-free multi-producer queue of fixed slots (Vyukov's sequence-per-slot design).
+// Producers fill a slot in place and readers use it in place, so nothing is copied or
+// allocated per record. Besides the writer thread, producers may also pop in order to evict
+// the oldest record on overflow. A record's position in the queue doubles as its ticket.
+class BoundedLogQueue {
+public:
+    // Only while no thread pushes or pops
+    void reset(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        mask_ = size - 1;
+        cells_.reset(new Cell[size]);
+        for (size_t i = 0; i < size; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        enqueue_pos_.store(0);
+        dequeue_pos_.store(0);
+    }
+
+    // Calls fill(record) for a free slot, then publishes it
+    template <typename Fill>
+    bool try_push(Fill&& fill) {
+        uint64_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells_[pos & mask_];
+            uint64_t seq = cell.sequence.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(seq - pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    fill(cell.record);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Calls fn(record, position) for the oldest record, then frees its slot
+    template <typename Fn>
+    bool try_pop(Fn&& fn) {
+        uint64_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells_[pos & mask_];
+            uint64_t seq = cell.sequence.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(seq - (pos + 1));
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    fn(cell.record, pos);
+                    cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Positions handed out so far; every record below it has been pushed or is being filled
+    uint64_t enqueued() const { return enqueue_pos_.load(); }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        std::atomic<uint64_t> sequence;
+        LogRecord record;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<uint64_t> enqueue_pos_{0};
+    alignas(64) std::atomic<uint64_t> dequeue_pos_{0};
+};
+
+// Self-describing encoding for deferred log arguments: a tag byte followed by the raw value.
+// Records can then be formatted later, on the writer thread, without knowing the C++ types.
+enum class LogArgTag : uint8_t { i64, u64, f64, boolean, character, string, static_string };
+
+// Text with static storage duration (a LogSite's location); encoded as a pointer, not copied
+struct LogStaticText {
+    std::string_view text;
+};
+
+inline std::string_view log_location_text(std::string_view location) { return location; }
+inline std::string_view log_location_text(const LogStaticText& location) { return location.text; }
+
+template <typename T>
+inline constexpr bool is_native_log_arg_v = std::is_arithmetic_v<T> || std::is_enum_v<T> || std::is_convertible_v<const T&, std::string_view>;
+
+// Natively encodable arguments pass through by reference; anything else is rendered with
+// operator<< on the calling thread and travels as a string
+template <typename T>
+inline decltype(auto) capture_log_arg(const T& value) {
+    if constexpr (is_native_log_arg_v<T>) {
+        return (value);
+    } else {
+        std::ostringstream oss;
+        oss << value;
+        return oss.str();
+    }
+}
+
+template <typename T>
+inline std::string_view log_arg_view(const T& value) {
+    if constexpr (std::is_pointer_v<T>) {
+        return value != nullptr ? std::string_view(value) : std::string_view("(null)");
+    } else {
+        return std::string_view(value);
+    }
+}
+
+template <typename T>
+inline size_t log_arg_size(const T& value) {
+    if constexpr (std::is_same_v<T, LogStaticText>) {
+        return 1 + sizeof(const char*) + sizeof(size_t);
+    } else if constexpr (std::is_same_v<T, bool> || std::is_same_v<T, char>) {
+        return 2;
+    } else if constexpr (std::is_arithmetic_v<T> || std::is_enum_v<T>) {
+        return 9;
+    } else {
+        return 5 + log_arg_view(value).size();
+    }
+}
+
+template <typename T>
+inline char* encode_log_arg(char* p, const T& value) {
+    if constexpr (std::is_same_v<T, LogStaticText>) {
+        const char* data = value.text.data();
+        size_t size = value.text.size();
+        *p++ = static_cast<char>(LogArgTag::static_string);
+        std::memcpy(p, &data, sizeof(data));
+        std::memcpy(p + sizeof(data), &size, sizeof(size));
+        p += sizeof(data) + sizeof(size);
+    } else if constexpr (std::is_same_v<T, bool>) {
+        *p++ = static_cast<char>(LogArgTag::boolean);
+        *p++ = value ? 1 : 0;
+    } else if constexpr (std::is_same_v<T, char>) {
+        *p++ = static_cast<char>(LogArgTag::character);
+        *p++ = value;
+    } else if constexpr (std::is_floating_point_v<T>) {
+        double v = static_cast<double>(value);
+        *p++ = static_cast<char>(LogArgTag::f64);
+        std::memcpy(p, &v, 8);
+        p += 8;
+    } else if constexpr (std::is_enum_v<T>) {
+        return encode_log_arg(p, static_cast<std::underlying_type_t<T>>(value));
+    } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+        int64_t v = value;
+        *p++ = static_cast<char>(LogArgTag::i64);
+        std::memcpy(p, &v, 8);
+        p += 8;
+    } else if constexpr (std::is_integral_v<T>) {
+        uint64_t v = value;
+        *p++ = static_cast<char>(LogArgTag::u64);
+        std::memcpy(p, &v, 8);
+        p += 8;
+    } else {
+        std::string_view view = log_arg_view(value);
+        uint32_t size = static_cast<uint32_t>(view.size());
+        *p++ = static_cast<char>(LogArgTag::string);
+        std::memcpy(p, &size, 4);
+        if (size) std::memcpy(p + 4, view.data(), size);
+        p += 4 + size;
+    }
+    return p;
+}
+
+// Reads a string or static_string argument
+inline const char* read_log_arg_string(const char* p, std::string_view& value) {
+    if (static_cast<LogArgTag>(*p) == LogArgTag::static_string) {
+        const char* data;
+        size_t size;
+        std::memcpy(&data, p + 1, sizeof(data));
+        std::memcpy(&size, p + 1 + sizeof(data), sizeof(size));
+        value = std::string_view(data, size);
+        return p + 1 + sizeof(data) + sizeof(size);
+    }
+    uint32_t size;
+    std::memcpy(&size, p + 1, 4);
+    value = std::string_view(p + 5, size);
+    return p + 5 + size;
+}
+
+// Fixed-capacity text output for the flight recorder's dump path, which must not allocate;
+// text beyond the capacity is cut off
+struct FixedLogBuffer {
+    static constexpr size_t capacity = 2048;
+    char data[capacity];
+    size_t size = 0;
+
+    void append(const char* text, size_t n) {
+        n = std::min(n, capacity - size);
+        std::memcpy(data + size, text, n);
+        size += n;
+    }
+    void append(const char* text) { append(text, std::strlen(text)); }
+    void append(std::string_view text) { append(text.data(), text.size()); }
+    void push_back(char c) {
+        if (size < capacity) data[size++] = c;
+    }
+    void clear() { size = 0; }
+};
+
+// A double as printf's "%g" renders it: six significant digits, trailing zeros dropped, and an
+// exponent below 1e-4 or from 1e6 up. Normal output and the flight recorder dump share it, so
+// both show the same text. to_chars neither allocates nor locks, so the dump may run it inside
+// a signal handler; where it is missing, a printf-free version that rounds the same way is used.
+template <typename Out>
+inline void append_log_double(Out& out, double value) {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    char buf[32];
+    auto result = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::general, 6);
+    out.append(buf, static_cast<size_t>(result.ptr - buf));
+#else
+    if (value != value) {
+        out.append("nan");
+        return;
+    }
+    if (value < 0) {
+        out.push_back('-');
+        value = -value;
+    }
+    if (value > std::numeric_limits<double>::max()) {
+        out.append("inf");
+        return;
+    }
+    if (value == 0) {
+        out.push_back('0');
+        return;
+    }
+    int exponent = 0;
+    for (double v = value; v >= 10; v /= 10) ++exponent;
+    for (double v = value; v < 1; v *= 10) --exponent;
+    // Scale to six integer digits, by one exactly representable power of ten where there is one,
+    // and round halves to even as printf does
+    int shift = 5 - exponent;
+    double scaled = value;
+    double power = 1;
+    for (int i = 0; i < (shift < 0 ? -shift : shift); ++i) {
+        if (i == 22) {
+            scaled = shift < 0 ? scaled / power : scaled * power;
+            power = 1;
+        }
+        power *= 10;
+    }
+    scaled = shift < 0 ? scaled / power : scaled * power;
+    uint64_t significand = static_cast<uint64_t>(scaled);
+    double rest = scaled - static_cast<double>(significand);
+    if (rest == 0.5 && shift >= -22 && shift <= 22) {
+        // A tie only after rounding the scaled value: its exact error says which way it was
+        double error = shift < 0 ? std::fma(scaled, power, -value) : -std::fma(value, power, -scaled);
+        if (error != 0) rest = error < 0 ? 1 : 0;
+    }
+    if (rest > 0.5 || (rest == 0.5 && (significand & 1) != 0)) ++significand;
+    if (significand >= 1000000) {
+        significand /= 10;
+        ++exponent;
+    }
+    char digits[6];
+    for (int i = 5; i >= 0; --i, significand /= 10) digits[i] = static_cast<char>('0' + significand % 10);
+    int kept = 6;
+    bool scientific = exponent < -4 || exponent >= 6;
+    int point = scientific ? 1 : exponent + 1;
+    while (kept > std::max(point, 1) && digits[kept - 1] == '0') --kept;
+    if (scientific || point > 0) {
+        out.append(digits, static_cast<size_t>(std::min(point, kept)));
+        if (kept > point) {
+            out.push_back('.');
+            out.append(digits + point, static_cast<size_t>(kept - point));
+        }
+    } else {
+        out.append("0.");
+        for (int i = point; i < 0; ++i) out.push_back('0');
+        out.append(digits, static_cast<size_t>(kept));
+    }
+    if (scientific) {
+        out.push_back('e');
+        out.push_back(exponent < 0 ? '-' : '+');
+        unsigned magnitude = static_cast<unsigned>(exponent < 0 ? -exponent : exponent);
+        if (magnitude < 10) out.push_back('0');
+        append_uint(out, magnitude);
+    }
+#endif
+}
+
+// Bytes taken by the encoded argument at p
+inline size_t log_arg_length(const char* p) {
+    switch (static_cast<LogArgTag>(*p)) {
+        case LogArgTag::boolean:
+        case LogArgTag::character: return 2;
+        case LogArgTag::string: {
+            uint32_t size;
+            std::memcpy(&size, p + 1, 4);
+            return 5 + size;
+        }
+        case LogArgTag::static_string: return 1 + sizeof(const char*) + sizeof(size_t);
+        default: return 9;
+    }
+}
+
+// Appends the encoded argument at p to out and returns the position after it
+template <typename Out>
+inline const char* append_log_arg(Out& out, const char* p) {
+    switch (static_cast<LogArgTag>(*p)) {
+        case LogArgTag::i64: {
+            int64_t v;
+            std::memcpy(&v, p + 1, 8);
+            if (v < 0) out.push_back('-');
+            append_uint(out, v < 0 ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v));
+            return p + 9;
+        }
+        case LogArgTag::u64: {
+            uint64_t v;
+            std::memcpy(&v, p + 1, 8);
+            append_uint(out, v);
+            return p + 9;
+        }
+        case LogArgTag::f64: {
+            double v;
+            std::memcpy(&v, p + 1, 8);
+            append_log_double(out, v);
+            return p + 9;
+        }
+        case LogArgTag::boolean:
+            out.append(p[1] ? "true" : "false");
+            return p + 2;
+        case LogArgTag::character:
+            out.push_back(p[1]);
+            return p + 2;
+        case LogArgTag::string:
+        case LogArgTag::static_string: {
+            std::string_view v;
+            p = read_log_arg_string(p, v);
+            out.append(v);
+            return p;
+        }
+    }
+    return p + 1;
+}
+
+// Expands each "{}" in format with the next encoded argument; "{{" and "}}" are literal braces
+template <typename Out>
+inline void format_log_args(Out& out, const char* format, const char* args, size_t count) {
+    const char* f = format;
+    for (;;) {
+        const char* brace = std::strpbrk(f, "{}");
+        if (brace == nullptr) {
+            out.append(f);
+            return;
+        }
+        out.append(f, brace - f);
+        if (brace[0] == '{' && brace[1] == '}') {
+            if (count != 0) {
+                args = append_log_arg(out, args);
+                --count;
+            } else {
+                out.append("{}");
+            }
+            f = brace + 2;
+        } else if (brace[1] == brace[0]) {
+            out.push_back(brace[0]);
+            f = brace + 2;
+        } else {
+            out.push_back(brace[0]);
+            f = brace + 1;
+        }
+    }
+}
+
+// Header of a record in a ThreadLogBuffer; the encoded arguments follow it
+struct DeferredRecordHeader {
+    uint32_t size;          // whole record including this header, a multiple of 8
+    uint8_t kind;
+    uint8_t level;
+    uint16_t arg_count;
+    const char* format;     // caller's string literal, or nullptr for a plain (file, line, msg) message
+    int64_t time;           // log_time_now() at the call
+};
+
+// Single-producer single-consumer byte ring owned by one logging thread. The owner appends
+// encoded records without locking; the async writer consumes them. Records too large for the
+// ring are copied to the heap and the ring holds a pointer to the copy, so they keep their place.
+// The owner sets the ring's size and the most records it may hold; the memory is allocated on
+// first use and resized only while the ring is empty.
+class ThreadLogBuffer {
+public:
+    static constexpr uint8_t padding_record = 0;
+    static constexpr uint8_t log_record = 1;
+    static constexpr uint8_t spilled_record = 2;
+    static constexpr size_t spilled_record_size = sizeof(DeferredRecordHeader) + sizeof(uint64_t);
+    static constexpr size_t min_capacity = 1024;
+
+    ~ThreadLogBuffer() { free_spilled(tail_.load(), head_.load()); }
+
+    size_t capacity() const { return size_; }
+
+    // Owner side: the ring's size in bytes (rounded up to a power of two) and record limit
+    void set_limits(size_t bytes, uint64_t records) {
+        size_t size = min_capacity;
+        while (size < bytes) size <<= 1;
+        wanted_size_ = size;
+        record_limit_ = records;
+    }
+
+    // Returns contiguous space for a record of `size` bytes (a multiple of 8), or nullptr when full
+    char* try_reserve(size_t size) {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        if (size_ != wanted_size_ && head == tail_.load(std::memory_order_acquire)) resize();
+        if (pushed_ - cached_released_ >= record_limit_) {
+            cached_released_ = released_.load(std::memory_order_acquire);
+            if (pushed_ - cached_released_ >= record_limit_) return nullptr;
+        }
+        size_t offset = static_cast<size_t>(head & mask_);
+        size_t contiguous = capacity() - offset;
+        size_t needed = size <= contiguous ? size : contiguous + size;
+        if (needed > capacity() - (head - cached_tail_)) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (needed > capacity() - (head - cached_tail_)) return nullptr;
+        }
+        reserved_ = needed;
+        if (size <= contiguous) return data_.get() + offset;
+        // Skip the tail end of the ring; too short for a header means the reader skips it implicitly
+        if (contiguous >= sizeof(DeferredRecordHeader)) {
+            auto* pad = reinterpret_cast<DeferredRecordHeader*>(data_.get() + offset);
+            pad->size = static_cast<uint32_t>(contiguous);
+            pad->kind = padding_record;
+        }
+        return data_.get();
+    }
+
+    // Sequentially consistent so the writer's sleep check cannot miss the record
+    void commit() {
+        ++pushed_;
+        head_.store(head_.load(std::memory_order_relaxed) + reserved_, std::memory_order_seq_cst);
+    }
+
+    // Calls fn(header, args) for every published record and returns the new read
+    // position; pass it to release() once the records' output has been written
+    template <typename Fn>
+    uint64_t consume(Fn&& fn) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        uint64_t head = head_.load(std::memory_order_acquire);
+        while (tail != head) {
+            size_t offset = static_cast<size_t>(tail & mask_);
+            size_t contiguous = capacity() - offset;
+            if (contiguous < sizeof(DeferredRecordHeader)) {
+                tail += contiguous;
+                continue;
+            }
+            const auto* header = reinterpret_cast<const DeferredRecordHeader*>(data_.get() + offset);
+            const char* args = data_.get() + offset + sizeof(DeferredRecordHeader);
+            if (header->kind == log_record) {
+                fn(*header, args);
+                ++consumed_;
+            } else if (header->kind == spilled_record) {
+                const char* copy = spilled_copy(args);
+                fn(*reinterpret_cast<const DeferredRecordHeader*>(copy), copy + sizeof(DeferredRecordHeader));
+                ++consumed_;
+            }
+            tail += header->size;
+        }
+        return tail;
+    }
+
+    // Owner side: publishes a spilled record pointing at `copy`, which the buffer then owns
+    bool try_push_spilled(std::unique_ptr<uint64_t[]>& copy) {
+        char* p = try_reserve(spilled_record_size);
+        if (p == nullptr) return false;
+        write_spilled(p, copy);
+        spilled_.fetch_add(1, std::memory_order_relaxed);
+        commit();
+        return true;
+    }
+
+    void release(uint64_t tail) {
+        if (spilled_.load(std::memory_order_relaxed) != spilled_freed_) free_spilled(tail_.load(std::memory_order_relaxed), tail);
+        released_.store(consumed_, std::memory_order_release);
+        tail_.store(tail, std::memory_order_release);
+    }
+
+    uint64_t head() const { return head_.load(); }
+    uint64_t tail() const { return tail_.load(std::memory_order_acquire); }
+
+    // A spilled record at p (spilled_record_size bytes) that takes ownership of `copy`
+    static void write_spilled(char* p, std::unique_ptr<uint64_t[]>& copy) {
+        auto* header = reinterpret_cast<DeferredRecordHeader*>(p);
+        header->size = static_cast<uint32_t>(spilled_record_size);
+        header->kind = spilled_record;
+        uint64_t* raw = copy.release();
+        std::memcpy(p + sizeof(DeferredRecordHeader), &raw, sizeof(raw));
+    }
+
+    // The record at p, following a spilled record to its copy
+    static const DeferredRecordHeader& resolve(const char* p) {
+        const auto* header = reinterpret_cast<const DeferredRecordHeader*>(p);
+        if (header->kind != spilled_record) return *header;
+        return *reinterpret_cast<const DeferredRecordHeader*>(spilled_copy(p + sizeof(DeferredRecordHeader)));
+    }
+
+    // Deletes the heap copy of the record at p if it was spilled
+    static void free_record(const char* p) {
+        if (reinterpret_cast<const DeferredRecordHeader*>(p)->kind == spilled_record) {
+            delete[] reinterpret_cast<const uint64_t*>(spilled_copy(p + sizeof(DeferredRecordHeader)));
+        }
+    }
+
+    // Set when the owning thread exits; the writer drops the buffer once it is empty
+    std::atomic<bool> orphaned{false};
+
+    // Set by the owner around each push, so stopping the backend can wait out pushes under way
+    alignas(64) std::atomic<bool> pushing{false};
+
+private:
+    static const char* spilled_copy(const char* args) {
+        uint64_t* copy;
+        std::memcpy(&copy, args, sizeof(copy));
+        return reinterpret_cast<const char*>(copy);
+    }
+
+    // Owner side, with the ring empty: the writer reads the memory only while tail != head
+    void resize() {
+        data_.reset(new char[wanted_size_]);
+        size_ = wanted_size_;
+        mask_ = size_ - 1;
+    }
+
+    // Consumer side: deletes the heap copies of spilled records in [from, to)
+    void free_spilled(uint64_t from, uint64_t to) {
+        while (from != to) {
+            size_t offset = static_cast<size_t>(from & mask_);
+            size_t contiguous = capacity() - offset;
+            if (contiguous < sizeof(DeferredRecordHeader)) {
+                from += contiguous;
+                continue;
+            }
+            const auto* header = reinterpret_cast<const DeferredRecordHeader*>(data_.get() + offset);
+            if (header->kind == spilled_record) {
+                free_record(data_.get() + offset);
+                ++spilled_freed_;
+            }
+            from += header->size;
+        }
+    }
+
+    std::unique_ptr<char[]> data_;
+    size_t size_ = 0;
+    size_t mask_ = 0;
+    // Owner side
+    size_t wanted_size_ = min_capacity;
+    uint64_t record_limit_ = UINT64_MAX;
+    uint64_t pushed_ = 0;
+    uint64_t cached_released_ = 0;
+    size_t reserved_ = 0;
+    uint64_t cached_tail_ = 0;
+    // Consumer side
+    uint64_t consumed_ = 0;
+    uint64_t spilled_freed_ = 0;
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    std::atomic<uint64_t> released_{0};    // records consumed and released, for the record limit
+    std::atomic<uint64_t> spilled_{0};
+};
+
+struct ThreadLogBufferHandle {
+    std::shared_ptr<ThreadLogBuffer> buffer;
+    ~ThreadLogBufferHandle() {
+        if (buffer) buffer->orphaned.store(true, std::memory_order_release);
+    }
+};
+
+inline ThreadLogBufferHandle& thread_log_buffer_handle() {
+    thread_local ThreadLogBufferHandle handle;
+    return handle;
+}
+
+template <typename... Args>
+inline size_t deferred_record_size(const Args&... args) {
+    size_t size = sizeof(DeferredRecordHeader) + (size_t{0} + ... + log_arg_size(args));
+    return (size + 7) & ~size_t{7};
+}
+
+template <typename... Args>
+inline void encode_deferred_record(char* p, size_t size, LogLevel level, int64_t time, const char* format, const Args&... args) {
+    auto* header = reinterpret_cast<DeferredRecordHeader*>(p);
+    header->size = static_cast<uint32_t>(size);
+    header->kind = ThreadLogBuffer::log_record;
+    header->level = static_cast<uint8_t>(level);
+    header->arg_count = static_cast<uint16_t>(sizeof...(Args));
+    header->format = format;
+    header->time = time;
+    p += sizeof(DeferredRecordHeader);
+    ((p = encode_log_arg(p, args)), ...);
+}
+
+// Formats a record from a ThreadLogBuffer (or an equivalent scratch encoding) as a full log line.
+// The first argument is always the location text; plain messages carry the message as the second.
+inline void format_deferred_record(std::string& out, const DeferredRecordHeader& header, const char* args, bool colored) {
+    LogLevel level = static_cast<LogLevel>(header.level);
+    std::string_view location;
+    args = read_log_arg_string(args, location);
+    if (header.format == nullptr) {
+        std::string_view msg;
+        read_log_arg_string(args, msg);
+        format_log_line(out, level, location, msg, colored, header.time);
+        return;
+    }
+    const LogPrefixTable& table = log_prefix_table();
+    append_log_prefix(out, table, level, location, colored, header.time);
+    format_log_args(out, header.format, args, header.arg_count - 1);
+    append_log_suffix(out, table, level, colored);
+}
+
+// Compact binary log stream written instead of text by Logger::set_binary_output(). After an
+// 8-byte magic, the stream is a sequence of records:
+//   string:  0x01, id, size, bytes         - a location or format string, sent once per id
+//   log:     0x02, level, time delta, location id, format id, arg count, args
+// Integers are LEB128 varints (signed ones zigzagged), the time delta is wall-clock nanoseconds
+// since the previous log record, id 0 means "none" (a plain message has format id 0 and the
+// message as its one argument), and each arg is its LogArgTag followed by a varint, 8 raw
+// little-endian bytes (f64), one byte (boolean, character) or a size and bytes (strings).
+inline constexpr char binary_log_magic[8] = {'C', 'T', 'L', 'O', 'G', 'B', '1', '\n'};
+inline constexpr uint8_t binary_string_record = 1;
+inline constexpr uint8_t binary_log_record = 2;
+
+inline void append_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+inline uint64_t zigzag_encode(int64_t value) { return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63); }
+inline int64_t zigzag_decode(uint64_t value) { return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1); }
+
+class BinaryLogWriter {
+public:
+    BinaryLogWriter() { log_output(); }
+    ~BinaryLogWriter() { close(); }
+
+    void open(LogSink sink) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flush_locked();
+        sink_ = std::move(sink);
+        pointer_ids_.clear();
+        text_ids_.clear();
+        next_id_ = 1;
+        last_time_ = 0;
+        pending_.assign(binary_log_magic, sizeof(binary_log_magic));
+        binary_log_enabled.store(true, std::memory_order_release);
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        binary_log_enabled.store(false, std::memory_order_release);
+        flush_locked();
+        sink_ = LogSink{};
+    }
+
+    // Appends a record in the ThreadLogBuffer encoding (see format_deferred_record)
+    void append(const DeferredRecordHeader& header, const char* args) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!sink_.write) return;
+        size_t count = header.arg_count;
+        uint32_t location = count != 0 ? intern_arg_locked(args) : 0;
+        if (count != 0) {
+            args += log_arg_length(args);
+            --count;
+        }
+        uint32_t format = header.format ? intern_locked(header.format, std::string_view(header.format)) : 0;
+        LogLevel level = static_cast<LogLevel>(header.level);
+        int64_t time = header.time + log_clock().wall_offset_ns;
+        size_t start = pending_.size();
+        pending_.push_back(static_cast<char>(binary_log_record));
+        pending_.push_back(static_cast<char>(header.level));
+        append_varint(pending_, zigzag_encode(time - last_time_));
+        append_varint(pending_, location);
+        append_varint(pending_, format);
+        append_varint(pending_, count);
+        for (; count != 0; --count) args = append_arg_locked(args);
+        last_time_ = time;
+        log_metrics().bytes_written.fetch_add(pending_.size() - start, std::memory_order_relaxed);
+        FlushPolicy policy = log_output().policy();
+        if (level == LogLevel::fatal || policy == FlushPolicy::always ||
+            (policy == FlushPolicy::on_error && log_severity(level) >= log_severity(LogLevel::error))) {
+            flush_locked();
+        } else if (pending_.size() >= max_pending) {
+            write_pending_locked();
+        }
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flush_locked();
+    }
+
+private:
+    static constexpr size_t max_pending = 64 * 1024;
+
+    // Literals and LogSite locations are keyed by address, other location text by content
+    uint32_t intern_arg_locked(const char* arg) {
+        std::string_view text;
+        read_log_arg_string(arg, text);
+        if (text.empty()) return 0;
+        if (static_cast<LogArgTag>(*arg) == LogArgTag::static_string) return intern_locked(text.data(), text);
+        uint64_t hash = hash_text(text);
+        auto it = text_ids_.find(hash);
+        if (it != text_ids_.end() && it->second.second == text) return it->second.first;
+        uint32_t id = define_locked(text);
+        text_ids_[hash] = {id, std::string(text)};
+        return id;
+    }
+
+    uint32_t intern_locked(const void* key, std::string_view text) {
+        auto it = pointer_ids_.find(key);
+        if (it != pointer_ids_.end()) return it->second;
+        uint32_t id = define_locked(text);
+        pointer_ids_.emplace(key, id);
+        return id;
+    }
+
+    uint32_t define_locked(std::string_view text) {
+        uint32_t id = next_id_++;
+        pending_.push_back(static_cast<char>(binary_string_record));
+        append_varint(pending_, id);
+        append_varint(pending_, text.size());
+        pending_.append(text);
+        return id;
+    }
+
+    const char* append_arg_locked(const char* p) {
+        auto tag = static_cast<LogArgTag>(*p);
+        switch (tag) {
+            case LogArgTag::i64:
+            case LogArgTag::u64: {
+                uint64_t v;
+                std::memcpy(&v, p + 1, 8);
+                pending_.push_back(static_cast<char>(tag));
+                append_varint(pending_, tag == LogArgTag::i64 ? zigzag_encode(static_cast<int64_t>(v)) : v);
+                return p + 9;
+            }
+            case LogArgTag::f64:
+                pending_.push_back(static_cast<char>(tag));
+                pending_.append(p + 1, 8);
+                return p + 9;
+            case LogArgTag::boolean:
+            case LogArgTag::character:
+                pending_.append(p, 2);
+                return p + 2;
+            case LogArgTag::string:
+            case LogArgTag::static_string: {
+                std::string_view v;
+                const char* next = read_log_arg_string(p, v);
+                pending_.push_back(static_cast<char>(LogArgTag::string));
+                append_varint(pending_, v.size());
+                pending_.append(v);
+                return next;
+            }
+        }
+        return p + 1;
+    }
+
+    static uint64_t hash_text(std::string_view text) {
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : text) hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        return hash;
+    }
+
+    void write_pending_locked() {
+        if (pending_.empty()) return;
+        if (sink_.write) sink_.write(pending_);
+        pending_.clear();
+    }
+
+    void flush_locked() {
+        write_pending_locked();
+        if (sink_.flush) sink_.flush();
+    }
+
+    std::mutex mutex_;
+    LogSink sink_;
+    std::string pending_;
+    std::unordered_map<const void*, uint32_t> pointer_ids_;
+    std::unordered_map<uint64_t, std::pair<uint32_t, std::string>> text_ids_;
+    uint32_t next_id_ = 1;
+    int64_t last_time_ = 0;
+};
+
+inline BinaryLogWriter& binary_log_writer() {
+    static BinaryLogWriter writer;
+    return writer;
+}
+
+// Writes a plain (location, msg) message to the binary stream
+template <typename Location>
+inline void write_binary_message(LogLevel level, int64_t time, const Location& location, std::string_view msg) {
+    thread_local std::vector<uint64_t> scratch;
+    size_t size = deferred_record_size(location, msg);
+    scratch.resize(size / sizeof(uint64_t));
+    char* p = reinterpret_cast<char*>(scratch.data());
+    encode_deferred_record(p, size, level, time, nullptr, location, msg);
+    binary_log_writer().append(*reinterpret_cast<const DeferredRecordHeader*>(p), p + sizeof(DeferredRecordHeader));
+}
+
+// Background writer for asynchronous logging: producers enqueue records without taking
+// a lock, a single thread formats and colours them and writes each batch with one call.
+// Every record a thread logs takes the same path, so each thread's lines stay in call order:
+// its own buffer, or under OverflowPolicy::drop_oldest the shared queue, which can evict.
+// At most `capacity` records are queued in all: the shared queue has that many slots, and
+// otherwise each thread's buffer holds an equal share of them.
+class AsyncLogBackend {
+public:
+    // Everything the writer touches must outlive the backend so the final drain at exit
+    // still has its configuration and somewhere to go
+    AsyncLogBackend() {
+        log_prefix_table();
+        log_output();
+        binary_log_writer();
+    }
+    ~AsyncLogBackend() { stop(); }
+
+    void start(size_t capacity, OverflowPolicy policy) {
+        std::lock_guard<std::mutex> control(control_mutex_);
+        if (running_.load()) return;
+        capacity_.store(std::max<size_t>(capacity, 1));
+        policy_.store(policy);
+        // Positions restart at zero, so flush() and the writer's sleep check start afresh
+        queue_.reset(policy == OverflowPolicy::drop_oldest ? capacity : 1);
+        retired_through_.store(0);
+        retired_ahead_.clear();
+        stopping_.store(false);
+        worker_ = std::thread([this] { run(); });
+        running_.store(true, std::memory_order_release);
+    }
+
+    // Drains everything already queued, then joins the writer thread
+    void stop() {
+        std::lock_guard<std::mutex> control(control_mutex_);
+        if (!running_.load()) return;
+        running_.store(false);
+        // Copied first: a blocked push needs the writer, and so buffers_mutex_, to finish
+        std::vector<std::shared_ptr<ThreadLogBuffer>> buffers;
+        {
+            std::lock_guard<std::mutex> lock(buffers_mutex_);
+            buffers = buffers_;
+        }
+        for (const auto& buffer : buffers) {
+            while (buffer->pushing.load()) std::this_thread::yield();
+        }
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            stopping_.store(true);
+        }
+        wake_cv_.notify_one();
+        worker_.join();
+    }
+
+    bool running() const { return running_.load(std::memory_order_acquire); }
+
+    // Queues an encoded record of `size` bytes (a multiple of 8) written by encode(char*).
+    // Returns false when the backend is not running, so the caller logs synchronously.
+    template <typename Encode>
+    bool push(size_t size, Encode&& encode) {
+        ThreadLogBuffer& buffer = thread_buffer();
+        buffer.pushing.store(true);
+        if (!running_.load()) {
+            buffer.pushing.store(false, std::memory_order_release);
+            return false;
+        }
+        // Read only once running: stop() waits for this push before start() can change them
+        OverflowPolicy policy = policy_.load(std::memory_order_relaxed);
+        if (policy == OverflowPolicy::drop_oldest) {
+            push_shared(size, encode);
+            buffer.pushing.store(false, std::memory_order_release);
+            return true;
+        }
+        uint64_t records = std::max<uint64_t>(1, capacity_.load(std::memory_order_relaxed) / std::max<size_t>(1, thread_count_.load(std::memory_order_relaxed)));
+        size_t bytes = static_cast<size_t>(std::min<uint64_t>(records * average_record_size, max_thread_buffer_capacity));
+        buffer.set_limits(bytes, records);
+        bool queued;
+        if (size > bytes / 4) {
+            std::unique_ptr<uint64_t[]> copy(new uint64_t[size / sizeof(uint64_t)]);
+            encode(reinterpret_cast<char*>(copy.get()));
+            queued = reserve_blocking(policy, [&] { return buffer.try_push_spilled(copy); });
+        } else {
+            queued = reserve_blocking(policy, [&] {
+                char* p = buffer.try_reserve(size);
+                if (p == nullptr) return false;
+                encode(p);
+                buffer.commit();
+                return true;
+            });
+        }
+        if (queued) nudge(buffer.head() - buffer.tail() > buffer.capacity() / 4);
+        buffer.pushing.store(false, std::memory_order_release);
+        return true;
+    }
+
+    // Blocks until every record queued before the call has been written
+    void flush() {
+        uint64_t target = queue_.enqueued();
+        std::vector<std::pair<std::shared_ptr<ThreadLogBuffer>, uint64_t>> heads;
+        {
+            std::lock_guard<std::mutex> lock(buffers_mutex_);
+            for (const auto& buffer : buffers_) heads.emplace_back(buffer, buffer->head());
+        }
+        auto written = [&] {
+            if (retired_through_.load() < target) return false;
+            for (const auto& entry : heads) {
+                if (entry.first->tail() < entry.second) return false;
+            }
+            return true;
+        };
+        wake();
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        flushed_cv_.wait(lock, [&] { return written() || !running_.load(); });
+    }
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t max_batch = 256;
+    // A thread's buffer gets room for its share of records at this many bytes each, up to
+    // max_thread_buffer_capacity; a buffer that fills up first also counts as full
+    static constexpr size_t average_record_size = 64;
+    static constexpr size_t max_thread_buffer_capacity = 64 * 1024;
+    // An idle writer polls every poll_interval and only sleeps until woken after idle_polls
+    // empty polls, so producers signal it only once per quiet spell, not once per record
+    static constexpr std::chrono::milliseconds poll_interval{1};
+    static constexpr int idle_polls = 50;
+
+    // Retries `try_push` while the buffer is full under OverflowPolicy::block; otherwise
+    // counts the record as dropped. Per-thread buffers cannot evict another thread's records.
+    template <typename TryPush>
+    bool reserve_blocking(OverflowPolicy policy, TryPush&& try_push) {
+        while (!try_push()) {
+            if (policy != OverflowPolicy::block) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            wake();
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    // OverflowPolicy::drop_oldest: every record is encoded into a slot of the shared queue,
+    // where a producer that finds it full can evict the oldest record of any thread. Records
+    // larger than a slot are spilled to the heap, as in the per-thread buffers.
+    template <typename Encode>
+    void push_shared(size_t size, Encode& encode) {
+        std::unique_ptr<uint64_t[]> copy;
+        if (size > LogRecord::slot_size) {
+            copy.reset(new uint64_t[size / sizeof(uint64_t)]);
+            encode(reinterpret_cast<char*>(copy.get()));
+        }
+        bool evicted_any = false;
+        while (!queue_.try_push([&](LogRecord& record) {
+            if (copy) {
+                ThreadLogBuffer::write_spilled(record.bytes, copy);
+            } else {
+                encode(record.bytes);
+            }
+        })) {
+            uint64_t evicted = 0;
+            if (queue_.try_pop([&](LogRecord& record, uint64_t position) {
+                ThreadLogBuffer::free_record(record.bytes);
+                evicted = position;
+            })) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                retire(&evicted, 1);
+                evicted_any = true;
+            }
+        }
+        nudge(evicted_any);
+    }
+
+    // Wakes the writer when it has gone to sleep or `backlog` says it should not wait for
+    // its next poll. Producers publish before checking sleeping_, so one side sees the other.
+    void nudge(bool backlog) {
+        if (backlog || (sleeping_.load() && sleeping_.exchange(false))) wake();
+    }
+
+    void wake() {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        wake_cv_.notify_one();
+    }
+
+    // Records are retired out of queue order (evictions land between batches), so positions
+    // that finish early wait in a min-heap until everything below them is done and
+    // retired_through_ can move past them
+    void retire(const uint64_t* positions, size_t count) {
+        std::lock_guard<std::mutex> lock(retired_mutex_);
+        uint64_t through = retired_through_.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < count; ++i) {
+            retired_ahead_.push_back(positions[i]);
+            std::push_heap(retired_ahead_.begin(), retired_ahead_.end(), std::greater<uint64_t>());
+        }
+        while (!retired_ahead_.empty() && retired_ahead_.front() == through) {
+            std::pop_heap(retired_ahead_.begin(), retired_ahead_.end(), std::greater<uint64_t>());
+            retired_ahead_.pop_back();
+            ++through;
+        }
+        retired_through_.store(through);
+    }
+
+    ThreadLogBuffer& thread_buffer() {
+        auto& handle = thread_log_buffer_handle();
+        if (!handle.buffer) {
+            handle.buffer = std::make_shared<ThreadLogBuffer>();
+            std::lock_guard<std::mutex> lock(buffers_mutex_);
+            buffers_.push_back(handle.buffer);
+            thread_count_.store(buffers_.size(), std::memory_order_relaxed);
+        }
+        return *handle.buffer;
+    }
+
+    bool buffers_empty() {
+        std::lock_guard<std::mutex> lock(buffers_mutex_);
+        for (const auto& buffer : buffers_) {
+            if (buffer->head() != buffer->tail()) return false;
+        }
+        return true;
+    }
+
+    void run() {
+        LogText batch;
+        std::vector<uint64_t> tails;
+        std::vector<uint64_t> positions;
+        bool shared = policy_.load() == OverflowPolicy::drop_oldest;
+        int idle = 0;
+        for (;;) {
+            size_t count = 0;
+            LogLevel most_severe = LogLevel::trace;
+            batch.clear();
+            positions.clear();
+            bool binary = binary_log_enabled.load(std::memory_order_acquire);
+            auto add = [&](const DeferredRecordHeader& header, const char* args) {
+                if (binary) {
+                    binary_log_writer().append(header, args);
+                } else {
+                    render_log_text(batch, [&](std::string& out, bool colored) { format_deferred_record(out, header, args, colored); });
+                }
+                LogLevel level = static_cast<LogLevel>(header.level);
+                if (log_severity(level) > log_severity(most_severe)) most_severe = level;
+                ++count;
+            };
+            {
+                // Held across the write so buffer tails are released only once their lines are out
+                std::lock_guard<std::mutex> lock(buffers_mutex_);
+                tails.clear();
+                for (const auto& buffer : buffers_) tails.push_back(buffer->consume(add));
+                while (shared && positions.size() < max_batch && queue_.try_pop([&](LogRecord& record, uint64_t position) {
+                    const DeferredRecordHeader& header = ThreadLogBuffer::resolve(record.bytes);
+                    add(header, reinterpret_cast<const char*>(&header) + sizeof(DeferredRecordHeader));
+                    ThreadLogBuffer::free_record(record.bytes);
+                    positions.push_back(position);
+                })) {
+                }
+                if (count != 0 && !binary) log_output().write(batch, most_severe);
+                for (size_t i = 0; i < tails.size(); ++i) buffers_[i]->release(tails[i]);
+                // Buffers of exited threads go once they have been drained
+                buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(), [](const auto& buffer) {
+                    return buffer->orphaned.load(std::memory_order_acquire) && buffer->head() == buffer->tail();
+                }), buffers_.end());
+                thread_count_.store(buffers_.size(), std::memory_order_relaxed);
+            }
+            if (count != 0) {
+                idle = 0;
+                retire(positions.data(), positions.size());
+                std::lock_guard<std::mutex> lock(wake_mutex_);
+                flushed_cv_.notify_all();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            if (idle < idle_polls && !stopping_.load()) {
+                ++idle;
+                wake_cv_.wait_for(lock, poll_interval);
+                continue;
+            }
+            sleeping_.store(true);
+            if (queue_.enqueued() <= retired_through_.load() && buffers_empty()) {
+                if (stopping_.load()) break;
+                wake_cv_.wait_for(lock, std::chrono::milliseconds(50));
+            }
+            sleeping_.store(false);
+        }
+        sleeping_.store(false);
+        flushed_cv_.notify_all();
+    }
+
+    BoundedLogQueue queue_;
+    std::atomic<size_t> capacity_{8192};
+    std::atomic<OverflowPolicy> policy_{OverflowPolicy::block};
+    std::thread worker_;
+    std::mutex control_mutex_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_cv_;
+    std::condition_variable flushed_cv_;
+    std::atomic<bool> running_{false};
+    std::atomic<bool> stopping_{false};
+    std::atomic<bool> sleeping_{false};
+    std::atomic<uint64_t> retired_through_{0};    // every queue position below this has been written or dropped
+    std::mutex retired_mutex_;
+    std::vector<uint64_t> retired_ahead_;
+    std::atomic<uint64_t> dropped_{0};
+    std::mutex buffers_mutex_;
+    std::vector<std::shared_ptr<ThreadLogBuffer>> buffers_;
+    std::atomic<size_t> thread_count_{0};
+};
+
+inline AsyncLogBackend& async_log_backend() {
+    static AsyncLogBackend backend;
+    return backend;
+}
+
+// Staged synchronous logging: each thread collects whole lines in its own buffer and hands
+// them to the output in one write once a size or age threshold is crossed
+struct LogStagingConfig {
+    std::atomic<bool> enabled{false};
+    std::atomic<size_t> bytes{16 * 1024};
+    std::atomic<int64_t> interval_ns{100000000};
+    std::atomic<bool> tag_lines{false};
+};
+
+inline LogStagingConfig& log_staging_config() {
+    static LogStagingConfig config;
+    return config;
+}
+
+class LogStagingBuffer {
+public:
+    explicit LogStagingBuffer(uint32_t thread_id) : thread_id_(thread_id) {}
+
+    // With tag_lines set, each line starts with "T<thread>#<seq>@<steady ns> " so the
+    // interleaving of threads can be reconstructed from the batched output
+    template <typename Format>
+    void stage(LogLevel level, Format&& format) {
+        const LogStagingConfig& config = log_staging_config();
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (lines_.empty()) first_line_ = now;
+        uint64_t seq = seq_++;
+        if (config.tag_lines.load(std::memory_order_relaxed)) {
+            render_log_text(lines_, [&](std::string& out, bool colored) {
+                out.push_back('T');
+                append_uint(out, thread_id_);
+                out.push_back('#');
+                append_uint(out, seq);
+                out.push_back('@');
+                append_uint(out, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count()));
+                out.push_back(' ');
+                format(out, colored);
+            });
+        } else {
+            render_log_text(lines_, format);
+        }
+        if (log_severity(level) > log_severity(most_severe_)) most_severe_ = level;
+        // Errors go out straight away rather than waiting behind a threshold
+        if (lines_.size() >= config.bytes.load(std::memory_order_relaxed) ||
+            log_severity(level) >= log_severity(LogLevel::error) ||
+            (now - first_line_).count() >= config.interval_ns.load(std::memory_order_relaxed)) {
+            hand_off_locked();
+        }
+    }
+
+    void hand_off() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        hand_off_locked();
+    }
+
+    // Hands off lines older than the interval, for threads that stopped logging
+    void hand_off_if_stale(std::chrono::steady_clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!lines_.empty() && (now - first_line_).count() >= log_staging_config().interval_ns.load(std::memory_order_relaxed)) {
+            hand_off_locked();
+        }
+    }
+
+private:
+    void hand_off_locked() {
+        if (lines_.empty()) return;
+        log_output().write(lines_, most_severe_);
+        lines_.clear();
+        most_severe_ = LogLevel::trace;
+    }
+
+    std::mutex mutex_;
+    LogText lines_;
+    LogLevel most_severe_ = LogLevel::trace;
+    std::chrono::steady_clock::time_point first_line_;
+    uint32_t thread_id_;
+    uint64_t seq_ = 0;
+};
+
+// Every live thread's buffer, so Logger::flush() can drain them all
+struct LogStagingRegistry {
+    LogStagingRegistry() { log_output(); }
+
+    void hand_off_all() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& buffer : buffers) buffer->hand_off();
+    }
+
+    void hand_off_stale() {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& buffer : buffers) buffer->hand_off_if_stale(now);
+    }
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<LogStagingBuffer>> buffers;
+    uint32_t next_thread_id = 1;
+};
+
+inline LogStagingRegistry& log_staging_registry() {
+    static LogStagingRegistry registry;
+    return registry;
+}
+
+struct LogStagingHandle {
+    std::shared_ptr<LogStagingBuffer> buffer;
+
+    LogStagingBuffer& get() {
+        if (!buffer) {
+            auto& registry = log_staging_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            buffer = std::make_shared<LogStagingBuffer>(registry.next_thread_id++);
+            registry.buffers.push_back(buffer);
+        }
+        return *buffer;
+    }
+
+    // A thread's remaining lines are written when it exits
+    ~LogStagingHandle() {
+        if (!buffer) return;
+        buffer->hand_off();
+        auto& registry = log_staging_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.buffers.erase(std::remove(registry.buffers.begin(), registry.buffers.end(), buffer), registry.buffers.end());
+    }
+};
+
+inline LogStagingBuffer& thread_log_staging_buffer() {
+    thread_local LogStagingHandle handle;
+    return handle.get();
+}
+
+inline uint64_t hash_log_key(std::string_view text, uint64_t seed = 14695981039346656037ull) {
+    uint64_t hash = seed;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+inline uint64_t hash_log_key(const void* pointer, uint64_t seed = 14695981039346656037ull) {
+    uint64_t hash = (reinterpret_cast<uintptr_t>(pointer) ^ seed) * 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 29);
+}
+
+// Lines suppressed for one key since its last summary, reported as "message repeated N times"
+struct RepeatSummary {
+    LogLevel level = LogLevel::unknown;
+    uint64_t count = 0;
+    char text[72] = {};
+    size_t size = 0;
+};
+
+// Fixed-size, 4-way set-associative table of per-key limiter state. Sets are guarded by
+// striped mutexes; nothing is allocated once the table exists. A new key takes a free way
+// of its set or the least recently seen one, whose pending repeats are then summarized.
+class LogRateLimiter {
+public:
+    static constexpr size_t slot_count = 1024;
+    static constexpr size_t way_count = 4;
+    static constexpr size_t set_count = slot_count / way_count;
+    static constexpr size_t stripe_count = 64;
+
+    bool active() const { return mode_.load(std::memory_order_relaxed) != RateLimitMode::off; }
+    RateLimitKey key() const { return key_.load(std::memory_order_relaxed); }
+
+    // Replaces the limit and clears every key. Repeats still pending are taken under the same
+    // locks, so none counted before the reset is lost, and passed to emit once they are released.
+    template <typename Emit>
+    void configure(const RateLimit& limit, Emit&& emit) {
+        std::vector<RepeatSummary> pending;
+        {
+            std::array<std::unique_lock<std::mutex>, stripe_count> locks;
+            for (size_t i = 0; i < stripe_count; ++i) locks[i] = std::unique_lock<std::mutex>(stripes_[i]);
+            for (auto& slot : slots_) {
+                RepeatSummary summary;
+                take_summary(slot, summary);
+                if (summary.count != 0) pending.push_back(summary);
+                slot = Slot();
+            }
+            limit_ = limit;
+            key_.store(limit.key, std::memory_order_relaxed);
+            mode_.store(limit.mode, std::memory_order_relaxed);
+        }
+        for (const auto& summary : pending) emit(summary);
+    }
+
+    // Returns whether a line with this key may be written. When it may and earlier lines
+    // were suppressed (or another key was evicted), `summary` describes them.
+    bool admit(uint64_t key, LogLevel level, std::string_view text, RepeatSummary& summary) {
+        if (level == LogLevel::fatal) return true;
+        int64_t now = steady_now_ns();
+        size_t set = static_cast<size_t>(key % set_count);
+        std::lock_guard<std::mutex> lock(stripes_[set % stripe_count]);
+        Slot& slot = find_slot(set, key);
+        if (slot.key != key || !slot.used) {
+            take_summary(slot, summary);
+            slot = Slot();
+            slot.used = true;
+            slot.key = key;
+            slot.tokens = limit_.burst;
+            slot.refilled = now;
+            slot.window_start = now;
+        }
+        slot.last_seen = now;
+        bool allow;
+        if (limit_.mode == RateLimitMode::token_bucket) {
+            slot.tokens = std::min(limit_.burst, slot.tokens + (now - slot.refilled) * 1e-9 * limit_.per_second);
+            slot.refilled = now;
+            allow = slot.tokens >= 1.0;
+            if (allow) slot.tokens -= 1.0;
+        } else {
+            if (now - slot.window_start >= std::chrono::nanoseconds(limit_.interval).count()) {
+                slot.window_start = now;
+                slot.in_window = 0;
+            }
+            allow = slot.in_window < limit_.first_n;
+            if (allow) ++slot.in_window;
+        }
+        if (allow) {
+            if (summary.count == 0) take_summary(slot, summary);
+        } else {
+            if (slot.suppressed == 0) {
+                slot.level = level;
+                slot.first_suppressed = now;
+                slot.size = std::min(text.size(), sizeof(slot.text));
+                if (slot.size < text.size()) slot.size = static_cast<size_t>(utf8_sequence_start(text.data(), text.data() + slot.size) - text.data());
+                std::memcpy(slot.text, text.data(), slot.size);
+            }
+            ++slot.suppressed;
+            suppressed_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return allow;
+    }
+
+    // Collects pending summaries: all of them, e.g. so Logger::flush() can report the tail
+    // of a storm, or with `all` false only those whose first suppression is an interval old
+    template <typename Emit>
+    void drain_summaries(Emit&& emit, bool all = true) {
+        int64_t now = steady_now_ns();
+        for (size_t stripe = 0; stripe < stripe_count; ++stripe) {
+            std::array<RepeatSummary, slot_count / stripe_count> pending;
+            size_t count = 0;
+            {
+                std::lock_guard<std::mutex> lock(stripes_[stripe]);
+                int64_t interval = std::chrono::nanoseconds(limit_.interval).count();
+                for (size_t set = stripe; set < set_count; set += stripe_count) {
+                    for (size_t way = 0; way < way_count; ++way) {
+                        Slot& slot = slots_[set * way_count + way];
+                        if (!all && now - slot.first_suppressed < interval) continue;
+                        take_summary(slot, pending[count]);
+                        if (pending[count].count != 0) ++count;
+                    }
+                }
+            }
+            for (size_t i = 0; i < count; ++i) emit(pending[i]);
+        }
+    }
+
+    uint64_t suppressed() const { return suppressed_.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot {
+        bool used = false;
+        uint64_t key = 0;
+        double tokens = 0;
+        int64_t refilled = 0;
+        int64_t window_start = 0;
+        int64_t last_seen = 0;
+        int64_t first_suppressed = 0;
+        uint32_t in_window = 0;
+        uint64_t suppressed = 0;
+        LogLevel level = LogLevel::unknown;
+        char text[72];
+        size_t size = 0;
+    };
+
+    // The way holding key, else a free way, else the least recently seen one
+    Slot& find_slot(size_t set, uint64_t key) {
+        Slot* ways = &slots_[set * way_count];
+        Slot* victim = &ways[0];
+        for (size_t way = 0; way < way_count; ++way) {
+            Slot& slot = ways[way];
+            if (slot.used && slot.key == key) return slot;
+            if (!victim->used) continue;
+            if (!slot.used || slot.last_seen < victim->last_seen) victim = &slot;
+        }
+        return *victim;
+    }
+
+    static void take_summary(Slot& slot, RepeatSummary& summary) {
+        if (!slot.used || slot.suppressed == 0) return;
+        summary.level = slot.level;
+        summary.count = slot.suppressed;
+        summary.size = slot.size;
+        std::memcpy(summary.text, slot.text, slot.size);
+        slot.suppressed = 0;
+    }
+
+    std::atomic<RateLimitMode> mode_{RateLimitMode::off};
+    std::atomic<RateLimitKey> key_{RateLimitKey::message};
+    RateLimit limit_;
+    std::array<Slot, slot_count> slots_;
+    std::array<std::mutex, stripe_count> stripes_;
+    std::atomic<uint64_t> suppressed_{0};
+};
+
+inline LogRateLimiter& log_rate_limiter() {
+    static LogRateLimiter limiter;
+    return limiter;
+}
+
+// Background thread for time-driven work that no log call may be around to trigger. It is
+// started by the features that need it and runs `tick(false)` at the shortest period
+// requested, then `tick(true)` once when it is stopped at exit.
+class LogTicker {
+public:
+    // Everything a tick touches is built first so it is still there when the ticker stops
+    LogTicker() {
+        async_log_backend();
+        log_output();
+        log_staging_registry();
+        log_rate_limiter();
+    }
+    ~LogTicker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        if (worker_.joinable()) worker_.join();
+    }
+
+    void start(void (*tick)(bool), std::chrono::milliseconds period) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        period_ = std::min(period_, std::max(period, std::chrono::milliseconds(1)));
+        if (worker_.joinable()) {
+            cv_.notify_one();
+            return;
+        }
+        tick_ = tick;
+        worker_ = std::thread([this] { run(); });
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            cv_.wait_for(lock, period_);
+            if (stopping_) break;
+            lock.unlock();
+            tick_(false);
+            lock.lock();
+        }
+        // On this thread: the exiting thread's thread_locals are already gone
+        lock.unlock();
+        tick_(true);
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread worker_;
+    void (*tick_)(bool) = nullptr;
+    std::chrono::milliseconds period_{1000};
+    bool stopping_ = false;
+};
+
+inline LogTicker& log_ticker() {
+    static LogTicker ticker;
+    return ticker;
+}
+
+// Writes all of text to a file descriptor with raw write(2); async-signal-safe
+inline void write_fd_all(int fd, const char* text, size_t size) {
+    while (size != 0) {
+#if defined(_WIN32) || defined(_WIN64)
+        int n = _write(fd, text, static_cast<unsigned>(size));
+#else
+        ssize_t n = ::write(fd, text, size);
+        if (n < 0 && errno == EINTR) continue;
+#endif
+        if (n <= 0) return;
+        text += n;
+        size -= static_cast<size_t>(n);
+    }
+}
+
+// Flight recorder: every record, including levels filtered from normal output, is copied
+// into a fixed ring of fixed-size slots as its encoded (unformatted) form. The ring is split
+// into shards, each with its own head, and a thread always writes to the same shard so
+// logging threads do not share one counter. Slots use a sequence number as a seqlock so the
+// dump can skip ones being overwritten; it merges the shards by time, formats without
+// allocating and writes with write(2), so it may run inside a signal handler. The level
+// labels are copied in when the recorder is made, so the dump reads no shared config.
+class FlightRecorder {
+public:
+    FlightRecorder(size_t records, size_t slot_bytes, const LogPrefixTable& labels, size_t shards = 0) {
+        for (size_t i = 0; i < log_level_count; ++i) prefixes_[i] = labels.levels[i].plain;
+        size_t count = 2;
+        while (count < records) count <<= 1;
+        size_t threads = shards != 0 ? shards : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        shard_count_ = 1;
+        while (shard_count_ < max_shards && shard_count_ < threads && count / (shard_count_ * 2) >= min_shard_records) shard_count_ <<= 1;
+        shard_mask_ = count / shard_count_ - 1;
+        slot_words_ = (std::clamp<size_t>(slot_bytes, 64, max_slot_bytes) + 7) / 8;
+        shards_.reset(new Shard[shard_count_]);
+        sequence_.reset(new std::atomic<uint64_t>[count]);
+        for (size_t i = 0; i < count; ++i) sequence_[i].store(0, std::memory_order_relaxed);
+        data_.reset(new uint64_t[count * slot_words_]);
+    }
+
+    // encode(p) writes a record of `size` bytes, as for a ThreadLogBuffer; records that do not
+    // fit a slot keep their leading arguments and have the first one that overflows cut short
+    template <typename Encode>
+    void record(size_t size, Encode&& encode) {
+        static std::atomic<size_t> next_thread{0};
+        thread_local size_t thread_index = next_thread.fetch_add(1, std::memory_order_relaxed);
+        int64_t now = steady_now_ns();
+        size_t payload = slot_words_ * 8;
+        size_t shard = thread_index & (shard_count_ - 1);
+        uint64_t index = shards_[shard].head.fetch_add(1, std::memory_order_relaxed);
+        size_t position = slot_position(shard, index);
+        std::atomic<uint64_t>& sequence = sequence_[position];
+        char* slot = reinterpret_cast<char*>(data_.get() + position * slot_words_);
+        sequence.store(index * 2 + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        if (size <= payload) {
+            encode(slot);
+        } else {
+            thread_local std::vector<uint64_t> scratch;
+            scratch.resize(size / 8);
+            char* full = reinterpret_cast<char*>(scratch.data());
+            encode(full);
+            copy_truncated(slot, payload, full);
+        }
+        reinterpret_cast<DeferredRecordHeader*>(slot)->time = now;
+        sequence.store(index * 2 + 2, std::memory_order_release);
+    }
+
+    // Writes the retained records, oldest first across all shards; async-signal-safe
+    void dump(int fd) const {
+        static const char banner[] = "---- flight recorder ----\n";
+        static const char footer[] = "---- end of flight recorder ----\n";
+        write_fd_all(fd, banner, sizeof(banner) - 1);
+        uint64_t next[max_shards];
+        uint64_t end[max_shards];
+        for (size_t shard = 0; shard < shard_count_; ++shard) {
+            end[shard] = shards_[shard].head.load(std::memory_order_acquire);
+            next[shard] = end[shard] > shard_mask_ + 1 ? end[shard] - (shard_mask_ + 1) : 0;
+        }
+        alignas(8) char copy[max_slot_bytes];
+        FixedLogBuffer line;
+        for (;;) {
+            // Pick the shard whose next complete record is oldest
+            size_t oldest = max_shards;
+            int64_t oldest_time = 0;
+            for (size_t shard = 0; shard < shard_count_; ++shard) {
+                int64_t time = 0;
+                while (next[shard] < end[shard] && !read_time(shard, next[shard], time)) ++next[shard];
+                if (next[shard] == end[shard]) continue;
+                if (oldest == max_shards || time < oldest_time) {
+                    oldest = shard;
+                    oldest_time = time;
+                }
+            }
+            if (oldest == max_shards) break;
+            uint64_t index = next[oldest]++;
+            size_t position = slot_position(oldest, index);
+            const std::atomic<uint64_t>& sequence = sequence_[position];
+            uint64_t before = sequence.load(std::memory_order_acquire);
+            if (before != index * 2 + 2) continue;
+            std::memcpy(copy, data_.get() + position * slot_words_, slot_words_ * 8);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) != before) continue;
+            line.clear();
+            format(line, *reinterpret_cast<const DeferredRecordHeader*>(copy), copy + sizeof(DeferredRecordHeader));
+            write_fd_all(fd, line.data, line.size);
+        }
+        write_fd_all(fd, footer, sizeof(footer) - 1);
+    }
+
+private:
+    static constexpr size_t max_slot_bytes = 1024;
+    static constexpr size_t max_shards = 16;
+    static constexpr size_t min_shard_records = 64;
+
+    struct Shard {
+        alignas(64) std::atomic<uint64_t> head{0};
+    };
+
+    size_t slot_position(size_t shard, uint64_t index) const {
+        return shard * (shard_mask_ + 1) + static_cast<size_t>(index & shard_mask_);
+    }
+
+    // Reads a complete record's time under the seqlock; false if the slot is not (or no
+    // longer) holding record `index`
+    bool read_time(size_t shard, uint64_t index, int64_t& time) const {
+        size_t position = slot_position(shard, index);
+        const std::atomic<uint64_t>& sequence = sequence_[position];
+        uint64_t before = sequence.load(std::memory_order_acquire);
+        if (before != index * 2 + 2) return false;
+        std::memcpy(&time, reinterpret_cast<const char*>(data_.get() + position * slot_words_) + offsetof(DeferredRecordHeader, time), sizeof(time));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return sequence.load(std::memory_order_relaxed) == before;
+    }
+
+    static void copy_truncated(char* slot, size_t payload, const char* full) {
+        auto* header = reinterpret_cast<DeferredRecordHeader*>(slot);
+        std::memcpy(header, full, sizeof(DeferredRecordHeader));
+        const char* src = full + sizeof(DeferredRecordHeader);
+        size_t used = sizeof(DeferredRecordHeader);
+        uint16_t kept = 0;
+        for (; kept < header->arg_count; ++kept) {
+            size_t length = log_arg_length(src);
+            if (used + length > payload) {
+                if (static_cast<LogArgTag>(*src) == LogArgTag::string && payload - used > 5) {
+                    uint32_t cut = static_cast<uint32_t>(payload - used - 5);
+                    slot[used] = *src;
+                    std::memcpy(slot + used + 1, &cut, 4);
+                    std::memcpy(slot + used + 5, src + 5, cut);
+                    ++kept;
+                }
+                break;
+            }
+            std::memcpy(slot + used, src, length);
+            used += length;
+            src += length;
+        }
+        header->arg_count = kept;
+    }
+
+    // "+<uptime> [label] <location><message>\n", without allocating
+    void format(FixedLogBuffer& out, const DeferredRecordHeader& header, const char* args) const {
+        uint64_t uptime = static_cast<uint64_t>(std::max<int64_t>(header.time - log_clock().start_ns, 0));
+        out.push_back('+');
+        append_uint(out, uptime / 1000000000);
+        char digits[7] = {'.', '0', '0', '0', '0', '0', '0'};
+        uint64_t micros = uptime % 1000000000 / 1000;
+        for (int i = 6; i >= 1; --i, micros /= 10) digits[i] = static_cast<char>('0' + micros % 10);
+        out.append(digits, 7);
+        out.push_back(' ');
+        out.append(prefixes_[std::min<size_t>(header.level, log_level_count - 1)]);
+        size_t count = header.arg_count;
+        if (count != 0) {
+            std::string_view location;
+            args = read_log_arg_string(args, location);
+            out.append(location);
+            --count;
+        }
+        if (header.format == nullptr) {
+            if (count != 0) append_log_arg(out, args);
+        } else {
+            format_log_args(out, header.format, args, count);
+        }
+        out.push_back('\n');
+    }
+
+    std::array<std::string, log_level_count> prefixes_;
+    std::unique_ptr<Shard[]> shards_;
+    std::unique_ptr<std::atomic<uint64_t>[]> sequence_;
+    std::unique_ptr<uint64_t[]> data_;
+    size_t shard_count_ = 1;
+    size_t shard_mask_ = 0;
+    size_t slot_words_ = 0;
+};
+
+// The active recorder; replaced recorders are kept alive since a logging thread may still
+// be writing into one
+struct FlightRecorderState {
+    std::atomic<FlightRecorder*> active{nullptr};
+    std::atomic<int> fd{2};
+    std::mutex mutex;
+    std::vector<std::unique_ptr<FlightRecorder>> recorders;
+};
+
+inline FlightRecorderState& flight_recorder_state() {
+    static FlightRecorderState state;
+    return state;
+}
+
+inline FlightRecorder* flight_recorder() {
+    return flight_recorder_state().active.load(std::memory_order_acquire);
+}
+
+// Follows a change of log_threshold or of the active recorder; the caller holds
+// flight_recorder_state().mutex
+inline void update_log_active_threshold_locked() {
+    int threshold = flight_recorder() != nullptr ? std::numeric_limits<int>::min() : log_threshold.load(std::memory_order_relaxed);
+    log_active_threshold.store(threshold, std::memory_order_relaxed);
+}
+
+inline void dump_flight_recorder_signal_safe(int fd) {
+    if (FlightRecorder* recorder = flight_recorder()) recorder->dump(fd);
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+inline void (*flight_recorder_previous_handlers[NSIG])(int) = {};
+
+inline void flight_recorder_signal_handler(int signal_number) {
+    dump_flight_recorder_signal_safe(flight_recorder_state().fd.load(std::memory_order_relaxed));
+    auto previous = flight_recorder_previous_handlers[signal_number];
+    std::signal(signal_number, previous != nullptr && previous != SIG_ERR ? previous : SIG_DFL);
+    std::raise(signal_number);
+}
+
+inline void install_flight_recorder_signal_handler(int signal_number) {
+    auto previous = std::signal(signal_number, flight_recorder_signal_handler);
+    if (previous != flight_recorder_signal_handler) flight_recorder_previous_handlers[signal_number] = previous;
+}
+#else
+// Actions in place before ours; a signal is passed on to them after the dump
+inline struct sigaction flight_recorder_previous_actions[NSIG] = {};
+
+// Puts the previous action back, then lets it see the signal: a fault raised by the kernel
+// happens again when the handler returns, one sent with kill() or raise() is sent again
+inline void flight_recorder_signal_handler(int signal_number, siginfo_t* info, void*) {
+    int saved_errno = errno;
+    dump_flight_recorder_signal_safe(flight_recorder_state().fd.load(std::memory_order_relaxed));
+    sigaction(signal_number, &flight_recorder_previous_actions[signal_number], nullptr);
+    if (info == nullptr || info->si_code <= 0) raise(signal_number);
+    errno = saved_errno;
+}
+
+// Gives the calling thread an alternate signal stack unless it has one, so the dump can
+// still run after a stack overflow; the stack is never freed
+inline void install_flight_recorder_alt_stack() {
+    stack_t current {};
+    if (sigaltstack(nullptr, &current) == 0 && (current.ss_flags & SS_DISABLE) == 0) return;
+    size_t size = std::max<size_t>(64 * 1024, SIGSTKSZ);
+    stack_t stack {};
+    stack.ss_sp = new char[size];
+    stack.ss_size = size;
+    sigaltstack(&stack, nullptr);
+}
+
+inline void install_flight_recorder_signal_handler(int signal_number) {
+    struct sigaction action {};
+    action.sa_sigaction = flight_recorder_signal_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    struct sigaction previous {};
+    if (sigaction(signal_number, &action, &previous) != 0) return;
+    // Installing twice must not make our own handler the one we chain to
+    if ((previous.sa_flags & SA_SIGINFO) == 0 || previous.sa_sigaction != flight_recorder_signal_handler) {
+        flight_recorder_previous_actions[signal_number] = previous;
+    }
+}
+#endif
+    } // namespace _internal
+
+// Sink over an existing stream, e.g. std::cerr or std::cout. Under ColorPolicy::automatic
+// the stream is coloured only if it is a terminal.
+inline LogSink make_stream_sink(std::ostream& stream, ColorPolicy policy = ColorPolicy::automatic) {
+    bool colored = policy == ColorPolicy::always || (policy == ColorPolicy::automatic && _internal::is_atty(stream));
+    return LogSink{
+        [&stream](std::string_view text) { stream.write(text.data(), static_cast<std::streamsize>(text.size())); },
+        [&stream] { stream.flush(); },
+        colored};
+}
+
+// Sink appending to a file; plain text unless asked otherwise
+inline LogSink make_file_sink(const std::string& path, ColorPolicy policy = ColorPolicy::never) {
+    auto file = std::make_shared<std::ofstream>(path, std::ios::binary | std::ios::app);
+    if (!*file) throw std::runtime_error("Failed to open log file: " + path);
+    return LogSink{
+        [file](std::string_view text) { file->write(text.data(), static_cast<std::streamsize>(text.size())); },
+        [file] { file->flush(); },
+        policy == ColorPolicy::always};
+}
+
+// When a rotating file sink starts a new file. Rotated files are kept as path.1 (newest)
+// up to path.<max_files>; the check runs per write, so files end on whole lines.
+struct LogRotation {
+    size_t max_bytes = 10 * 1024 * 1024;    // 0 disables size-based rotation
+    std::chrono::seconds interval{0};       // 0 disables time-based rotation
+    size_t max_files = 5;
+};
+
+namespace _internal {
+
+class RotatingLogFile {
+public:
+    RotatingLogFile(std::string path, LogRotation rotation) : path_(std::move(path)), rotation_(rotation) {
+        if (!open(std::ios::app)) throw std::runtime_error("Failed to open log file: " + path_);
+    }
+
+    // Runs inside sink writes, possibly on the async writer thread, so it must not throw: when
+    // the next file cannot be opened the failure is reported once on stderr and text is dropped
+    // until a reopen, retried at most once a second, succeeds
+    void write(std::string_view text) {
+        auto now = std::chrono::steady_clock::now();
+        if (!file_.is_open()) {
+            if (now - opened_ < std::chrono::seconds(1)) return;
+            if (!open(std::ios::app)) return report_failure();
+        }
+        bool full = rotation_.max_bytes != 0 && size_ != 0 && size_ + text.size() > rotation_.max_bytes;
+        bool expired = rotation_.interval.count() != 0 && now - opened_ >= rotation_.interval;
+        if ((full || expired) && !rotate()) return report_failure();
+        file_.write(text.data(), static_cast<std::streamsize>(text.size()));
+        size_ += text.size();
+    }
+
+    void flush() {
+        if (file_.is_open()) file_.flush();
+    }
+
+private:
+    bool open(std::ios::openmode mode) {
+        opened_ = std::chrono::steady_clock::now();
+        file_.open(path_, std::ios::binary | std::ios::out | mode);
+        if (!file_.is_open()) return false;
+        failure_reported_ = false;
+        file_.seekp(0, std::ios::end);
+        size_ = static_cast<size_t>(file_.tellp());
+        return true;
+    }
+
+    bool rotate() {
+        file_.close();
+        if (rotation_.max_files == 0) {
+            std::remove(path_.c_str());
+        } else {
+            std::remove((path_ + "." + std::to_string(rotation_.max_files)).c_str());
+            for (size_t i = rotation_.max_files - 1; i >= 1; --i) {
+                std::rename((path_ + "." + std::to_string(i)).c_str(), (path_ + "." + std::to_string(i + 1)).c_str());
+            }
+            std::rename(path_.c_str(), (path_ + ".1").c_str());
+        }
+        return open(std::ios::trunc);
+    }
+
+    void report_failure() {
+        if (failure_reported_) return;
+        failure_reported_ = true;
+        std::cerr << "colorterm: failed to open log file " << path_ << ", dropping output until it can be reopened" << std::endl;
+    }
+
+    std::string path_;
+    LogRotation rotation_;
+    std::ofstream file_;
+    size_t size_ = 0;
+    std::chrono::steady_clock::time_point opened_;
+    bool failure_reported_ = false;
+};
+
+} // namespace _internal
+
+inline LogSink make_rotating_file_sink(const std::string& path, LogRotation rotation = LogRotation(), ColorPolicy policy = ColorPolicy::never) {
+    auto file = std::make_shared<_internal::RotatingLogFile>(path, rotation);
+    return LogSink{
+        [file](std::string_view text) { file->write(text); },
+        [file] { file->flush(); },
+        policy == ColorPolicy::always};
+}
+
+// In-memory log, e.g. for tests or an in-application console
+class LogMemory {
+public:
+    void append(std::string_view text) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        text_.append(text);
+    }
+
+    std::string contents() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return text_;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        text_.clear();
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::string text_;
+};
+
+inline LogSink make_memory_sink(std::shared_ptr<LogMemory> memory, ColorPolicy policy = ColorPolicy::never) {
+    return LogSink{
+        [memory](std::string_view text) { memory->append(text); },
+        nullptr,
+        policy == ColorPolicy::always};
+}
+
+namespace _internal {
+
+// Reads the binary log stream written by BinaryLogWriter
+class BinaryLogReader {
+public:
+    explicit BinaryLogReader(std::istream& in) : buf_(in.rdbuf()) {}
+
+    bool byte(uint8_t& value) {
+        int c = buf_->sbumpc();
+        if (c == std::char_traits<char>::eof()) return false;
+        value = static_cast<uint8_t>(c);
+        return true;
+    }
+
+    bool varint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t b;
+            if (!byte(b)) return false;
+            value |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) return true;
+        }
+        throw std::runtime_error("Corrupt binary log: varint too long");
+    }
+
+    bool bytes(char* p, size_t size) {
+        return buf_->sgetn(p, static_cast<std::streamsize>(size)) == static_cast<std::streamsize>(size);
+    }
+
+    bool text(std::string& out) {
+        uint64_t size;
+        if (!varint(size)) return false;
+        out.resize(static_cast<size_t>(size));
+        return size == 0 || bytes(&out[0], out.size());
+    }
+
+    // Appends one argument to args in the in-memory LogArgTag encoding
+    bool arg(std::string& args) {
+        uint8_t tag;
+        if (!byte(tag)) return false;
+        switch (static_cast<LogArgTag>(tag)) {
+            case LogArgTag::i64:
+            case LogArgTag::u64: {
+                uint64_t v;
+                if (!varint(v)) return false;
+                if (static_cast<LogArgTag>(tag) == LogArgTag::i64) v = static_cast<uint64_t>(zigzag_decode(v));
+                args.push_back(static_cast<char>(tag));
+                args.append(reinterpret_cast<const char*>(&v), 8);
+                return true;
+            }
+            case LogArgTag::f64: {
+                char v[8];
+                if (!bytes(v, 8)) return false;
+                args.push_back(static_cast<char>(tag));
+                args.append(v, 8);
+                return true;
+            }
+            case LogArgTag::boolean:
+            case LogArgTag::character: {
+                uint8_t v;
+                if (!byte(v)) return false;
+                args.push_back(static_cast<char>(tag));
+                args.push_back(static_cast<char>(v));
+                return true;
+            }
+            case LogArgTag::string: {
+                if (!text(text_)) return false;
+                uint32_t size = static_cast<uint32_t>(text_.size());
+                args.push_back(static_cast<char>(tag));
+                args.append(reinterpret_cast<const char*>(&size), 4);
+                args.append(text_);
+                return true;
+            }
+            default:
+                throw std::runtime_error("Corrupt binary log: unknown argument tag");
+        }
+    }
+
+private:
+    std::streambuf* buf_;
+    std::string text_;
+};
+
+} // namespace _internal
+
+// Renders a stream written by Logger::set_binary_output() as log lines, using the current level
+// labels and colours (Config and applyLogLevelColor) and prefixing each line with its wall-clock
+// time. Returns the number of records; a stream cut off mid-record ends at the last whole one.
+inline size_t decode_binary_log(std::istream& in, std::ostream& out, bool colored = true, TimestampPrecision precision = TimestampPrecision::milliseconds) {
+    _internal::BinaryLogReader reader(in);
+    char magic[sizeof(_internal::binary_log_magic)];
+    if (!reader.bytes(magic, sizeof(magic)) || std::memcmp(magic, _internal::binary_log_magic, sizeof(magic)) != 0) {
+        throw std::runtime_error("Not a colorterm binary log");
+    }
+    std::vector<std::string> strings(1);
+    std::string args;
+    std::string line;
+    _internal::TimestampCache timestamp;
+    int64_t time = 0;
+    size_t records = 0;
+    uint8_t kind;
+    while (reader.byte(kind)) {
+        if (kind == _internal::binary_string_record) {
+            uint64_t id;
+            std::string text;
+            if (!reader.varint(id) || !reader.text(text)) break;
+            if (id == 0 || id > strings.size()) throw std::runtime_error("Corrupt binary log: bad string id");
+            if (id == strings.size()) strings.emplace_back();
+            strings[id] = std::move(text);
+            continue;
+        }
+        if (kind != _internal::binary_log_record) throw std::runtime_error("Corrupt binary log: unknown record type");
+        uint8_t level;
+        uint64_t delta, location, format, count;
+        if (!reader.byte(level) || !reader.varint(delta) || !reader.varint(location) || !reader.varint(format) || !reader.varint(count)) break;
+        if (level >= _internal::log_level_count || location >= strings.size() || format >= strings.size()) {
+            throw std::runtime_error("Corrupt binary log: bad record");
+        }
+        args.clear();
+        uint64_t read = 0;
+        while (read < count && reader.arg(args)) ++read;
+        if (read < count) break;
+        time += _internal::zigzag_decode(delta);
+        line.clear();
+        timestamp.append(line, time, precision);
+        line.push_back(' ');
+        const _internal::LogPrefixTable& table = _internal::log_prefix_table();
+        _internal::append_log_prefix(line, table, static_cast<LogLevel>(level), strings[location], colored, 0);
+        _internal::format_log_args(line, format != 0 ? strings[format].c_str() : "{}", args.data(), static_cast<size_t>(count));
+        _internal::append_log_suffix(line, table, static_cast<LogLevel>(level), colored);
+        out.write(line.data(), static_cast<std::streamsize>(line.size()));
+        ++records;
+    }
+    return records;
+}
+
+// Snapshot of Logger metrics; see Logger::metrics(). Latencies cover the whole Logger call,
+// including rate limiting and, in synchronous mode, formatting and writing.
+struct LogMetrics {
+    std::array<uint64_t, _internal::log_level_count> messages{};    // indexed by LogLevel
+    uint64_t bytes_written = 0;
+    uint64_t dropped = 0;
+    uint64_t suppressed = 0;
+    uint64_t mutex_waits = 0;       // contended acquisitions of the output lock
+    uint64_t mutex_wait_ns = 0;
+    uint64_t calls = 0;
+    uint64_t latency_p50_ns = 0;
+    uint64_t latency_p90_ns = 0;
+    uint64_t latency_p99_ns = 0;
+    uint64_t latency_p999_ns = 0;
+    uint64_t latency_max_ns = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> latency_histogram;     // (bucket upper bound ns, count), non-empty buckets only
+};
+
+// Format string for the {} logging overloads. Deferred and binary records keep only the
+// pointer, so it has to be a string literal; COLORTERM_FMT("...") builds one and does not
+// compile for anything else.
+class LogFormat {
+public:
+    struct literal_tag {};
+
+    constexpr LogFormat(literal_tag, const char* text) : text_(text) {}
+
+    constexpr const char* c_str() const { return text_; }
+
+private:
+    const char* text_;
+};
+
+#define COLORTERM_FMT(text) colorterm::LogFormat(colorterm::LogFormat::literal_tag{}, "" text)
+
+// Per-call-site descriptor, built once by the COLORTERM_*_HERE macros: level, file basename,
+// line and function, plus the "file:line " text written in front of each message. The
+// location text is interned so records still pointing at it outlive the LogSite.
+struct LogSite {
+    LogSite(LogLevel level, const char* path, int line, const char* function) : level(level), line(line), function(function) {
+        std::string_view full(path);
+        size_t slash = full.find_last_of("/\\");
+        file = slash == std::string_view::npos ? full : full.substr(slash + 1);
+        std::string text;
+        _internal::append_log_location(text, file, line);
+        location = _internal::intern_log_site_text(std::move(text));
+    }
+
+    LogLevel level;
+    int line;
+    const char* function;
+    std::string_view file;
+    std::string_view location;
+};
+
+// Logging class to manage log messages
+class Logger {
+public:
+    // Define logging functions using a macro
+    #define DEFINE_LOG_FUNCTION(level) \
+    static void level(const std::string& msg) { \
+        if (active<LogLevel::level>()) log(LogLevel::level, msg); \
+    } \
+    static void level(std::string_view file, int line, std::string_view msg) { \
+        if (active<LogLevel::level>()) log(LogLevel::level, file, line, msg); \
+    } \
+    template <typename MessageFn, typename = std::enable_if_t<std::is_invocable_v<MessageFn&>>> \
+    static void level(MessageFn&& make_message) { \
+        if (active<LogLevel::level>()) log(LogLevel::level, std::string(make_message())); \
+    } \
+    template <typename... Args> \
+    static void level(LogFormat format, const Args&... args) { \
+        if (active<LogLevel::level>()) log_format(LogLevel::level, std::string_view(), format.c_str(), _internal::capture_log_arg(args)...); \
+    }
+
+    DEFINE_LOG_FUNCTION(info)
+    DEFINE_LOG_FUNCTION(debug)
+    DEFINE_LOG_FUNCTION(warn)
+    DEFINE_LOG_FUNCTION(error)
+    DEFINE_LOG_FUNCTION(fatal)
+    DEFINE_LOG_FUNCTION(trace)
+
+    #undef DEFINE_LOG_FUNCTION
+
+    // Compile-time and runtime level check; the message-building forms only run when this is true
+    template <LogLevel Level>
+    static bool enabled() {
+        if constexpr (_internal::log_severity(Level) < COLORTERM_MIN_LOG_LEVEL) {
+            return false;
+        } else {
+            return _internal::log_severity(Level) >= _internal::log_threshold.load(std::memory_order_relaxed);
+        }
+    }
+
+    // True when a level is either written or captured by the flight recorder; the logging
+    // functions and COLORTERM_* macros only evaluate their arguments when this holds
+    template <LogLevel Level>
+    static bool active() {
+        if constexpr (_internal::log_severity(Level) < COLORTERM_MIN_LOG_LEVEL) {
+            return false;
+        } else {
+            return _internal::log_severity(Level) >= _internal::log_active_threshold.load(std::memory_order_relaxed);
+        }
+    }
+
+    static bool is_active(LogLevel level) {
+        return _internal::log_severity(level) >= COLORTERM_MIN_LOG_LEVEL &&
+               _internal::log_severity(level) >= _internal::log_active_threshold.load(std::memory_order_relaxed);
+    }
+
+    static bool is_enabled(LogLevel level) {
+        return _internal::log_severity(level) >= COLORTERM_MIN_LOG_LEVEL &&
+               _internal::log_severity(level) >= _internal::log_threshold.load(std::memory_order_relaxed);
+    }
+
+    // Messages below this level are skipped before any locking or formatting
+    static void set_level(LogLevel level) {
+        auto& state = _internal::flight_recorder_state();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        _internal::log_threshold.store(_internal::log_severity(level), std::memory_order_relaxed);
+        _internal::update_log_active_threshold_locked();
+    }
+
+    // Switch to asynchronous logging: callers push records into their thread's lock-free ring
+    // buffer and a background thread formats, colours and writes them in batches. At most
+    // `capacity` records wait in all: each thread's ring holds an equal share of them, and
+    // `policy` says what a full ring does. Under drop_oldest the threads share one queue of
+    // `capacity` records instead, so the oldest can be evicted.
+    static void enable_async(size_t capacity = 8192, OverflowPolicy policy = OverflowPolicy::block) {
+        _internal::async_log_backend().start(capacity, policy);
+    }
+
+    // Write out everything still queued and return to synchronous logging
+    static void disable_async() {
+        _internal::async_log_backend().stop();
+    }
+
+    static bool is_async() {
+        return _internal::async_log_backend().running();
+    }
+
+    // Block until every message logged so far has reached the output
+    static void flush() {
+        emit_pending_summaries();
+        _internal::async_log_backend().flush();
+        _internal::log_staging_registry().hand_off_all();
+        _internal::log_output().flush();
+        _internal::binary_log_writer().flush();
+    }
+
+    // Choose when buffered log output is flushed: after every line (the default), never,
+    // on error or fatal, every `bytes` bytes, every `interval`, or only on Logger::flush().
+    // Fatal messages always flush. Buffered text goes to the sinks whenever 64 KiB (or `bytes`)
+    // is pending; the interval is checked as lines are written and by a background ticker.
+    static void set_flush_policy(FlushPolicy policy, size_t bytes = 64 * 1024, std::chrono::milliseconds interval = std::chrono::milliseconds(1000)) {
+        _internal::log_output().set_policy(policy, bytes, interval);
+        if (policy == FlushPolicy::every_interval) _internal::log_ticker().start(&Logger::tick, interval);
+    }
+
+    // Prefix each line with the local wall-clock time, the time since logging started, or both
+    static void set_timestamp(LogTimestamp mode, TimestampPrecision precision = TimestampPrecision::milliseconds) {
+        _internal::log_clock();
+        _internal::log_timestamp_precision.store(precision, std::memory_order_relaxed);
+        _internal::log_timestamp_mode.store(mode, std::memory_order_relaxed);
+    }
+
+    // Log from the call site described by `site`; usually reached through COLORTERM_INFO_HERE
+    // and friends, which keep one static LogSite per call site
+    static void at(const LogSite& site, std::string_view msg) {
+        if (is_active(site.level)) dispatch(site.level, _internal::LogStaticText{site.location}, msg);
+    }
+
+    template <typename MessageFn, typename = std::enable_if_t<std::is_invocable_v<MessageFn&>>>
+    static void at(const LogSite& site, MessageFn&& make_message) {
+        if (is_active(site.level)) dispatch(site.level, _internal::LogStaticText{site.location}, std::string(make_message()));
+    }
+
+    template <typename... Args>
+    static void at(const LogSite& site, LogFormat format, const Args&... args) {
+        if (is_active(site.level)) log_format(site.level, _internal::LogStaticText{site.location}, format.c_str(), _internal::capture_log_arg(args)...);
+    }
+
+    // Replace the log destinations; the default is a single coloured std::cerr sink. Each
+    // line is formatted once per colour variant in use, not once per sink.
+    static void set_sinks(std::vector<LogSink> sinks) {
+        _internal::log_output().set_sinks(std::move(sinks));
+    }
+
+    static void add_sink(LogSink sink) {
+        _internal::log_output().add_sink(std::move(sink));
+    }
+
+    // Write a compact binary record stream (level, time, call-site and format ids, raw
+    // arguments) instead of text; decode_binary_log() or colorterm_decode renders it later.
+    // Text sinks receive nothing until disable_binary_output().
+    static void set_binary_output(const std::string& path) {
+        auto file = std::make_shared<std::ofstream>(path, std::ios::binary | std::ios::trunc);
+        if (!*file) throw std::runtime_error("Failed to open binary log file: " + path);
+        flush();
+        _internal::binary_log_writer().open(LogSink{
+            [file](std::string_view bytes) { file->write(bytes.data(), static_cast<std::streamsize>(bytes.size())); },
+            [file] { file->flush(); },
+            false});
+    }
+
+    static void set_binary_output(std::ostream& stream) {
+        flush();
+        _internal::binary_log_writer().open(LogSink{
+            [&stream](std::string_view bytes) { stream.write(bytes.data(), static_cast<std::streamsize>(bytes.size())); },
+            [&stream] { stream.flush(); },
+            false});
+    }
+
+    static void disable_binary_output() {
+        flush();
+        _internal::binary_log_writer().close();
+    }
+
+    // Stage synchronous log lines in per-thread buffers and write each batch with a single
+    // call once it reaches `bytes` or `interval` old; error and fatal lines go out at once.
+    // The log ticker hands off batches from threads that have gone quiet. With tag_lines,
+    // lines are tagged "T<thread>#<seq>@<steady ns>" so the interleaving can be reconstructed.
+    static void enable_staging(size_t bytes = 16 * 1024, std::chrono::milliseconds interval = std::chrono::milliseconds(100), bool tag_lines = false) {
+        auto& config = _internal::log_staging_config();
+        config.bytes.store(bytes, std::memory_order_relaxed);
+        config.interval_ns.store(std::chrono::nanoseconds(interval).count(), std::memory_order_relaxed);
+        config.tag_lines.store(tag_lines, std::memory_order_relaxed);
+        config.enabled.store(true, std::memory_order_release);
+        _internal::log_ticker().start(&Logger::tick, interval);
+    }
+
+    static void disable_staging() {
+        _internal::log_staging_config().enabled.store(false, std::memory_order_release);
+        _internal::log_staging_registry().hand_off_all();
+    }
+
+    // Records discarded by the drop and drop_oldest overflow policies
+    static uint64_t dropped_count() {
+        return _internal::async_log_backend().dropped();
+    }
+
+    // Limit repeated lines per call site or per message; suppressed lines are counted in
+    // suppressed_count() and reported as "message repeated N times: ..." before the key's next
+    // line, by the log ticker once `interval` has passed, on flush() and at exit
+    static void set_rate_limit(const RateLimit& limit) {
+        _internal::log_rate_limiter().configure(limit, [](const _internal::RepeatSummary& summary) { emit_summary(summary); });
+        if (limit.mode != RateLimitMode::off) _internal::log_ticker().start(&Logger::tick, limit.interval);
+    }
+
+    static uint64_t suppressed_count() {
+        return _internal::log_rate_limiter().suppressed();
+    }
+
+    // Keep the last `records` log records of every level, including ones filtered from the
+    // output, in a fixed in-memory ring. Records longer than `record_bytes` (clamped to
+    // 64..1024) are cut short. The ring is split into `shards` per-thread shards, by default one
+    // per core, up to 16 and as long as each keeps 64 records. The ring is dumped after a fatal
+    // message, by dump_flight_recorder(), and by the handlers from
+    // install_flight_recorder_signal_handlers().
+    static void enable_flight_recorder(size_t records = 4096, size_t record_bytes = 256, size_t shards = 0) {
+        _internal::log_clock();
+        auto& state = _internal::flight_recorder_state();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.recorders.push_back(std::make_unique<_internal::FlightRecorder>(records, record_bytes, _internal::log_prefix_table(), shards));
+        state.active.store(state.recorders.back().get(), std::memory_order_release);
+        _internal::update_log_active_threshold_locked();
+    }
+
+    static void disable_flight_recorder() {
+        auto& state = _internal::flight_recorder_state();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.active.store(nullptr, std::memory_order_release);
+        _internal::update_log_active_threshold_locked();
+    }
+
+    // Where dumps go: a file descriptor (stderr by default) or a file opened now, so that
+    // a signal handler never has to open it
+    static void set_flight_recorder_output(int fd) {
+        _internal::flight_recorder_state().fd.store(fd, std::memory_order_relaxed);
+    }
+
+    static void set_flight_recorder_output(const std::string& path) {
+#if defined(_WIN32) || defined(_WIN64)
+        int fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, 0644);
+#else
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+#endif
+        if (fd < 0) throw std::runtime_error("Failed to open flight recorder output: " + path);
+        set_flight_recorder_output(fd);
+    }
+
+    // Async-signal-safe: formats without allocating and writes with write(2)
+    static void dump_flight_recorder() {
+        _internal::dump_flight_recorder_signal_safe(_internal::flight_recorder_state().fd.load(std::memory_order_relaxed));
+    }
+
+    // Dump the flight recorder on SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT, then pass the
+    // signal on to whichever handler was installed before (by default, the default action).
+    // The handlers run on an alternate stack, set up here for the calling thread only; other
+    // threads that may overflow their stack need their own sigaltstack().
+    static void install_flight_recorder_signal_handlers() {
+#if !defined(_WIN32) && !defined(_WIN64)
+        _internal::install_flight_recorder_alt_stack();
+#endif
+        for (int signal_number : {SIGSEGV, SIGFPE, SIGILL, SIGABRT
+#if !defined(_WIN32) && !defined(_WIN64)
+                                  , SIGBUS
+#endif
+             }) {
+            _internal::install_flight_recorder_signal_handler(signal_number);
+        }
+    }
+
+    // Count messages per level and time each call into a latency histogram. Bytes written,
+    // drops, suppressions and output-lock contention are tracked regardless.
+    static void enable_metrics(bool enabled = true) {
+        _internal::log_metrics_enabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    static void reset_metrics() {
+        _internal::log_metrics().reset();
+    }
+
+    // Sums the per-thread counters into a snapshot
+    static LogMetrics metrics() {
+        const auto& registry = _internal::log_metrics();
+        LogMetrics snapshot;
+        std::vector<uint64_t> latency(_internal::latency_bucket_count, 0);
+        for (const auto& slot : registry.slots()) {
+            for (size_t i = 0; i < snapshot.messages.size(); ++i) snapshot.messages[i] += slot.messages[i].load(std::memory_order_relaxed);
+            for (size_t i = 0; i < latency.size(); ++i) latency[i] += slot.latency[i].load(std::memory_order_relaxed);
+            snapshot.latency_max_ns = std::max(snapshot.latency_max_ns, slot.latency_max.load(std::memory_order_relaxed));
+        }
+        snapshot.bytes_written = registry.bytes_written.load(std::memory_order_relaxed);
+        snapshot.dropped = dropped_count();
+        snapshot.suppressed = suppressed_count();
+        snapshot.mutex_waits = registry.mutex_waits.load(std::memory_order_relaxed);
+        snapshot.mutex_wait_ns = registry.mutex_wait_ns.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < latency.size(); ++i) {
+            if (latency[i] == 0) continue;
+            snapshot.calls += latency[i];
+            snapshot.latency_histogram.emplace_back(_internal::latency_bucket_upper(i), latency[i]);
+        }
+        auto percentile = [&](double fraction) {
+            uint64_t rank = static_cast<uint64_t>(fraction * snapshot.calls);
+            uint64_t seen = 0;
+            for (const auto& [upper, count] : snapshot.latency_histogram) {
+                seen += count;
+                if (seen > rank) return std::min(upper, snapshot.latency_max_ns);
+            }
+            return snapshot.latency_max_ns;
+        };
+        snapshot.latency_p50_ns = percentile(0.5);
+        snapshot.latency_p90_ns = percentile(0.9);
+        snapshot.latency_p99_ns = percentile(0.99);
+        snapshot.latency_p999_ns = percentile(0.999);
+        return snapshot;
+    }
+
+private:
+    // Periodic work run on the log ticker thread; `final` is the last call, at exit
+    static void tick(bool final) {
+        emit_pending_summaries(final);
+        if (final) {
+            _internal::log_staging_registry().hand_off_all();
+        } else {
+            _internal::log_staging_registry().hand_off_stale();
+        }
+        _internal::log_output().tick();
+    }
+
+    static void log(LogLevel level, const std::string& msg) {
+        dispatch(level, std::string_view(), msg);
+    }
+
+    static void log(LogLevel level, std::string_view file, int line, std::string_view msg) {
+        thread_local std::string location;
+        location.clear();
+        _internal::append_log_location(location, file, line);
+        dispatch(level, std::string_view(location), msg);
+    }
+
+    // Location is either rendered "file:line " text or a LogSite's static text
+    template <typename Location>
+    static void dispatch(LogLevel level, const Location& location, std::string_view msg) {
+        if (_internal::FlightRecorder* recorder = _internal::flight_recorder()) {
+            size_t size = _internal::deferred_record_size(location, msg);
+            recorder->record(size, [&](char* p) { _internal::encode_deferred_record(p, size, level, 0, nullptr, location, msg); });
+        }
+        if (!is_enabled(level)) return;
+        _internal::LogCallTimer timer(level);
+        if (!admit(level, location, nullptr, msg)) return;
+        emit(level, location, msg);
+        if (level == LogLevel::fatal) dump_on_fatal();
+    }
+
+    static void dump_on_fatal() {
+        if (_internal::flight_recorder() != nullptr) {
+            flush();
+            dump_flight_recorder();
+        }
+    }
+
+    // Rate limiter check, a single relaxed load when limiting is off. Call-site keys use the
+    // location (or the format string when there is none); message keys use the text or format.
+    template <typename Location>
+    static bool admit(LogLevel level, const Location& location, const char* format, std::string_view msg) {
+        auto& limiter = _internal::log_rate_limiter();
+        if (!limiter.active()) return true;
+        std::string_view where = _internal::log_location_text(location);
+        uint64_t key;
+        if (limiter.key() == RateLimitKey::call_site && !where.empty()) {
+            key = std::is_same_v<Location, _internal::LogStaticText> ? _internal::hash_log_key(where.data()) : _internal::hash_log_key(where);
+        } else {
+            key = format != nullptr ? _internal::hash_log_key(format, _internal::hash_log_key(where)) : _internal::hash_log_key(msg);
+        }
+        _internal::RepeatSummary summary;
+        bool allow = limiter.admit(key, level, format != nullptr ? std::string_view(format) : msg, summary);
+        if (summary.count != 0) emit_summary(summary);
+        return allow;
+    }
+
+    static void emit_summary(const _internal::RepeatSummary& summary) {
+        std::string msg = "message repeated " + std::to_string(summary.count) + " times: ";
+        msg.append(summary.text, summary.size);
+        emit(summary.level, std::string_view(), msg);
+    }
+
+    static void emit_pending_summaries(bool all = true) {
+        auto& limiter = _internal::log_rate_limiter();
+        if (limiter.active()) limiter.drain_summaries([](const _internal::RepeatSummary& summary) { emit_summary(summary); }, all);
+    }
+
+    template <typename Location>
+    static void emit(LogLevel level, const Location& location, std::string_view msg) {
+        int64_t time = _internal::log_time_now();
+        auto& backend = _internal::async_log_backend();
+        if (backend.running()) {
+            // Encoded like a format call with no format, on the same path as the thread's other
+            // records. Call sites with a static location keep only a pointer to it.
+            size_t size = _internal::deferred_record_size(location, msg);
+            if (backend.push(size, [&](char* p) { _internal::encode_deferred_record(p, size, level, time, nullptr, location, msg); })) {
+                if (level == LogLevel::fatal) backend.flush();
+                return;
+            }
+        }
+        if (_internal::binary_log_enabled.load(std::memory_order_acquire)) {
+            _internal::write_binary_message(level, time, location, msg);
+            return;
+        }
+        std::string_view where = _internal::log_location_text(location);
+        if (_internal::log_staging_config().enabled.load(std::memory_order_acquire)) {
+            _internal::thread_log_staging_buffer().stage(level, [&](std::string& out, bool colored) { _internal::format_log_line(out, level, where, msg, colored, time); });
+            return;
+        }
+        thread_local _internal::LogText buffer;
+        buffer.clear();
+        _internal::render_log_text(buffer, [&](std::string& out, bool colored) { _internal::format_log_line(out, level, where, msg, colored, time); });
+        _internal::log_output().write(buffer, level);
+    }
+
+    // Format strings are literals, so in async mode only the pointer and the binary-encoded
+    // arguments are copied into the calling thread's buffer; the writer thread does the
+    // formatting, whatever the record's size. Synchronous mode encodes into scratch space
+    // and formats right away.
+    template <typename Location, typename... Args>
+    static void log_format(LogLevel level, const Location& location, const char* format, const Args&... args) {
+        size_t size = _internal::deferred_record_size(location, args...);
+        if (_internal::FlightRecorder* recorder = _internal::flight_recorder()) {
+            recorder->record(size, [&](char* p) { _internal::encode_deferred_record(p, size, level, 0, format, location, args...); });
+        }
+        if (!is_enabled(level)) return;
+        _internal::LogCallTimer timer(level);
+        if (!admit(level, location, format, std::string_view())) return;
+        int64_t time = _internal::log_time_now();
+        auto encode = [&](char* p) { _internal::encode_deferred_record(p, size, level, time, format, location, args...); };
+        auto& backend = _internal::async_log_backend();
+        if (backend.running() && backend.push(size, encode)) {
+            if (level == LogLevel::fatal) {
+                backend.flush();
+                dump_on_fatal();
+            }
+            return;
+        }
+        thread_local std::vector<uint64_t> scratch;
+        thread_local _internal::LogText buffer;
+        scratch.resize(size / sizeof(uint64_t));
+        char* p = reinterpret_cast<char*>(scratch.data());
+        encode(p);
+        const auto& header = *reinterpret_cast<const _internal::DeferredRecordHeader*>(p);
+        if (_internal::binary_log_enabled.load(std::memory_order_acquire)) {
+            _internal::binary_log_writer().append(header, p + sizeof(header));
+        } else if (_internal::log_staging_config().enabled.load(std::memory_order_acquire)) {
+            _internal::thread_log_staging_buffer().stage(level, [&](std::string& out, bool colored) { _internal::format_deferred_record(out, header, p + sizeof(header), colored); });
+        } else {
+            buffer.clear();
+            _internal::render_log_text(buffer, [&](std::string& out, bool colored) { _internal::format_deferred_record(out, header, p + sizeof(header), colored); });
+            _internal::log_output().write(buffer, level);
+        }
+        if (level == LogLevel::fatal) dump_on_fatal();
+    }
+};
+
+// Logging macros that skip evaluating their arguments unless the level is enabled:
+// COLORTERM_INFO("user " + name + " connected") builds the string only when info is on.
+#define COLORTERM_LOG(level, ...) do { \
+    if (colorterm::Logger::active<colorterm::LogLevel::level>()) colorterm::Logger::level(__VA_ARGS__); \
+} while (0)
+
+#define COLORTERM_TRACE(...) COLORTERM_LOG(trace, __VA_ARGS__)
+#define COLORTERM_DEBUG(...) COLORTERM_LOG(debug, __VA_ARGS__)
+#define COLORTERM_INFO(...) COLORTERM_LOG(info, __VA_ARGS__)
+#define COLORTERM_WARN(...) COLORTERM_LOG(warn, __VA_ARGS__)
+#define COLORTERM_ERROR(...) COLORTERM_LOG(error, __VA_ARGS__)
+#define COLORTERM_FATAL(...) COLORTERM_LOG(fatal, __VA_ARGS__)
+
+// Same, prefixed with "file:line " from a static LogSite built the first time the call site
+// runs: no per-call std::string for __FILE__, and only the file's basename is printed
+#define COLORTERM_LOG_HERE(level, ...) do { \
+    if (colorterm::Logger::active<colorterm::LogLevel::level>()) { \
+        static const colorterm::LogSite colorterm_log_site(colorterm::LogLevel::level, __FILE__, __LINE__, __func__); \
+        colorterm::Logger::at(colorterm_log_site, __VA_ARGS__); \
+    } \
+} while (0)
+
+#define COLORTERM_TRACE_HERE(...) COLORTERM_LOG_HERE(trace, __VA_ARGS__)
+#define COLORTERM_DEBUG_HERE(...) COLORTERM_LOG_HERE(debug, __VA_ARGS__)
+#define COLORTERM_INFO_HERE(...) COLORTERM_LOG_HERE(info, __VA_ARGS__)
+#define COLORTERM_WARN_HERE(...) COLORTERM_LOG_HERE(warn, __VA_ARGS__)
+#define COLORTERM_ERROR_HERE(...) COLORTERM_LOG_HERE(error, __VA_ARGS__)
+#define COLORTERM_FATAL_HERE(...) COLORTERM_LOG_HERE(fatal, __VA_ARGS__)
+
+} // namespace colorterm
+
+
+
+namespace colorterm {
+namespace _internal {
+
+
+
+// custom_regex_replace function to replace all occurrences of a substring in a string
+inline std::string custom_regex_replace(const std::string& str, const std::string& from, const std::string& to) {
+    std::string result = str;
+    size_t start_pos = 0;
+    while ((start_pos = result.find(from, start_pos)) != std::string::npos) {
+        result.replace(start_pos, from.length(), to);
+        start_pos += to.length(); // In case 'to' contains 'from', like replacing 'x' with 'yx'
+    }
+    return result;
+}
+
+
+
+struct ThemeRGB {
+    uint8_t r, g, b;
+};
+
+// 256-bit byte set laid out for nibble-shuffle lookups: bit (b >> 4) & 7 of low[b & 15]
+// (bytes below 0x80) or high[b & 15] (the rest) is set when byte b is in the set
+struct ByteClass {
+    alignas(16) uint8_t low[16] = {};
+    alignas(16) uint8_t high[16] = {};
+
+    constexpr void add(unsigned char b) { (b < 0x80 ? low : high)[b & 15] |= static_cast<uint8_t>(1u << ((b >> 4) & 7)); }
+    constexpr bool contains(unsigned char b) const { return ((b < 0x80 ? low : high)[b & 15] >> ((b >> 4) & 7)) & 1; }
+};
+
+inline const char* find_byte_class_scalar(const char* p, const char* end, const ByteClass& set) {
+    while (p != end && !set.contains(static_cast<unsigned char>(*p))) ++p;
+    return p;
+}
+
+#if defined(COLORTERM_SIMD_X86)
+inline int count_trailing_zeros(uint32_t value) { return __builtin_ctz(value); }
+
+// pshufb returns 0 for index bytes with the top bit set, so looking up x in low and x ^ 0x80
+// in high picks the right half without a blend; the high nibble then selects the bit
+__attribute__((target("ssse3"))) inline const char* find_byte_class_ssse3(const char* p, const char* end, const ByteClass& set) {
+    const __m128i low = _mm_load_si128(reinterpret_cast<const __m128i*>(set.low));
+    const __m128i high = _mm_load_si128(reinterpret_cast<const __m128i*>(set.high));
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i top = _mm_set1_epi8(-128);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    for (; end - p >= 16; p += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i row = _mm_or_si128(_mm_shuffle_epi8(low, x), _mm_shuffle_epi8(high, _mm_xor_si128(x, top)));
+        __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(x, 4), nibble));
+        uint32_t miss = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), _mm_setzero_si128())));
+        if (miss != 0xffff) return p + count_trailing_zeros(~miss);
+    }
+    return find_byte_class_scalar(p, end, set);
+}
+
+__attribute__((target("avx2"))) inline const char* find_byte_class_avx2(const char* p, const char* end, const ByteClass& set) {
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(set.low)));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(set.high)));
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i top = _mm256_set1_epi8(-128);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    for (; end - p >= 32; p += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i row = _mm256_or_si256(_mm256_shuffle_epi8(low, x), _mm256_shuffle_epi8(high, _mm256_xor_si256(x, top)));
+        __m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+        uint32_t miss = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, bit), _mm256_setzero_si256())));
+        if (miss != 0xffffffffu) return p + count_trailing_zeros(~miss);
+    }
+    return find_byte_class_ssse3(p, end, set);
+}
+#elif defined(COLORTERM_SIMD_NEON)
+// tbl returns 0 for out-of-range indices, so both halves are looked up by the low nibble
+// and the high nibble's top bit selects between them
+inline const char* find_byte_class_neon(const char* p, const char* end, const ByteClass& set) {
+    const uint8x16_t low = vld1q_u8(set.low);
+    const uint8x16_t high = vld1q_u8(set.high);
+    static const uint8_t bit_table[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    const uint8x16_t bits = vld1q_u8(bit_table);
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t x = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+        uint8x16_t lo = vandq_u8(x, vdupq_n_u8(0x0f));
+        uint8x16_t hi = vshrq_n_u8(x, 4);
+        uint8x16_t row = vbslq_u8(vcltq_u8(x, vdupq_n_u8(0x80)), vqtbl1q_u8(low, lo), vqtbl1q_u8(high, lo));
+        uint8x16_t hit = vtstq_u8(row, vqtbl1q_u8(bits, hi));
+        // Four mask bits per byte
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+        if (mask != 0) return p + (__builtin_ctzll(mask) >> 2);
+    }
+    return find_byte_class_scalar(p, end, set);
+}
+#endif
+
+// First byte in [p, end) that is in set, or end. Picks the widest vector unit the CPU has,
+// falling back to a scalar loop
+inline const char* find_byte_class(const char* p, const char* end, const ByteClass& set) {
+#if defined(COLORTERM_SIMD_X86)
+    using Scanner = const char* (*)(const char*, const char*, const ByteClass&);
+    static const Scanner scanner = __builtin_cpu_supports("avx2") ? find_byte_class_avx2
+                                 : __builtin_cpu_supports("ssse3") ? find_byte_class_ssse3
+                                 : find_byte_class_scalar;
+    return scanner(p, end, set);
+#elif defined(COLORTERM_SIMD_NEON)
+    return find_byte_class_neon(p, end, set);
+#else
+    return find_byte_class_scalar(p, end, set);
+#endif
+}
+
+// Span table entry for the UTF-8 lead byte of a mapped code point: the character has to be
+// decoded and looked up before its colour is known
+inline constexpr uint16_t wide_span = 0xFFFF;
+
+// Colours text with a per-byte span table, for ColorMapping and StaticTheme alike. Mapped
+// bytes are found with the vector scanner and unmapped runs copied in bulk; a run of
+// characters with the same colour shares one escape and reset. span_at(p, length) gives the
+// span of the character at p (0 if unmapped) and its length; spans[span] is its escape.
+// Streaming input passes open, the span of a run the previous piece left open (0 if none):
+// the run is continued, and a run reaching end is left open for the next piece instead of
+// being reset. Returns end.
+template <typename Spans, typename SpanAt>
+inline const char* apply_color_spans(std::string& out, const char* p, const char* end, const std::array<uint16_t, 256>& table,
+                                     const ByteClass& mapped, const Spans& spans, SpanAt&& span_at, uint16_t* open = nullptr) {
+    if (open != nullptr && *open != 0) {
+        const char* run = p;
+        size_t length;
+        while (p != end && span_at(p, length) == *open) p += length;
+        out.append(run, p - run);
+        if (p == end) return end;
+        out.append("\033[0m");
+        *open = 0;
+    }
+    while (p != end) {
+        const char* run = p;
+        // Short gaps between mapped bytes are cheaper to step over than to hand to the scanner
+        const char* probe = p + std::min<ptrdiff_t>(end - p, 8);
+        while (p != probe && table[static_cast<unsigned char>(*p)] == 0) ++p;
+        if (p == probe) p = find_byte_class(p, end, mapped);
+        out.append(run, p - run);
+        if (p == end) return end;
+        size_t length;
+        uint16_t span = span_at(p, length);
+        if (span == 0) {
+            out.append(p, length);
+            p += length;
+            continue;
+        }
+        run = p;
+        p += length;
+        while (p != end && span_at(p, length) == span) p += length;
+        out.append(spans[span]);
+        out.append(run, p - run);
+        if (p == end && open != nullptr) {
+            *open = span;
+            return end;
+        }
+        out.append("\033[0m");
+    }
+    return end;
+}
+
+// Resets a run apply_color_spans left open
+inline void close_color_span(std::string& out, uint16_t* open) {
+    if (open == nullptr || *open == 0) return;
+    out.append("\033[0m");
+    *open = 0;
+}
+
+
+// Aho-Corasick automaton over a theme's multi-character keys or values, stored as a full
+// transition table over the bytes that occur in some pattern. find() makes one pass over the
+// text; outside a partial match it jumps to the next byte that can start a pattern, using
+// the vector scanner.
+class TokenMatcher {
+public:
+    struct Match {
+        size_t start;
+        size_t end;
+        uint16_t span;
+    };
+
+    bool empty() const { return states_.size() <= 1; }
+
+    // Longest pattern; a match can start at most this many bytes minus one before a chunk's end
+    size_t max_length() const { return max_length_; }
+
+    // Whether some pattern contains byte b
+    bool uses_byte(unsigned char b) const { return classes_[b] != 0; }
+
+    void build(const std::vector<std::pair<std::string, uint16_t>>& patterns) {
+        classes_.fill(0);
+        first_ = ByteClass();
+        class_count_ = 1;
+        max_length_ = 0;
+        for (const auto& [pattern, span] : patterns) {
+            max_length_ = std::max(max_length_, pattern.size());
+            for (char c : pattern) {
+                uint16_t& cls = classes_[static_cast<unsigned char>(c)];
+                if (cls == 0) cls = static_cast<uint16_t>(class_count_++);
+            }
+            if (!pattern.empty()) first_.add(static_cast<unsigned char>(pattern[0]));
+        }
+        states_.assign(1, State{});
+        next_.assign(class_count_, 0);
+        // Trie; 0 doubles as "no child" since nothing transitions back into the root here
+        for (const auto& [pattern, span] : patterns) {
+            if (pattern.empty()) continue;
+            int32_t s = 0;
+            for (char c : pattern) {
+                size_t slot = static_cast<size_t>(s) * class_count_ + classes_[static_cast<unsigned char>(c)];
+                if (next_[slot] == 0) {
+                    next_[slot] = static_cast<int32_t>(states_.size());
+                    states_.push_back(State{});
+                    next_.resize(states_.size() * class_count_, 0);
+                }
+                s = next_[slot];
+            }
+            states_[s].length = static_cast<uint32_t>(pattern.size());
+            states_[s].span = span;
+        }
+        // Breadth-first failure links, folded into the transition table
+        std::vector<int32_t> queue;
+        for (size_t c = 0; c < class_count_; ++c) {
+            if (int32_t child = next_[c]) queue.push_back(child);
+        }
+        for (size_t head = 0; head < queue.size(); ++head) {
+            int32_t s = queue[head];
+            const State& fail = states_[states_[s].fail];
+            states_[s].output = fail.length != 0 ? states_[s].fail : fail.output;
+            for (size_t c = 0; c < class_count_; ++c) {
+                int32_t& child = next_[static_cast<size_t>(s) * class_count_ + c];
+                int32_t fallback = next_[static_cast<size_t>(states_[s].fail) * class_count_ + c];
+                if (child != 0) {
+                    states_[child].fail = fallback;
+                    queue.push_back(child);
+                } else {
+                    child = fallback;
+                }
+            }
+        }
+    }
+
+    // Appends the leftmost-longest, non-overlapping matches in [begin, end) to matches, with
+    // offsets relative to begin. Every match is collected, then the overlaps are resolved.
+    void find(const char* begin, const char* end, std::vector<Match>& matches) const {
+        size_t first = matches.size();
+        int32_t s = 0;
+        for (const char* p = begin; p != end; ++p) {
+            if (s == 0) {
+                p = find_byte_class(p, end, first_);
+                if (p == end) break;
+            }
+            s = next_[static_cast<size_t>(s) * class_count_ + classes_[static_cast<unsigned char>(*p)]];
+            size_t stop = static_cast<size_t>(p - begin) + 1;
+            for (int32_t m = states_[s].length != 0 ? s : states_[s].output; m > 0; m = states_[m].output) {
+                matches.push_back(Match{stop - states_[m].length, stop, states_[m].span});
+            }
+        }
+        std::sort(matches.begin() + first, matches.end(), [](const Match& a, const Match& b) {
+            return a.start != b.start ? a.start < b.start : a.end > b.end;
+        });
+        size_t kept = first;
+        size_t cursor = 0;
+        for (size_t i = first; i < matches.size(); ++i) {
+            if (matches[i].start < cursor) continue;
+            cursor = matches[i].end;
+            matches[kept++] = matches[i];
+        }
+        matches.resize(kept);
+    }
+
+private:
+    struct State {
+        uint32_t length = 0;    // pattern ending in this state, or 0
+        uint16_t span = 0;
+        int32_t output = -1;    // next state along the failure chain that ends a pattern
+        int32_t fail = 0;
+    };
+
+    std::array<uint16_t, 256> classes_{};
+    size_t class_count_ = 1;
+    size_t max_length_ = 0;
+    std::vector<int32_t> next_;
+    std::vector<State> states_;
+    ByteClass first_;
+};
+
+// Binary compiled theme file, written by save_theme_binary() and loaded by load_theme(). Fields
+// are in the writer's byte order, which byte_order records: a machine of the other order reads
+// it swapped and rejects the file. Offsets are from the start of the file and 8-byte aligned.
+//   header | uint16 key_table[256] | uint16 value_table[256] | ThemeFileString colors[]
+//   | ThemeFileEntry entries[] | string bytes
+// Table entries index colors (0 = unmapped); entry and colour strings point into the bytes.
+inline constexpr char theme_file_magic[8] = {'C', 'T', 'T', 'H', 'E', 'M', 'E', '\n'};
+inline constexpr uint32_t theme_file_version = 2;
+inline constexpr uint32_t theme_file_byte_order = 0x01020304;
+
+struct ThemeFileString {
+    uint32_t offset;    // from the start of the string bytes
+    uint32_t size;
+};
+
+struct ThemeFileEntry {
+    uint32_t kind;      // ThemeFileEntryKind
+    uint32_t color;     // index into colors
+    ThemeFileString name;
+};
+
+enum ThemeFileEntryKind : uint32_t { theme_entry_char = 0, theme_entry_key = 1, theme_entry_value = 2, theme_entry_highlight = 3 };
+
+struct ThemeFileHeader {
+    char magic[8];
+    uint32_t byte_order;        // theme_file_byte_order
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t reserved;          // 0
+    uint64_t file_size;
+    uint64_t checksum;          // FNV-1a of everything after the header
+    uint32_t color_count;
+    uint32_t entry_count;
+    uint64_t tables_offset;
+    uint64_t colors_offset;
+    uint64_t entries_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+inline uint64_t fnv1a64(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    return hash;
+}
+
+// Token classes coloured by LogHighlighter. Themes set them by name ("highlight" entries);
+// classes a theme leaves unset use the defaults below.
+enum class HighlightRole : uint8_t { timestamp, debug, info, warning, error, key, string, number, ip, uuid };
+inline constexpr size_t highlight_role_count = 10;
+inline constexpr const char* highlight_role_names[highlight_role_count] = {
+    "timestamp", "debug", "info", "warning", "error", "key", "string", "number", "ip", "uuid"};
+inline constexpr const char* highlight_role_defaults[highlight_role_count] = {
+    "\033[36m", "\033[34m", "\033[32m", "\033[33m", "\033[1;31m", "\033[94m", "\033[92m", "\033[35m", "\033[96m", "\033[95m"};
+
+inline bool highlight_role_from_name(std::string_view name, HighlightRole& role) {
+    for (size_t i = 0; i < highlight_role_count; ++i) {
+        if (name == highlight_role_names[i]) {
+            role = static_cast<HighlightRole>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Read-only view of a whole file: mapped where mmap exists, read into memory otherwise
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#if defined(_WIN32) || defined(_WIN64)
+        std::ifstream in(path, std::ios::binary);
+        if (!in) throw std::runtime_error("Failed to open file: " + path);
+        copy_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data_ = copy_.data();
+        size_ = copy_.size();
+#else
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error("Failed to open file: " + path);
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to stat file: " + path);
+        }
+        size_ = static_cast<size_t>(info.st_size);
+        if (size_ != 0) {
+            void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Failed to map file: " + path);
+            }
+            data_ = static_cast<const char*>(data);
+            mapped_ = true;
+        }
+        ::close(fd);
+#endif
+    }
+
+    ~MappedFile() {
+#if !defined(_WIN32) && !defined(_WIN64)
+        if (mapped_) ::munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const char* data_ = "";
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::string copy_;
+};
+
+class ColorMapping {
+private:
+    std::unordered_map<char, std::string> charToColorCode;
+    // Non-ASCII characters, by code point
+    std::unordered_map<char32_t, std::string> codePointToColorCode;
+    std::unordered_map<std::string, std::string> keyToColorCode;
+    std::unordered_map<std::string, std::string> valueToColorCode;
+    std::unordered_map<std::string, std::string> highlightToColorCode;
+    // Colour of every LogHighlighter token class, with the defaults filled in
+    std::array<std::string, highlight_role_count> highlightColors = default_highlight_colors();
+
+    // Flat per-byte tables rebuilt whenever the maps change: entry 0 means unmapped, anything
+    // else indexes colorSpans. Bytes before the first ':' use keyTable, the rest valueTable.
+    // wide_span marks the UTF-8 lead bytes of mapped code points, which are decoded and
+    // looked up in wideSpans (sorted by code point); ASCII text never reaches the decoder.
+    std::array<uint16_t, 256> keyTable{};
+    std::array<uint16_t, 256> valueTable{};
+    std::vector<std::pair<char32_t, uint16_t>> wideSpans;
+    ByteClass keyClass;
+    ByteClass valueClass;
+    // Keys and values longer than one character
+    TokenMatcher keyTokens;
+    TokenMatcher valueTokens;
+    std::vector<std::string> colorSpans{std::string()};
+    // Index of each colour in colorSpans, past the unmapped entry 0
+    std::unordered_map<std::string, uint16_t> spanIndex;
+    // Set inside update(), where edits only change the maps
+    bool deferTables = false;
+
+    static std::array<std::string, highlight_role_count> default_highlight_colors() {
+        std::array<std::string, highlight_role_count> colors;
+        for (size_t i = 0; i < highlight_role_count; ++i) colors[i] = highlight_role_defaults[i];
+        return colors;
+    }
+
+    void resolve_highlight_colors() {
+        highlightColors = default_highlight_colors();
+        for (const auto& [name, colorCode] : highlightToColorCode) {
+            HighlightRole role;
+            if (highlight_role_from_name(name, role)) highlightColors[static_cast<size_t>(role)] = colorCode;
+        }
+    }
+
+    uint16_t span_index(const std::string& colorCode) {
+        auto [it, added] = spanIndex.emplace(colorCode, static_cast<uint16_t>(colorSpans.size()));
+        if (added) colorSpans.push_back(colorCode);
+        return it->second;
+    }
+
+    void tables_changed() {
+        if (!deferTables) rebuild_tables();
+    }
+
+    // A character mapping wins over a single-character key or value mapping
+    void rebuild_tables() {
+        colorSpans.assign(1, std::string());
+        spanIndex.clear();
+        keyTable.fill(0);
+        valueTable.fill(0);
+        for (const auto& [key, colorCode] : keyToColorCode) {
+            if (key.size() == 1) keyTable[static_cast<unsigned char>(key[0])] = span_index(colorCode);
+        }
+        for (const auto& [value, colorCode] : valueToColorCode) {
+            if (value.size() == 1) valueTable[static_cast<unsigned char>(value[0])] = span_index(colorCode);
+        }
+        for (const auto& [ch, colorCode] : charToColorCode) {
+            keyTable[static_cast<unsigned char>(ch)] = valueTable[static_cast<unsigned char>(ch)] = span_index(colorCode);
+        }
+        build_wide_spans();
+        for (const auto& [cp, span] : wideSpans) {
+            std::string bytes;
+            append_utf8(bytes, cp);
+            keyTable[static_cast<unsigned char>(bytes[0])] = valueTable[static_cast<unsigned char>(bytes[0])] = wide_span;
+        }
+        // Listed in colorSpans only so that the compiled image can refer to them
+        for (const auto& [name, colorCode] : highlightToColorCode) span_index(colorCode);
+        resolve_highlight_colors();
+        compile_matchers();
+    }
+
+    void build_wide_spans() {
+        wideSpans.clear();
+        for (const auto& [cp, colorCode] : codePointToColorCode) wideSpans.emplace_back(cp, span_index(colorCode));
+        std::sort(wideSpans.begin(), wideSpans.end());
+    }
+
+    // Colour span of the character at p and its length: one byte, or a whole code point for
+    // a wide_span lead byte. Unmapped or malformed sequences give span 0.
+    uint16_t span_at(const char* p, const char* end, const std::array<uint16_t, 256>& table, size_t& length) const {
+        uint16_t span = table[static_cast<unsigned char>(*p)];
+        length = 1;
+        if (span != wide_span) return span;
+        char32_t cp;
+        size_t decoded = decode_utf8(p, end, cp);
+        if (decoded == 0) return 0;
+        length = decoded;
+        auto it = std::lower_bound(wideSpans.begin(), wideSpans.end(), std::make_pair(cp, uint16_t{0}));
+        return it != wideSpans.end() && it->first == cp ? it->second : 0;
+    }
+
+    // Length of a UTF-8 sequence cut off by end, which streaming has to hold back
+    static size_t incomplete_utf8_tail(const char* p, const char* end) {
+        for (size_t back = 1; back <= 3 && end - p >= static_cast<ptrdiff_t>(back); ++back) {
+            unsigned char byte = static_cast<unsigned char>(end[-static_cast<ptrdiff_t>(back)]);
+            if ((byte & 0xC0) != 0x80) {
+                size_t length = byte >= 0xF0 ? 4 : byte >= 0xE0 ? 3 : byte >= 0xC0 ? 2 : 1;
+                return length > back ? back : 0;
+            }
+        }
+        return 0;
+    }
+
+    // Calls byte() for ASCII and undecodable bytes of characters and wide() for code points
+    template <typename Byte, typename Wide>
+    static void for_each_character(const std::string& characters, Byte&& byte, Wide&& wide) {
+        const char* p = characters.data();
+        const char* end = p + characters.size();
+        while (p != end) {
+            char32_t cp;
+            size_t length = static_cast<unsigned char>(*p) < 0x80 ? 0 : decode_utf8(p, end, cp);
+            if (length == 0) {
+                byte(*p++);
+            } else {
+                wide(cp);
+                p += length;
+            }
+        }
+    }
+
+    // Byte classes and token automata, derived from the tables and the multi-character mappings
+    void compile_matchers() {
+        std::vector<std::pair<std::string, uint16_t>> keys;
+        std::vector<std::pair<std::string, uint16_t>> values;
+        for (const auto& [key, colorCode] : keyToColorCode) {
+            if (key.size() > 1) keys.emplace_back(key, span_index(colorCode));
+        }
+        for (const auto& [value, colorCode] : valueToColorCode) {
+            if (value.size() > 1) values.emplace_back(value, span_index(colorCode));
+        }
+        keyTokens.build(keys);
+        valueTokens.build(values);
+        keyClass = ByteClass();
+        valueClass = ByteClass();
+        for (int b = 0; b < 256; ++b) {
+            if (keyTable[b] != 0) keyClass.add(static_cast<unsigned char>(b));
+            if (valueTable[b] != 0) valueClass.add(static_cast<unsigned char>(b));
+        }
+    }
+
+    const char* apply_span(std::string& out, const char* p, const char* end, const std::array<uint16_t, 256>& table,
+                           const ByteClass& mapped, uint16_t* open = nullptr) const {
+        return apply_color_spans(out, p, end, table, mapped, colorSpans,
+                                 [&](const char* at, size_t& length) { return span_at(at, end, table, length); }, open);
+    }
+
+    // Multi-character key or value matches are coloured whole; the bytes between them go
+    // through the per-byte tables. Unless final, bytes that may begin a token continuing past
+    // end are left unprocessed, and a same-colour run reaching the cut stays open (see
+    // apply_color_spans); returns how far the text was consumed.
+    const char* apply_tokens(std::string& out, const char* p, const char* end, const TokenMatcher& tokens,
+                             const std::array<uint16_t, 256>& table, const ByteClass& mapped, bool final = true,
+                             uint16_t* open = nullptr) const {
+        // A code point split by end is finished by the next call
+        const char* limit = final || wideSpans.empty() ? end : end - incomplete_utf8_tail(p, end);
+        if (tokens.empty()) {
+            apply_span(out, p, limit, table, mapped, open);
+            if (final) close_color_span(out, open);
+            return limit;
+        }
+        size_t size = static_cast<size_t>(end - p);
+        size_t holdback = final ? 0 : std::min(size, tokens.max_length() - 1);
+        size_t cut = std::min(size - holdback, static_cast<size_t>(limit - p));
+        // The held back bytes may begin inside a code point the tables colour whole; stray
+        // continuation bytes are not part of one
+        if (!wideSpans.empty() && cut < size) {
+            const char* start = _internal::utf8_sequence_start(p, p + cut);
+            char32_t cp;
+            if (decode_utf8(start, end, cp) > static_cast<size_t>(p + cut - start)) cut = static_cast<size_t>(start - p);
+        }
+        thread_local std::vector<TokenMatcher::Match> matches;
+        matches.clear();
+        tokens.find(p, end, matches);
+        size_t done = 0;
+        for (const auto& match : matches) {
+            if (match.start >= cut) break;
+            apply_span(out, p + done, p + match.start, table, mapped, open);
+            close_color_span(out, open);
+            out.append(colorSpans[match.span]);
+            out.append(p + match.start, match.end - match.start);
+            out.append("\033[0m");
+            done = match.end;
+        }
+        cut = std::max(cut, done);
+        apply_span(out, p + done, p + cut, table, mapped, open);
+        if (final) close_color_span(out, open);
+        return p + cut;
+    }
+
+public:
+    // Binary image in the compiled theme file format (ThemeFileHeader): all three mapping
+    // kinds plus the lookup tables
+    std::string to_image() const {
+        std::string strings;
+        auto add_string = [&](const std::string& text) {
+            ThemeFileString ref{static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(text.size())};
+            strings.append(text);
+            return ref;
+        };
+        std::vector<ThemeFileString> colors;
+        for (const auto& color : colorSpans) colors.push_back(add_string(color));
+        std::vector<ThemeFileEntry> entries;
+        auto add_entries = [&](uint32_t kind, const auto& map) {
+            for (const auto& [name, colorCode] : map) {
+                auto it = spanIndex.find(colorCode);
+                uint32_t color = colorCode.empty() || it == spanIndex.end() ? 0 : it->second;
+                entries.push_back(ThemeFileEntry{kind, color, add_string(std::string(name))});
+            }
+        };
+        // Sorted, so that the same theme always produces the same file
+        std::map<std::string, std::string> chars;
+        for (const auto& [ch, colorCode] : charToColorCode) chars.emplace(std::string(1, ch), colorCode);
+        for (const auto& [cp, colorCode] : codePointToColorCode) {
+            std::string bytes;
+            append_utf8(bytes, cp);
+            chars.emplace(bytes, colorCode);
+        }
+        add_entries(theme_entry_char, chars);
+        add_entries(theme_entry_key, std::map<std::string, std::string>(keyToColorCode.begin(), keyToColorCode.end()));
+        add_entries(theme_entry_value, std::map<std::string, std::string>(valueToColorCode.begin(), valueToColorCode.end()));
+        add_entries(theme_entry_highlight, std::map<std::string, std::string>(highlightToColorCode.begin(), highlightToColorCode.end()));
+
+        auto align = [](size_t offset) { return (offset + 7) & ~size_t{7}; };
+        ThemeFileHeader header{};
+        std::memcpy(header.magic, theme_file_magic, sizeof(header.magic));
+        header.byte_order = theme_file_byte_order;
+        header.version = theme_file_version;
+        header.header_size = sizeof(ThemeFileHeader);
+        header.color_count = static_cast<uint32_t>(colors.size());
+        header.entry_count = static_cast<uint32_t>(entries.size());
+        header.tables_offset = align(sizeof(ThemeFileHeader));
+        header.colors_offset = align(header.tables_offset + 2 * sizeof(keyTable));
+        header.entries_offset = align(header.colors_offset + colors.size() * sizeof(ThemeFileString));
+        header.strings_offset = align(header.entries_offset + entries.size() * sizeof(ThemeFileEntry));
+        header.strings_size = strings.size();
+        header.file_size = header.strings_offset + strings.size();
+
+        std::string image(header.file_size, '\0');
+        std::memcpy(&image[header.tables_offset], keyTable.data(), sizeof(keyTable));
+        std::memcpy(&image[header.tables_offset + sizeof(keyTable)], valueTable.data(), sizeof(valueTable));
+        if (!colors.empty()) std::memcpy(&image[header.colors_offset], colors.data(), colors.size() * sizeof(ThemeFileString));
+        if (!entries.empty()) std::memcpy(&image[header.entries_offset], entries.data(), entries.size() * sizeof(ThemeFileEntry));
+        if (!strings.empty()) std::memcpy(&image[header.strings_offset], strings.data(), strings.size());
+        header.checksum = fnv1a64(image.data() + sizeof(header), image.size() - sizeof(header));
+        std::memcpy(&image[0], &header, sizeof(header));
+        return image;
+    }
+
+    static bool is_image(const char* data, size_t size) {
+        return size >= sizeof(theme_file_magic) && std::memcmp(data, theme_file_magic, sizeof(theme_file_magic)) == 0;
+    }
+
+    // Validates an image from to_image() and loads it into a new mapping. The per-byte lookup
+    // tables are copied as stored; the maps, wide spans, byte classes and token automata are
+    // rebuilt from the entries. Throws std::runtime_error if the image is truncated, corrupt,
+    // of another version or of the other byte order.
+    static ColorMapping from_image(const char* data, size_t size) {
+        auto fail = [](const char* what) { throw std::runtime_error(std::string("Invalid compiled theme: ") + what); };
+        ThemeFileHeader header;
+        if (size < sizeof(header) || !is_image(data, size)) fail("bad magic");
+        std::memcpy(&header, data, sizeof(header));
+        if (header.byte_order != theme_file_byte_order) fail("written on a machine of the other byte order");
+        if (header.version != theme_file_version) fail("unsupported version");
+        if (header.header_size != sizeof(header) || header.file_size != size) fail("bad size");
+        if (header.checksum != fnv1a64(data + sizeof(header), size - sizeof(header))) fail("checksum mismatch");
+        auto fits = [size](uint64_t offset, uint64_t count, uint64_t item) {
+            return offset <= size && count <= (size - offset) / item;
+        };
+        if (!fits(header.tables_offset, 2, sizeof(keyTable)) || !fits(header.colors_offset, header.color_count, sizeof(ThemeFileString)) ||
+            !fits(header.entries_offset, header.entry_count, sizeof(ThemeFileEntry)) || !fits(header.strings_offset, header.strings_size, 1)) {
+            fail("section out of bounds");
+        }
+        const char* strings = data + header.strings_offset;
+        auto text = [&](const ThemeFileString& ref) {
+            if (ref.offset > header.strings_size || ref.size > header.strings_size - ref.offset) fail("string out of bounds");
+            return std::string(strings + ref.offset, ref.size);
+        };
+
+        ColorMapping mapping;
+        if (header.color_count == 0) fail("missing colour table");
+        mapping.colorSpans.clear();
+        for (uint32_t i = 0; i < header.color_count; ++i) {
+            ThemeFileString ref;
+            std::memcpy(&ref, data + header.colors_offset + i * sizeof(ref), sizeof(ref));
+            mapping.colorSpans.push_back(text(ref));
+            if (i != 0) mapping.spanIndex.emplace(mapping.colorSpans.back(), static_cast<uint16_t>(i));
+        }
+        std::memcpy(mapping.keyTable.data(), data + header.tables_offset, sizeof(mapping.keyTable));
+        std::memcpy(mapping.valueTable.data(), data + header.tables_offset + sizeof(mapping.keyTable), sizeof(mapping.valueTable));
+        for (int b = 0; b < 256; ++b) {
+            for (uint16_t span : {mapping.keyTable[b], mapping.valueTable[b]}) {
+                if (span == wide_span ? b < 0xC2 || b > 0xF4 : span >= header.color_count) fail("table entry out of range");
+            }
+        }
+        for (uint32_t i = 0; i < header.entry_count; ++i) {
+            ThemeFileEntry entry;
+            std::memcpy(&entry, data + header.entries_offset + i * sizeof(entry), sizeof(entry));
+            if (entry.color >= header.color_count) fail("entry colour out of range");
+            std::string name = text(entry.name);
+            const std::string& colorCode = mapping.colorSpans[entry.color];
+            switch (entry.kind) {
+                case theme_entry_char: {
+                    char32_t cp;
+                    if (name.size() == 1) {
+                        mapping.charToColorCode[name[0]] = colorCode;
+                    } else if (decode_utf8(name.data(), name.data() + name.size(), cp) == name.size()) {
+                        mapping.codePointToColorCode[cp] = colorCode;
+                    } else {
+                        fail("character entry is not one character");
+                    }
+                    break;
+                }
+                case theme_entry_key: mapping.keyToColorCode[name] = colorCode; break;
+                case theme_entry_value: mapping.valueToColorCode[name] = colorCode; break;
+                case theme_entry_highlight: {
+                    HighlightRole role;
+                    if (!highlight_role_from_name(name, role)) fail("unknown highlight class");
+                    mapping.highlightToColorCode[name] = colorCode;
+                    break;
+                }
+                default: fail("unknown entry kind");
+            }
+        }
+        mapping.resolve_highlight_colors();
+        mapping.build_wide_spans();
+        mapping.compile_matchers();
+        return mapping;
+    }
+
+    void insert(const std::string& name, const std::string& characters, const std::string& colorCode, bool isKey = false, bool isValue = false) {
+        if (isKey) {
+            keyToColorCode[name] = colorCode;
+        } else if (isValue) {
+            valueToColorCode[name] = colorCode;
+        } else {
+            for_each_character(characters, [&](char ch) { charToColorCode[ch] = colorCode; },
+                               [&](char32_t cp) { codePointToColorCode[cp] = colorCode; });
+        }
+        tables_changed();
+    }
+
+    // Runs edit(*this) and compiles the tables once at the end, instead of after each insert,
+    // replace, erase or set_highlight_color it makes. The tables are stale until it returns.
+    template <typename Edit>
+    void update(Edit&& edit) {
+        if (deferTables) {
+            edit(*this);
+            return;
+        }
+        deferTables = true;
+        try {
+            edit(*this);
+        } catch (...) {
+            deferTables = false;
+            rebuild_tables();
+            throw;
+        }
+        deferTables = false;
+        rebuild_tables();
+    }
+
+    // Colour of a LogHighlighter token class; role is one of highlight_role_names. Throws
+    // std::runtime_error for unknown names.
+    void set_highlight_color(const std::string& role, const std::string& colorCode) {
+        HighlightRole parsed;
+        if (!highlight_role_from_name(role, parsed)) throw std::runtime_error("Unknown highlight class: " + role);
+        highlightToColorCode[role] = colorCode;
+        tables_changed();
+    }
+
+    const std::array<std::string, highlight_role_count>& highlight_colors() const {
+        return highlightColors;
+    }
+
+    std::string apply(const std::string& text) const {
+        std::string out;
+        apply_to(out, text);
+        return out;
+    }
+
+    // Streaming form of apply_to() for input split at arbitrary points: colours a prefix of
+    // text and returns its length. The rest, which may start a token, has to be passed again
+    // followed by more input; with final set, everything is consumed. in_value carries the
+    // key/value state from one call to the next, and open (required unless final) the
+    // same-colour run left open at the end of the output.
+    size_t apply_chunk(std::string& out, std::string_view text, bool& in_value, bool final, uint16_t* open = nullptr) const {
+        out.reserve(out.size() + text.size() + text.size() / 2 + 16);
+        const char* begin = text.data();
+        const char* end = begin + text.size();
+        const char* p = begin;
+        if (!in_value) {
+            const char* colon = static_cast<const char*>(std::memchr(begin, ':', text.size()));
+            if (colon == nullptr) return apply_tokens(out, begin, end, keyTokens, keyTable, keyClass, final, open) - begin;
+            // No key token can span the ':', so the key side is complete
+            p = apply_tokens(out, begin, colon, keyTokens, keyTable, keyClass, true, open);
+            in_value = true;
+        }
+        return apply_tokens(out, p, end, valueTokens, valueTable, valueClass, final, open) - begin;
+    }
+
+    // Same output as apply_to(), computed on `threads` workers (0: one per core) and passed to
+    // sink piece by piece, in order. The text is cut after newlines roughly every chunk_size
+    // bytes; workers take the next uncoloured piece as they finish one, so uneven lines even
+    // out, and stay at most a few pieces ahead of the sink to bound memory.
+    void apply_parallel(std::string_view text, const std::function<void(std::string_view)>& sink, size_t threads = 0, size_t chunk_size = 256 * 1024) const {
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        const char* data = text.data();
+        const char* found = static_cast<const char*>(std::memchr(data, ':', text.size()));
+        size_t colon = found ? static_cast<size_t>(found - data) : text.size();
+        std::vector<size_t> cuts{0};
+        // A token spanning a newline would straddle a cut
+        if (!keyTokens.uses_byte('\n') && !valueTokens.uses_byte('\n')) {
+            for (size_t pos = chunk_size; pos < text.size();) {
+                const void* newline = std::memchr(data + pos, '\n', text.size() - pos);
+                if (newline == nullptr) break;
+                size_t cut = static_cast<size_t>(static_cast<const char*>(newline) - data) + 1;
+                if (cut == text.size()) break;
+                // Cutting inside a same-colour run would restart its escape sequence
+                const auto& before = cut - 1 < colon ? keyTable : valueTable;
+                const auto& after = cut < colon ? keyTable : valueTable;
+                size_t length;
+                uint16_t span = span_at(data + cut - 1, data + text.size(), before, length);
+                if (span != 0 && &before == &after && span_at(data + cut, data + text.size(), after, length) == span) {
+                    pos = cut;
+                    continue;
+                }
+                cuts.push_back(cut);
+                pos = cut + chunk_size;
+            }
+        }
+        cuts.push_back(text.size());
+        size_t count = cuts.size() - 1;
+        if (threads == 1 || count == 1) {
+            std::string out;
+            for (size_t i = 0; i < count; ++i) {
+                out.clear();
+                bool in_value = colon < cuts[i];
+                apply_chunk(out, text.substr(cuts[i], cuts[i + 1] - cuts[i]), in_value, true);
+                sink(out);
+            }
+            return;
+        }
+
+        struct Piece {
+            std::string out;
+            bool done = false;
+        };
+        std::vector<Piece> pieces(count);
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::condition_variable room;
+        size_t emitted = 0;
+        bool stop = false;
+        const size_t window = threads * 4;
+        auto work = [&] {
+            for (;;) {
+                size_t i = next.fetch_add(1);
+                if (i >= count) return;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    room.wait(lock, [&] { return stop || i < emitted + window; });
+                    if (stop) return;
+                }
+                bool in_value = colon < cuts[i];
+                apply_chunk(pieces[i].out, text.substr(cuts[i], cuts[i + 1] - cuts[i]), in_value, true);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    pieces[i].done = true;
+                }
+                ready.notify_all();
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < std::min(threads, count); ++t) workers.emplace_back(work);
+        try {
+            for (size_t i = 0; i < count; ++i) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [&] { return pieces[i].done; });
+                }
+                sink(pieces[i].out);
+                std::string().swap(pieces[i].out);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    emitted = i + 1;
+                }
+                room.notify_all();
+            }
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            room.notify_all();
+            for (auto& worker : workers) worker.join();
+            throw;
+        }
+        for (auto& worker : workers) worker.join();
+    }
+
+    // Appends the coloured text to out
+    void apply_to(std::string& out, std::string_view text) const {
+        out.reserve(out.size() + text.size() + text.size() / 2 + 16);
+        const char* begin = text.data();
+        const char* end = begin + text.size();
+        const char* colon = static_cast<const char*>(std::memchr(begin, ':', text.size()));
+        if (colon == nullptr) colon = end;
+        apply_tokens(out, begin, colon, keyTokens, keyTable, keyClass);
+        apply_tokens(out, colon, end, valueTokens, valueTable, valueClass);
+    }
+
+    std::string apply_key_color(const std::string& key) const {
+        auto it = keyToColorCode.find(key);
+        if (it != keyToColorCode.end()) {
+            return it->second + key + "\033[0m";
+        }
+        return key;
+    }
+
+    std::string apply_value_color(const std::string& value) const {
+        auto it = valueToColorCode.find(value);
+        if (it != valueToColorCode.end()) {
+            return it->second + value + "\033[0m";
+        }
+        return value;
+    }
+
+    std::unordered_map<char, std::string> get() const {
+        return charToColorCode;
+    }
+
+    // Mappings for non-ASCII characters; get() holds the single-byte ones
+    std::unordered_map<char32_t, std::string> get_code_point_map() const {
+        return codePointToColorCode;
+    }
+
+    std::unordered_map<std::string, std::string> get_key_map() const {
+        return keyToColorCode;
+    }
+
+    std::unordered_map<std::string, std::string> get_value_map() const {
+        return valueToColorCode;
+    }
+
+    std::unordered_map<std::string, std::string> get_highlight_map() const {
+        return highlightToColorCode;
+    }
+
+    const std::string* inspect_color(char character) const {
+        auto it = charToColorCode.find(character);
+        if (it != charToColorCode.end()) {
+            return &it->second;
+        }
+        return nullptr;
+    }
+
+    const std::string* inspect_code_point_color(char32_t cp) const {
+        if (cp < 0x80) return inspect_color(static_cast<char>(cp));
+        auto it = codePointToColorCode.find(cp);
+        if (it != codePointToColorCode.end()) {
+            return &it->second;
+        }
+        return nullptr;
+    }
+
+    const std::string* inspect_key_color(const std::string& key) const {
+        auto it = keyToColorCode.find(key);
+        if (it != keyToColorCode.end()) {
+            return &it->second;
+        }
+        return nullptr;
+    }
+
+    const std::string* inspect_value_color(const std::string& value) const {
+        auto it = valueToColorCode.find(value);
+        if (it != valueToColorCode.end()) {
+            return &it->second;
+        }
+        return nullptr;
+    }
+
+    void replace(const std::string& characters, const std::string& colorCode) {
+        for_each_character(characters, [&](char ch) { charToColorCode[ch] = colorCode; },
+                           [&](char32_t cp) { codePointToColorCode[cp] = colorCode; });
+        tables_changed();
+    }
+
+    void erase(const std::string& characters) {
+        for_each_character(characters, [&](char ch) { charToColorCode.erase(ch); },
+                           [&](char32_t cp) { codePointToColorCode.erase(cp); });
+        tables_changed();
+    }
+};
+
+// Single-pass highlighter for structured log lines: timestamps, levels, the keys of key=value
+// pairs and JSON members, quoted strings, numbers, IPv4/IPv6 addresses and UUIDs, each in its
+// theme highlight colour. A per-byte class table drives the scan: bytes that cannot begin a
+// token are copied in bulk, a quote starts a string, and anything else starts a word whose
+// combined class bits select the few shapes it can still have. No token crosses a newline.
+class LogHighlighter {
+public:
+    explicit LogHighlighter(const ColorMapping& theme) : colors_(padded_colors(theme.highlight_colors())) {}
+
+    std::string apply(std::string_view text) const {
+        std::string out;
+        apply_to(out, text);
+        return out;
+    }
+
+    // Appends the highlighted text to out
+    void apply_to(std::string& out, std::string_view text) const {
+        out.reserve(out.size() + text.size() + text.size() / 2);
+        const auto& cls = classes();
+        const char* begin = text.data();
+        const char* end = begin + text.size();
+        const char* p = begin;
+        Writer w(out, end);
+        // Set by a level/severity key, for its value only
+        bool level_context = false;
+        while (p != end) {
+            const char* run = p;
+            while (p != end && (cls[static_cast<unsigned char>(*p)] & word_start) == 0) ++p;
+            w.write(run, p);
+            if (p == end) break;
+
+            if (cls[static_cast<unsigned char>(*p)] & quote) {
+                char open = *p;
+                const char* close = p + 1;
+                // The classes seen inside tell whether the string holds a single token
+                uint16_t seen = 0;
+                for (;;) {
+                    while (close != end && (cls[static_cast<unsigned char>(*close)] & string_stop) == 0) seen |= cls[static_cast<unsigned char>(*close++)];
+                    if (close == end || *close == open || *close == '\n') break;
+                    seen |= plain;
+                    close += *close == '\\' && close + 1 != end && close[1] != '\n' ? 2 : 1;
+                }
+                // An apostrophe inside a word, or a quote that is never closed, is plain text
+                bool apostrophe = open == '\'' && p != begin && (cls[static_cast<unsigned char>(p[-1])] & (digit | hex | alpha));
+                if (close == end || *close != open || apostrophe) {
+                    w.write(p++, 1);
+                    continue;
+                }
+                ++close;
+                std::string_view inner(p + 1, close - p - 2);
+                HighlightRole role = HighlightRole::string;
+                if (close != end && *close == ':') {
+                    role = HighlightRole::key;
+                } else if (!inner.empty() && (seen & plain) == 0) {
+                    // A quoted value that is a single token ("2024-05-17T14:03:10Z") takes its colour
+                    const char* inner_end = inner.data() + inner.size();
+                    classify(inner.data(), inner_end, inner_end, seen, level_context, role, inner_end);
+                }
+                level_context = role == HighlightRole::key && is_level_key(inner.data(), inner.data() + inner.size());
+                w.token(colors_[static_cast<size_t>(role)], p, close);
+                p = close;
+                continue;
+            }
+
+            const char* word = p;
+            uint16_t seen = 0;
+            while (p != end && (cls[static_cast<unsigned char>(*p)] & word_char)) seen |= cls[static_cast<unsigned char>(*p++)];
+            // Sentence punctuation after a word is not part of it
+            while (p - word > 1 && (cls[static_cast<unsigned char>(p[-1])] & trailing)) --p;
+
+            if (p != end && *p == '=') {
+                level_context = is_level_key(word, p);
+                w.token(colors_[static_cast<size_t>(HighlightRole::key)], word, p);
+                continue;
+            }
+            HighlightRole role;
+            const char* token_end = p;
+            if (classify(word, p, end, seen, level_context, role, token_end)) {
+                w.token(colors_[static_cast<size_t>(role)], word, token_end);
+            } else {
+                w.write(word, p);
+            }
+            p = token_end;
+            level_context = false;
+        }
+        w.flush();
+    }
+
+private:
+    enum : uint16_t {
+        digit = 1,          // 0-9
+        hex = 2,            // a-f, A-F
+        alpha = 4,          // other letters
+        dot = 8,
+        colon = 16,
+        dash = 32,
+        other = 64,         // '_', '+'
+        quote = 128,        // '"', '\''
+        plain = 256,        // everything else
+        string_stop = 512,  // quotes, '\\' and '\n', which end a scan inside a string
+        word_char = digit | hex | alpha | dot | colon | dash | other,
+        word_start = digit | hex | alpha | dash | other | quote,
+        trailing = dot | colon | dash,
+    };
+
+    static const std::array<uint16_t, 256>& classes() {
+        static const std::array<uint16_t, 256> table = [] {
+            std::array<uint16_t, 256> t;
+            t.fill(plain);
+            for (int c = '0'; c <= '9'; ++c) t[c] = digit;
+            for (int c = 'a'; c <= 'z'; ++c) t[c] = c <= 'f' ? hex : alpha;
+            for (int c = 'A'; c <= 'Z'; ++c) t[c] = c <= 'F' ? hex : alpha;
+            t['.'] = dot;
+            t[':'] = colon;
+            t['-'] = dash;
+            t['_'] = t['+'] = other;
+            t['"'] = t['\''] = quote | string_stop;
+            t['\\'] = plain | string_stop;
+            t['\n'] = plain | string_stop;
+            return t;
+        }();
+        return table;
+    }
+
+    static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+    static bool is_hex(char c) { return is_digit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f'); }
+
+    // Consumes min to max digits
+    static bool digits(const char*& p, const char* end, size_t min, size_t max) {
+        size_t n = 0;
+        while (n < max && p != end && is_digit(*p)) ++p, ++n;
+        return n >= min;
+    }
+
+    // hh:mm[:ss[.frac]][Z|+hh[:mm]]; returns the end of the time or nullptr
+    static const char* parse_time(const char* p, const char* end, bool need_seconds) {
+        if (!digits(p, end, 2, 2) || p == end || *p != ':' || !digits(++p, end, 2, 2)) return nullptr;
+        if (p != end && *p == ':' && p + 1 != end && is_digit(p[1])) {
+            if (!digits(++p, end, 2, 2)) return nullptr;
+            if (p != end && (*p == '.' || *p == ',') && p + 1 != end && is_digit(p[1])) digits(++p, end, 1, 9);
+        } else if (need_seconds) {
+            return nullptr;
+        }
+        if (p != end && *p == 'Z') return p + 1;
+        if (p != end && (*p == '+' || *p == '-')) {
+            const char* zone = p + 1;
+            if (!digits(zone, end, 2, 2)) return p;
+            if (zone != end && *zone == ':') ++zone;
+            digits(zone, end, 0, 2);
+            return zone;
+        }
+        return p;
+    }
+
+    // yyyy-mm-dd[(T| )time] or hh:mm:ss[.frac]; token_end may extend past a space
+    static bool timestamp(const char* word, const char* word_end, const char* end, const char*& token_end) {
+        const char* p = word;
+        if (word_end - word >= 10 && digits(p, word_end, 4, 4) && *p == '-' && digits(++p, word_end, 2, 2) && *p == '-' && digits(++p, word_end, 2, 2)) {
+            if (p == word_end) {
+                // "2024-05-17 14:03:10.123"
+                const char* time = word_end != end && *word_end == ' ' ? parse_time(word_end + 1, end, true) : nullptr;
+                const auto& cls = classes();
+                if (time != nullptr && (time == end || (cls[static_cast<unsigned char>(*time)] & (digit | hex | alpha)) == 0)) token_end = time;
+                return true;
+            }
+            return (*p == 'T' || *p == 't') && parse_time(p + 1, word_end, false) == word_end;
+        }
+        return parse_time(word, word_end, true) == word_end;
+    }
+
+    // Dashes at the four fixed places and hex digits in the other 32, counted without branches
+    static bool uuid(const char* p, const char* end) {
+        if (end - p != 36 || p[8] != '-' || p[13] != '-' || p[18] != '-' || p[23] != '-') return false;
+        const auto& cls = classes();
+        int hex_digits = 0;
+        for (int i = 0; i < 36; ++i) hex_digits += (cls[static_cast<unsigned char>(p[i])] & (digit | hex)) != 0;
+        return hex_digits == 32;
+    }
+
+    // Dotted quad with an optional port
+    static bool ipv4(const char* p, const char* end) {
+        for (int part = 0; part < 4; ++part) {
+            if (part != 0 && (p == end || *p++ != '.')) return false;
+            int value = 0;
+            int n = 0;
+            for (; n < 3 && p != end && is_digit(*p); ++n, ++p) value = value * 10 + (*p - '0');
+            if (n == 0 || value > 255) return false;
+        }
+        if (p != end && *p == ':') return digits(++p, end, 1, 5) && p == end;
+        return p == end;
+    }
+
+    // Eight groups of hex digits, or fewer with one "::" (not leading: a word never starts with ':')
+    static bool ipv6(const char* p, const char* end) {
+        int groups = 0;
+        bool compressed = false;
+        while (p != end) {
+            int n = 0;
+            while (p != end && n < 5 && is_hex(*p)) ++p, ++n;
+            if (n == 0 || n > 4) return false;
+            ++groups;
+            if (p == end) break;
+            if (*p != ':') return false;
+            if (++p != end && *p == ':') {
+                if (compressed) return false;
+                compressed = true;
+                ++p;
+            }
+        }
+        return compressed ? groups < 8 : groups == 8;
+    }
+
+    // Integers, decimals, exponents and 0x hex, with an optional unit of up to three letters
+    // ("12ms", "1.5GB")
+    static bool number(const char* p, const char* end) {
+        if (*p == '-' || *p == '+') ++p;
+        if (p == end || !is_digit(*p)) return false;
+        if (end - p > 2 && p[0] == '0' && (p[1] | 0x20) == 'x') {
+            p += 2;
+            while (p != end && is_hex(*p)) ++p;
+            return p == end;
+        }
+        digits(p, end, 1, SIZE_MAX);
+        if (p != end && *p == '.' && !digits(++p, end, 1, SIZE_MAX)) return false;
+        if (end - p >= 2 && (*p | 0x20) == 'e' && (is_digit(p[1]) || (end - p >= 3 && (p[1] == '-' || p[1] == '+') && is_digit(p[2])))) {
+            p += 2;
+            digits(p, end, 0, SIZE_MAX);
+        }
+        for (int unit = 0; p != end && unit < 3; ++unit, ++p) {
+            if ((*p | 0x20) < 'a' || (*p | 0x20) > 'z') return false;
+        }
+        return p == end;
+    }
+
+    // Severity names; lower or mixed case only counts after a level key
+    static bool level_word(const char* p, const char* end, bool any_case, HighlightRole& role) {
+        struct Level {
+            const char* name;
+            size_t size;
+            HighlightRole role;
+        };
+        static constexpr Level levels[] = {
+            {"TRACE", 5, HighlightRole::debug}, {"DEBUG", 5, HighlightRole::debug}, {"DBG", 3, HighlightRole::debug},
+            {"INFO", 4, HighlightRole::info}, {"NOTICE", 6, HighlightRole::info}, {"WARN", 4, HighlightRole::warning},
+            {"WARNING", 7, HighlightRole::warning}, {"ERROR", 5, HighlightRole::error}, {"ERR", 3, HighlightRole::error},
+            {"FATAL", 5, HighlightRole::error}, {"CRIT", 4, HighlightRole::error}, {"CRITICAL", 8, HighlightRole::error},
+            {"PANIC", 5, HighlightRole::error}, {"ALERT", 5, HighlightRole::error}, {"EMERG", 5, HighlightRole::error}};
+        size_t size = static_cast<size_t>(end - p);
+        if (size < 3 || size > 8) return false;
+        char upper[8];
+        for (size_t i = 0; i < size; ++i) {
+            if (p[i] >= 'a' && p[i] <= 'z') {
+                if (!any_case) return false;
+                upper[i] = static_cast<char>(p[i] - 32);
+            } else {
+                upper[i] = p[i];
+            }
+        }
+        for (const auto& level : levels) {
+            if (level.size == size && std::memcmp(level.name, upper, size) == 0) {
+                role = level.role;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool is_level_key(const char* p, const char* end) {
+        std::string_view key(p, static_cast<size_t>(end - p));
+        return key == "level" || key == "lvl" || key == "severity" || key == "LEVEL" || key == "Level" || key == "loglevel";
+    }
+
+    static bool classify(const char* word, const char* word_end, const char* end, uint16_t seen, bool level_context, HighlightRole& role, const char*& token_end) {
+        if ((seen & digit) == 0) {
+            if ((seen & ~(hex | alpha)) == 0) return level_word(word, word_end, level_context, role);
+            return false;
+        }
+        if ((seen & dash) && uuid(word, word_end)) {
+            role = HighlightRole::uuid;
+            return true;
+        }
+        if ((seen & (dash | colon)) && is_digit(*word) && timestamp(word, word_end, end, token_end)) {
+            role = HighlightRole::timestamp;
+            return true;
+        }
+        if ((seen & dot) && (seen & ~(digit | dot | colon)) == 0 && ipv4(word, word_end)) {
+            role = HighlightRole::ip;
+            return true;
+        }
+        if ((seen & colon) && (seen & ~(digit | hex | colon)) == 0 && ipv6(word, word_end)) {
+            role = HighlightRole::ip;
+            return true;
+        }
+        if (number(word, word_end)) {
+            role = HighlightRole::number;
+            return true;
+        }
+        return false;
+    }
+
+    // A colour escape padded so that the common short ones copy as one fixed-size block. The
+    // escape is owned, so the highlighter stays valid after the theme it came from is freed.
+    struct Color {
+        std::array<char, 32> padded{};
+        size_t size = 0;
+        std::string code;
+    };
+
+    static std::array<Color, highlight_role_count> padded_colors(const std::array<std::string, highlight_role_count>& colors) {
+        std::array<Color, highlight_role_count> padded;
+        for (size_t i = 0; i < highlight_role_count; ++i) {
+            padded[i].size = colors[i].size();
+            padded[i].code = colors[i];
+            if (colors[i].size() <= padded[i].padded.size()) std::memcpy(padded[i].padded.data(), colors[i].data(), colors[i].size());
+        }
+        return padded;
+    }
+
+    // Collects output in a block on the stack and appends it to out a block at a time: a
+    // highlighted line is many short pieces, and std::string::append costs more per piece.
+    // Pieces of up to 16 bytes copy as one fixed-size block when the input has 16 readable
+    // bytes from there, so the usual token costs a few stores rather than three memcpy calls.
+    class Writer {
+    public:
+        Writer(std::string& out, const char* input_end) : out_(out), input_end_(input_end) {}
+
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+
+        void write(const char* p, size_t size) {
+            if (size > room()) {
+                flush();
+                if (size > room()) {
+                    out_.append(p, size);
+                    return;
+                }
+            }
+            copy(p, size);
+        }
+
+        void write(const char* p, const char* end) { write(p, static_cast<size_t>(end - p)); }
+
+        // Text between the colour's escape and a reset; plain if the colour is empty
+        void token(const Color& color, const char* p, const char* end) {
+            if (color.size == 0) return write(p, end);
+            size_t size = static_cast<size_t>(end - p);
+            if (color.size + size + 4 > room()) {
+                flush();
+                if (color.size + size + 4 > room()) {
+                    out_ += color.code;
+                    out_.append(p, size);
+                    out_.append("\033[0m", 4);
+                    return;
+                }
+            }
+            if (color.size <= color.padded.size()) {
+                std::memcpy(pos_, color.padded.data(), color.padded.size());
+            } else {
+                std::memcpy(pos_, color.code.data(), color.size);
+            }
+            pos_ += color.size;
+            copy(p, size);
+            std::memcpy(pos_, "\033[0m", 4);
+            pos_ += 4;
+        }
+
+        void flush() {
+            out_.append(buffer_, static_cast<size_t>(pos_ - buffer_));
+            pos_ = buffer_;
+        }
+
+    private:
+        // The fixed-size copies may write up to 32 bytes past what room() reports
+        static constexpr size_t slack = 32;
+
+        size_t room() const { return static_cast<size_t>(buffer_ + sizeof(buffer_) - slack - pos_); }
+
+        void copy(const char* p, size_t size) {
+            if (size <= 16 && input_end_ - p >= 16) {
+                std::memcpy(pos_, p, 16);
+            } else {
+                std::memcpy(pos_, p, size);
+            }
+            pos_ += size;
+        }
+
+        std::string& out_;
+        const char* input_end_;
+        char buffer_[4096];
+        char* pos_ = buffer_;
+    };
+
+    std::array<Color, highlight_role_count> colors_;
+};
+
+class ThemeManager {
+private:
+    using Version = std::shared_ptr<const ColorMapping>;
+
+    ThemeManager() {
+        Version empty = std::make_shared<const ColorMapping>();
+        themes["default"] = empty;
+        set_current_locked(empty);
+    }
+
+    // Published themes are immutable: an edit copies the theme, recompiles it and swaps the
+    // new version in. Each thread caches a reference to the current version and checks it
+    // against currentVersion, so apply() costs one atomic load while nothing changes and
+    // takes the mutex only to pick up a new version. A replaced version is freed once no
+    // theme, thread cache or caller snapshot refers to it. Changes are serialized on mutex.
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, Version> themes;
+    std::string currentName = "default";
+    Version currentTheme;
+    std::atomic<uint64_t> currentVersion{0};
+    std::atomic<bool> color_enabled{true};
+
+    void set_current_locked(Version version) {
+        currentTheme = std::move(version);
+        currentVersion.fetch_add(1, std::memory_order_release);
+    }
+
+    // This thread's reference to the current version
+    const Version& snapshot() const {
+        struct Cache {
+            uint64_t version = 0;
+            Version theme;
+        };
+        thread_local Cache cache;
+        uint64_t version = currentVersion.load(std::memory_order_acquire);
+        if (cache.version != version) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cache.theme = currentTheme;
+            cache.version = currentVersion.load(std::memory_order_relaxed);
+        }
+        return cache.theme;
+    }
+
+    const Version& find_locked(const std::string& themeName) const {
+        auto it = themes.find(themeName);
+        if (it == themes.end()) {
+            std::string error_msg = "Theme does not exist: " + themeName;
+            Logger::error(error_msg);
+            throw std::runtime_error(error_msg);
+        }
+        return it->second;
+    }
+
+    // Publishes a new version of a theme built by edit from the current one, compiled once
+    // however many changes edit makes
+    template <typename Edit>
+    void edit_theme(const std::string& themeName, Edit&& edit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ColorMapping mapping = *find_locked(themeName);
+        mapping.update(edit);
+        Version version = std::make_shared<const ColorMapping>(std::move(mapping));
+        themes[themeName] = version;
+        if (themeName == currentName) set_current_locked(std::move(version));
+    }
+
+    template <typename Edit>
+    void edit_current(Edit&& edit) {
+        std::string themeName;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            themeName = currentName;
+        }
+        edit_theme(themeName, std::forward<Edit>(edit));
+    }
+
+public:
+    static ThemeManager& instance() {
+        static ThemeManager instance;
+        return instance;
+    }
+
+    void create(const std::string& themeName) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (themes.find(themeName) != themes.end()) {
+                std::string error_msg = "Theme already exists: " + themeName;
+                Logger::error(error_msg);
+                throw std::runtime_error(error_msg);
+            }
+            themes[themeName] = std::make_shared<const ColorMapping>();
+        }
+        Logger::info("Created theme: " + themeName);
+    }
+
+    void set(const std::string& themeName) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Version theme = find_locked(themeName);
+            currentName = themeName;
+            set_current_locked(std::move(theme));
+        }
+        Logger::info("Set current theme to: " + themeName);
+    }
+
+    void insert(const std::string& name, const std::string& characters, const std::string& colorCode, bool isKey = false, bool isValue = false) {
+        edit_current([&](ColorMapping& mapping) { mapping.insert(name, characters, colorCode, isKey, isValue); });
+        Logger::info("Inserted color mapping for " + name + " in current theme");
+    }
+
+    template <typename Edit>
+    void edit(Edit&& edit) {
+        edit_current(std::forward<Edit>(edit));
+        Logger::info("Edited current theme");
+    }
+
+    std::string apply(const std::string& text) const {
+        if (color_enabled.load(std::memory_order_relaxed)) {
+            return snapshot()->apply(text);
+        } else {
+            return text;
+        }
+    }
+
+    // The theme apply() uses, or nullptr while the colormap is disabled. The snapshot stays
+    // valid and unchanged for as long as it is held, whatever is switched or edited later.
+    std::shared_ptr<const ColorMapping> current() const {
+        return color_enabled.load(std::memory_order_relaxed) ? snapshot() : nullptr;
+    }
+
+    std::unordered_map<char, std::string> inspect() const {
+        return snapshot()->get();
+    }
+
+    const std::string* inspect_color(char character) const {
+        return snapshot()->inspect_color(character);
+    }
+
+    const std::string* inspect_code_point_color(char32_t cp) const {
+        return snapshot()->inspect_code_point_color(cp);
+    }
+
+    const std::string* inspect_key_color(const std::string& key) const {
+        return snapshot()->inspect_key_color(key);
+    }
+
+    const std::string* inspect_value_color(const std::string& value) const {
+        return snapshot()->inspect_value_color(value);
+    }
+
+    std::vector<std::string> list() const {
+        std::lock_guard<std::mutex> lock(mutex);
         std::vector<std::string> themeNames;
         for (const auto& [key, _] : themes) {
             themeNames.push_back(key);
@@ -1349,94 +5919,255 @@ public:
         return themeNames;
     }
 
+    void set_highlight_color(const std::string& role, const std::string& colorCode) {
+        HighlightRole parsed;
+        if (!highlight_role_from_name(role, parsed)) {
+            std::string error_msg = "Unknown highlight class: " + role;
+            Logger::error(error_msg);
+            throw std::runtime_error(error_msg);
+        }
+        edit_current([&](ColorMapping& mapping) { mapping.set_highlight_color(role, colorCode); });
+        Logger::info("Set " + role + " highlight color in current theme");
+    }
+
     void replace(const std::string& characters, const std::string& colorCode) {
-        currentTheme->replace(characters, colorCode);
+        edit_current([&](ColorMapping& mapping) { mapping.replace(characters, colorCode); });
         Logger::info("Replaced color mapping in current theme");
     }
 
     void erase(const std::string& characters) {
-        currentTheme->erase(characters);
+        edit_current([&](ColorMapping& mapping) { mapping.erase(characters); });
         Logger::info("Erased color mapping from current theme");
     }
 
     void save(const std::string& themeName, const std::string& filePath) {
+        Version theme;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            theme = find_locked(themeName);
+        }
         std::ofstream outFile(filePath);
         if (!outFile) {
             std::string error_msg = "Failed to open file for saving theme: " + filePath;
             Logger::error(error_msg);
             throw std::runtime_error(error_msg);
         }
-        auto colormap = themes[themeName].get();
+        // Character lines are "c:code"; keys, values and highlight classes are tab-separated
+        // "key|value|highlight<TAB>name<TAB>code". Characters, names and codes are escaped
+        // (see escape_theme_text) so that every mapping stays on its own line.
+        auto colormap = theme->get();
         for (const auto& [ch, colorCode] : colormap) {
-            outFile << ch << ":" << colorCode << "\n";
+            outFile << escape_theme_text(std::string_view(&ch, 1)) << ":" << escape_theme_text(colorCode) << "\n";
+        }
+        for (const auto& [cp, colorCode] : theme->get_code_point_map()) {
+            std::string bytes;
+            _internal::append_utf8(bytes, cp);
+            outFile << bytes << ":" << escape_theme_text(colorCode) << "\n";
+        }
+        for (const auto& [key, colorCode] : theme->get_key_map()) {
+            outFile << "key\t" << escape_theme_text(key) << "\t" << escape_theme_text(colorCode) << "\n";
+        }
+        for (const auto& [value, colorCode] : theme->get_value_map()) {
+            outFile << "value\t" << escape_theme_text(value) << "\t" << escape_theme_text(colorCode) << "\n";
+        }
+        for (const auto& [role, colorCode] : theme->get_highlight_map()) {
+            outFile << "highlight\t" << escape_theme_text(role) << "\t" << escape_theme_text(colorCode) << "\n";
         }
         outFile.close();
         Logger::info("Saved theme " + themeName + " to file: " + filePath);
     }
 
-    void load(const std::string& themeName, const std::string& filePath) {
-        std::ifstream inFile(filePath);
-        if (!inFile) {
-            std::string error_msg = "Failed to open file for loading theme: " + filePath;
+    // Compiled binary form (see ThemeFileHeader), which load() maps and validates without parsing
+    void save_binary(const std::string& themeName, const std::string& filePath) {
+        Version theme;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            theme = find_locked(themeName);
+        }
+        std::string image = theme->to_image();
+        std::ofstream outFile(filePath, std::ios::binary | std::ios::trunc);
+        if (!outFile || !outFile.write(image.data(), static_cast<std::streamsize>(image.size()))) {
+            std::string error_msg = "Failed to open file for saving theme: " + filePath;
             Logger::error(error_msg);
             throw std::runtime_error(error_msg);
         }
+        outFile.close();
+        Logger::info("Saved compiled theme " + themeName + " to file: " + filePath);
+    }
+
+    // Text theme files write backslash, tab, newline and carriage return as \\, \t, \n and \r
+    static std::string escape_theme_text(std::string_view text) {
+        std::string out;
+        for (char c : text) {
+            switch (c) {
+            case '\\': out += "\\\\"; break;
+            case '\t': out += "\\t"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            default: out.push_back(c);
+            }
+        }
+        return out;
+    }
+
+    // Reverses escape_theme_text; any other backslash is kept as written
+    static std::string unescape_theme_text(std::string_view text) {
+        std::string out;
+        for (size_t i = 0; i < text.size(); ++i) {
+            char c = text[i];
+            if (c == '\\' && i + 1 < text.size()) {
+                char next = text[i + 1];
+                char plain = next == '\\' ? '\\' : next == 't' ? '\t' : next == 'n' ? '\n' : next == 'r' ? '\r' : 0;
+                if (plain != 0) {
+                    out.push_back(plain);
+                    ++i;
+                    continue;
+                }
+            }
+            out.push_back(c);
+        }
+        return out;
+    }
+
+    // Reads a theme file in either format; compiled files are recognised by their magic number
+    static ColorMapping read_theme_file(const std::string& filePath) {
+        std::unique_ptr<MappedFile> file;
+        try {
+            file = std::make_unique<MappedFile>(filePath);
+        } catch (const std::runtime_error&) {
+            throw std::runtime_error("Failed to open file for loading theme: " + filePath);
+        }
+        return parse_theme(std::string_view(file->data(), file->size()), false);
+    }
+
+    // Parses theme file contents. Compiled images are always fully validated; `strict` also
+    // rejects text with an unrecognised line or without a final newline, as seen when a file
+    // is read while it is still being written.
+    static ColorMapping parse_theme(std::string_view data, bool strict) {
+        if (ColorMapping::is_image(data.data(), data.size())) {
+            return ColorMapping::from_image(data.data(), data.size());
+        }
+        if (strict && !data.empty() && data.back() != '\n') throw std::runtime_error("Incomplete theme file: no final newline");
+        ColorMapping mapping;
+        mapping.update([&](ColorMapping&) { parse_theme_lines(mapping, data, strict); });
+        return mapping;
+    }
+
+    // Adds the mappings of a text theme file; see parse_theme
+    static void parse_theme_lines(ColorMapping& mapping, std::string_view data, bool strict) {
+        std::string_view text = data;
+        while (!text.empty()) {
+            size_t end = std::min(text.find('\n'), text.size());
+            std::string_view line = text.substr(0, end);
+            text.remove_prefix(std::min(end + 1, text.size()));
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            size_t tab = line.find('\t');
+            size_t second = tab == std::string_view::npos ? tab : line.find('\t', tab + 1);
+            if (second != std::string_view::npos && line.substr(0, tab) == "highlight") {
+                mapping.set_highlight_color(unescape_theme_text(line.substr(tab + 1, second - tab - 1)), unescape_theme_text(line.substr(second + 1)));
+            } else if (second != std::string_view::npos && (line.substr(0, tab) == "key" || line.substr(0, tab) == "value")) {
+                std::string name = unescape_theme_text(line.substr(tab + 1, second - tab - 1));
+                bool isKey = line.substr(0, tab) == "key";
+                mapping.insert(name, name, unescape_theme_text(line.substr(second + 1)), isKey, !isKey);
+            } else if (line.size() >= 3 && line[0] == '\\' && line[2] == ':' && unescape_theme_text(line.substr(0, 2)).size() == 1) {
+                std::string character = unescape_theme_text(line.substr(0, 2));
+                mapping.insert(character, character, unescape_theme_text(line.substr(3)));
+            } else if (line.size() >= 2 && line[1] == ':') {
+                mapping.insert(std::string(1, line[0]), std::string(1, line[0]), unescape_theme_text(line.substr(2)));
+            } else {
+                // A UTF-8 character before the ':'
+                char32_t cp;
+                size_t length = decode_utf8(line.data(), line.data() + line.size(), cp);
+                if (length > 1 && length < line.size() && line[length] == ':') {
+                    std::string character(line.substr(0, length));
+                    mapping.insert(character, character, unescape_theme_text(line.substr(length + 1)));
+                } else if (strict && !line.empty()) {
+                    throw std::runtime_error("Malformed theme line: " + std::string(line));
+                }
+            }
+        }
+    }
+
+    void load(const std::string& themeName, const std::string& filePath) {
+        ColorMapping mapping;
+        try {
+            mapping = read_theme_file(filePath);
+        } catch (const std::runtime_error& e) {
+            Logger::error(e.what());
+            throw;
+        }
         create(themeName);
-        std::string line;
-        while (std::getline(inFile, line)) {
-            if (line.empty()) continue;
-            auto pos = line.find(':');
-            if (pos == std::string::npos) continue;
-            char ch = line[0];
-            std::string colorCode = line.substr(pos + 1);
-            themes[themeName].insert(std::string(1, ch), std::string(1, ch), colorCode);
-        }
-        inFile.close();
+        publish(themeName, std::move(mapping));
         Logger::info("Loaded theme " + themeName + " from file: " + filePath);
     }
 
+    // Replaces (or creates) a theme with an already compiled mapping
+    void publish(const std::string& themeName, ColorMapping mapping) {
+        Version version = std::make_shared<const ColorMapping>(std::move(mapping));
+        std::lock_guard<std::mutex> lock(mutex);
+        themes[themeName] = version;
+        if (themeName == currentName) set_current_locked(std::move(version));
+    }
+
+    // Loads the theme now and again, in the background, whenever the file changes; see ThemeWatcher
+    void watch(const std::string& themeName, const std::string& filePath, std::chrono::milliseconds debounce = std::chrono::milliseconds(200));
+    void unwatch(const std::string& filePath);
+
     void set_default() {
-        currentTheme = &themes["default"];
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            currentName = "default";
+            set_current_locked(themes["default"]);
+        }
         Logger::info("Set current theme to default");
     }
 
     void enable_colormap() {
-        color_enabled = true;
+        color_enabled.store(true);
         Logger::info("Enabled colormap");
     }
 
     void disable_colormap() {
-        color_enabled = false;
+        color_enabled.store(false);
         Logger::info("Disabled colormap");
     }
 
     bool is_enabled() const {
-        return color_enabled;
+        return color_enabled.load();
     }
 
     std::string list_all_theme_maps() const {
+        std::lock_guard<std::mutex> lock(mutex);
         std::ostringstream oss;
         oss << "\nAll Themes and Their Mappings:\n";
         for (const auto& [themeName, colormap] : themes) {
             oss << "Theme: " << themeName << "\n";
-            for (const auto& [character, colorCode] : colormap.get()) {
+            for (const auto& [character, colorCode] : colormap->get()) {
                 oss << "Character: " << character << ", Color Code: " << _internal::custom_regex_replace(colorCode, "\033", "\\033") << "\n";
             }
-            for (const auto& [key, colorCode] : colormap.get_key_map()) {
+            for (const auto& [cp, colorCode] : colormap->get_code_point_map()) {
+                std::string character;
+                _internal::append_utf8(character, cp);
+                oss << "Character: " << character << ", Color Code: " << _internal::custom_regex_replace(colorCode, "\033", "\\033") << "\n";
+            }
+            for (const auto& [key, colorCode] : colormap->get_key_map()) {
                 oss << "Key: " << key << ", Color Code: " << _internal::custom_regex_replace(colorCode, "\033", "\\033") << "\n";
             }
-            for (const auto& [value, colorCode] : colormap.get_value_map()) {
+            for (const auto& [value, colorCode] : colormap->get_value_map()) {
                 oss << "Value: " << value << ", Color Code: " << _internal::custom_regex_replace(colorCode, "\033", "\\033") << "\n";
             }
+            for (const auto& [role, colorCode] : colormap->get_highlight_map()) {
+                oss << "Highlight: " << role << ", Color Code: " << _internal::custom_regex_replace(colorCode, "\033", "\\033") << "\n";
+            }
             oss << "\n";
         }
         return oss.str();
     }
 
     void interactive_edit_theme(const std::string& themeName) {
-        if (themes.find(themeName) == themes.end()) {
-            Logger::error("Theme does not exist: " + themeName);
-            throw std::runtime_error("Theme does not exist: " + themeName);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            find_locked(themeName);
         }
         std::string input;
         std::cout << "Editing theme: " << themeName << "\nEnter color mapping (char:colorCode) or 'done' to finish:\n";
@@ -1451,11 +6182,278 @@ public:
             }
             char ch = input[0];
             std::string colorCode = input.substr(pos + 1);
-            themes[themeName].insert(std::string(1, ch), std::string(1, ch), colorCode);
+            edit_theme(themeName, [&](ColorMapping& mapping) { mapping.insert(std::string(1, ch), std::string(1, ch), colorCode); });
+        }
+    }
+};
+
+// Background reloader behind ThemeManager::watch(). On Linux it waits on inotify for the
+// directories of the watched files, so editors that save by renaming a new file into place
+// are seen too; elsewhere it compares modification times every debounce window. A file is
+// reloaded once it has been quiet for its debounce window. The new theme is compiled on
+// this thread and then published, so rendering threads never wait or see a partial theme;
+// failures are logged and the previous version stays in place.
+class ThemeWatcher {
+public:
+    ThemeWatcher() {
+        log_output();
+        ThemeManager::instance();
+    }
+
+    ~ThemeWatcher() { stop(); }
+
+    // Registers the watch and only then runs load(), the initial load, so a write made while
+    // it runs is still seen. Loads are serialized, so a reload never lands before it. If load()
+    // throws, the watch is removed again.
+    template <typename Load>
+    void watch(const std::string& themeName, const std::string& filePath, std::chrono::milliseconds debounce, Load&& load) {
+        add_watch(themeName, filePath, debounce);
+        try {
+            std::lock_guard<std::mutex> lock(load_mutex_);
+            load();
+        } catch (...) {
+            unwatch(filePath);
+            throw;
+        }
+    }
+
+    void unwatch(const std::string& filePath) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        unwatch_locked(filePath);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!thread_.joinable()) return;
+            running_ = false;
+            wake();
+        }
+        thread_.join();
+        std::lock_guard<std::mutex> lock(mutex_);
+        watches_.clear();
+#if defined(__linux__)
+        ::close(inotify_fd_);
+        ::close(wake_fds_[0]);
+        ::close(wake_fds_[1]);
+        inotify_fd_ = -1;
+#endif
+    }
+
+private:
+    struct Watch {
+        std::string theme;
+        std::string path;
+        std::string dir;
+        std::string file;
+        std::chrono::milliseconds debounce{0};
+        int wd = -1;
+        int64_t mtime = 0;
+        bool pending = false;
+        std::chrono::steady_clock::time_point due;
+    };
+
+    void add_watch(const std::string& themeName, const std::string& filePath, std::chrono::milliseconds debounce) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        start_locked();
+        unwatch_locked(filePath);
+        Watch watch;
+        watch.theme = themeName;
+        watch.path = filePath;
+        watch.debounce = debounce;
+        watch.mtime = modification_time(filePath);
+        size_t slash = filePath.find_last_of("/\\");
+        watch.dir = slash == std::string::npos ? "." : filePath.substr(0, std::max<size_t>(slash, 1));
+        watch.file = slash == std::string::npos ? filePath : filePath.substr(slash + 1);
+#if defined(__linux__)
+        // Only finished writes: a file closed after writing, or one renamed into place
+        watch.wd = inotify_add_watch(inotify_fd_, watch.dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (watch.wd < 0) throw std::runtime_error("Failed to watch theme file: " + filePath + ": " + std::strerror(errno));
+#endif
+        watches_.push_back(std::move(watch));
+        wake();
+    }
+
+    static int64_t modification_time(const std::string& path) {
+#if defined(_WIN32) || defined(_WIN64)
+        struct _stat64 info;
+        if (_stat64(path.c_str(), &info) != 0) return 0;
+        return static_cast<int64_t>(info.st_mtime);
+#else
+        struct stat info;
+        if (::stat(path.c_str(), &info) != 0) return 0;
+#if defined(__APPLE__)
+        return static_cast<int64_t>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+        return static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#endif
+    }
+
+    void start_locked() {
+        if (thread_.joinable()) return;
+#if defined(__linux__)
+        inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd_ < 0) throw std::runtime_error(std::string("Failed to initialise inotify: ") + std::strerror(errno));
+        if (::pipe2(wake_fds_, O_NONBLOCK | O_CLOEXEC) != 0) {
+            ::close(inotify_fd_);
+            throw std::runtime_error(std::string("Failed to create theme watcher pipe: ") + std::strerror(errno));
+        }
+#endif
+        running_ = true;
+        thread_ = std::thread([this] { run(); });
+    }
+
+    void unwatch_locked(const std::string& filePath) {
+        for (auto it = watches_.begin(); it != watches_.end(); ++it) {
+            if (it->path != filePath) continue;
+#if defined(__linux__)
+            // Watches on one directory share a descriptor
+            int wd = it->wd;
+            watches_.erase(it);
+            if (std::none_of(watches_.begin(), watches_.end(), [wd](const Watch& w) { return w.wd == wd; })) inotify_rm_watch(inotify_fd_, wd);
+#else
+            watches_.erase(it);
+#endif
+            return;
+        }
+    }
+
+    void wake() {
+#if defined(__linux__)
+        if (wake_fds_[1] >= 0) {
+            char byte = 1;
+            ssize_t ignored = ::write(wake_fds_[1], &byte, 1);
+            (void)ignored;
+        }
+#else
+        wake_cv_.notify_all();
+#endif
+    }
+
+    void mark_changed_locked(Watch& watch, std::chrono::steady_clock::time_point now) {
+        watch.pending = true;
+        watch.due = now + watch.debounce;
+    }
+
+    // Milliseconds until the next pending reload is due, or -1 if none is
+    int next_timeout_locked(std::chrono::steady_clock::time_point now) const {
+        int timeout = -1;
+        for (const auto& watch : watches_) {
+            if (!watch.pending) continue;
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(watch.due - now).count();
+            int ms = static_cast<int>(std::max<int64_t>(wait, 0));
+            if (timeout < 0 || ms < timeout) timeout = ms;
+        }
+        return timeout;
+    }
+
+    void run() {
+        std::vector<std::pair<std::string, std::string>> due;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (!running_) return;
+                int timeout = next_timeout_locked(std::chrono::steady_clock::now());
+#if defined(__linux__)
+                lock.unlock();
+                pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {wake_fds_[0], POLLIN, 0}};
+                ::poll(fds, 2, timeout);
+                char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+                while (::read(wake_fds_[0], buffer, sizeof(buffer)) > 0) {}
+                lock.lock();
+                if (!running_) return;
+                auto now = std::chrono::steady_clock::now();
+                ssize_t n;
+                while ((n = ::read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+                    for (char* p = buffer; p < buffer + n;) {
+                        const auto* event = reinterpret_cast<const inotify_event*>(p);
+                        for (auto& watch : watches_) {
+                            if (event->len != 0 && watch.wd == event->wd && watch.file == event->name) mark_changed_locked(watch, now);
+                        }
+                        p += sizeof(inotify_event) + event->len;
+                    }
+                }
+#else
+                // Without change notification, check every debounce window
+                std::chrono::milliseconds interval(250);
+                for (const auto& watch : watches_) interval = std::min(interval, std::max(watch.debounce, std::chrono::milliseconds(10)));
+                if (timeout >= 0) interval = std::min(interval, std::chrono::milliseconds(timeout));
+                wake_cv_.wait_for(lock, interval);
+                if (!running_) return;
+                auto now = std::chrono::steady_clock::now();
+                for (auto& watch : watches_) {
+                    int64_t mtime = modification_time(watch.path);
+                    if (mtime != watch.mtime) {
+                        watch.mtime = mtime;
+                        mark_changed_locked(watch, now);
+                    }
+                }
+#endif
+                due.clear();
+                for (auto& watch : watches_) {
+                    if (watch.pending && watch.due <= now) {
+                        watch.pending = false;
+                        due.emplace_back(watch.theme, watch.path);
+                    }
+                }
+            }
+            for (const auto& [theme, path] : due) reload(theme, path);
+        }
+    }
+
+    // The file is copied rather than mapped, since a writer truncating it under a mapping would
+    // raise SIGBUS, and is parsed strictly so a half-written theme is never published
+    void reload(const std::string& themeName, const std::string& filePath) {
+        std::lock_guard<std::mutex> lock(load_mutex_);
+        try {
+            std::ifstream in(filePath, std::ios::binary);
+            if (!in) throw std::runtime_error("Failed to open file for loading theme: " + filePath);
+            std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            if (in.bad()) throw std::runtime_error("Failed to read theme file: " + filePath);
+            ThemeManager::instance().publish(themeName, ThemeManager::parse_theme(data, true));
+            Logger::info("Reloaded theme " + themeName + " from file: " + filePath);
+        } catch (const std::exception& e) {
+            Logger::error("Failed to reload theme " + themeName + ": " + e.what());
         }
     }
+
+    std::mutex mutex_;
+    std::mutex load_mutex_;     // held by each load and reload, from read to publish
+    std::vector<Watch> watches_;
+    std::thread thread_;
+    bool running_ = false;
+#if defined(__linux__)
+    int inotify_fd_ = -1;
+    int wake_fds_[2] = {-1, -1};
+#else
+    std::condition_variable wake_cv_;
+#endif
 };
 
+inline ThemeWatcher& theme_watcher() {
+    static ThemeWatcher watcher;
+    return watcher;
+}
+
+inline void ThemeManager::watch(const std::string& themeName, const std::string& filePath, std::chrono::milliseconds debounce) {
+    theme_watcher().watch(themeName, filePath, debounce, [&] {
+        ColorMapping mapping;
+        try {
+            mapping = read_theme_file(filePath);
+        } catch (const std::runtime_error& e) {
+            Logger::error(e.what());
+            throw;
+        }
+        publish(themeName, std::move(mapping));
+    });
+    Logger::info("Watching theme " + themeName + " in file: " + filePath);
+}
+
+inline void ThemeManager::unwatch(const std::string& filePath) {
+    theme_watcher().unwatch(filePath);
+}
+
 } // namespace _internal
 
 void create_theme(const std::string& themeName) {
@@ -1479,10 +6477,32 @@ void erase_colormap(const std::string& characters) {
     _internal::ThemeManager::instance().erase(characters);
 }
 
+// Makes several changes to the current theme as one edit, e.g.
+//   edit_colormap([](auto& theme) { theme.insert("a", "a", "\033[31m"); theme.erase("b"); });
+// The theme is copied and compiled once rather than per change, and other threads see either
+// none of the changes or all of them.
+template <typename Edit>
+inline void edit_colormap(Edit&& edit) {
+    _internal::ThemeManager::instance().edit(std::forward<Edit>(edit));
+}
+
 void save_theme(const std::string& themeName, const std::string& filePath) {
     _internal::ThemeManager::instance().save(themeName, filePath);
 }
 
+// Loads the theme now and reloads it in the background whenever the file changes
+inline void watch_theme(const std::string& themeName, const std::string& filePath, std::chrono::milliseconds debounce = std::chrono::milliseconds(200)) {
+    _internal::ThemeManager::instance().watch(themeName, filePath, debounce);
+}
+
+inline void unwatch_theme(const std::string& filePath) {
+    _internal::ThemeManager::instance().unwatch(filePath);
+}
+
+inline void save_theme_binary(const std::string& themeName, const std::string& filePath) {
+    _internal::ThemeManager::instance().save_binary(themeName, filePath);
+}
+
 void load_theme(const std::string& themeName, const std::string& filePath) {
     _internal::ThemeManager::instance().load(themeName, filePath);
 }
@@ -1503,6 +6523,325 @@ std::string apply_theme(const std::string& text) {
     return _internal::ThemeManager::instance().apply(text);
 }
 
+// apply_theme() for large inputs, coloured on `threads` workers (0: one per core) in pieces
+// of about chunk_size bytes cut after newlines; the output is identical to the sequential version
+inline std::string apply_theme_parallel(const std::string& text, size_t threads = 0, size_t chunk_size = 256 * 1024) {
+    auto theme = _internal::ThemeManager::instance().current();
+    if (theme == nullptr) return text;
+    std::string out;
+    theme->apply_parallel(text, [&out](std::string_view piece) { out.append(piece); }, threads, chunk_size);
+    return out;
+}
+
+inline void apply_theme_parallel(std::string_view text, const std::function<void(std::string_view)>& sink, size_t threads = 0, size_t chunk_size = 256 * 1024) {
+    auto theme = _internal::ThemeManager::instance().current();
+    if (theme == nullptr) {
+        sink(text);
+        return;
+    }
+    theme->apply_parallel(text, sink, threads, chunk_size);
+}
+
+// Applies the current theme to input that arrives in pieces, such as a multi-GB log file,
+// with memory bounded by the piece size. Tokens and the key/value state carry across pieces,
+// and a same-colour run reaching the end of a piece stays open in the output until it ends;
+// the output goes to sink as each piece is processed. Call finish() after the last piece.
+class ThemeStream {
+public:
+    using Sink = std::function<void(std::string_view)>;
+
+    explicit ThemeStream(Sink sink) : theme_(_internal::ThemeManager::instance().current()), sink_(std::move(sink)) {}
+
+    void write(std::string_view chunk) {
+        if (theme_ == nullptr) {
+            sink_(chunk);
+            return;
+        }
+        if (carry_.empty()) {
+            size_t used = theme_->apply_chunk(out_, chunk, in_value_, false, &open_span_);
+            carry_.assign(chunk.substr(used));
+        } else {
+            carry_.append(chunk);
+            carry_.erase(0, theme_->apply_chunk(out_, carry_, in_value_, false, &open_span_));
+        }
+        emit();
+    }
+
+    void finish() {
+        if (theme_ != nullptr) theme_->apply_chunk(out_, carry_, in_value_, true, &open_span_);
+        carry_.clear();
+        emit();
+    }
+
+private:
+    void emit() {
+        if (out_.empty()) return;
+        sink_(out_);
+        out_.clear();
+    }
+
+    std::shared_ptr<const _internal::ColorMapping> theme_;
+    Sink sink_;
+    std::string carry_;
+    std::string out_;
+    bool in_value_ = false;
+    // Colour of the run the output so far ends in, still to be reset
+    uint16_t open_span_ = 0;
+};
+
+inline void apply_theme(std::istream& in, std::ostream& out, size_t chunk_size = 64 * 1024) {
+    ThemeStream stream([&out](std::string_view text) { out.write(text.data(), static_cast<std::streamsize>(text.size())); });
+    std::unique_ptr<char[]> buffer(new char[chunk_size]);
+    while (in.read(buffer.get(), static_cast<std::streamsize>(chunk_size)) || in.gcount() > 0) {
+        stream.write(std::string_view(buffer.get(), static_cast<size_t>(in.gcount())));
+    }
+    if (in.bad()) throw std::runtime_error("Failed to read theme input stream");
+    stream.finish();
+}
+
+// Reads fd until end of file
+inline void apply_theme_fd(int fd, const ThemeStream::Sink& sink, size_t chunk_size = 64 * 1024) {
+    ThemeStream stream(sink);
+    std::unique_ptr<char[]> buffer(new char[chunk_size]);
+    for (;;) {
+#if defined(_WIN32) || defined(_WIN64)
+        int n = _read(fd, buffer.get(), static_cast<unsigned>(chunk_size));
+#else
+        ssize_t n = ::read(fd, buffer.get(), chunk_size);
+        if (n < 0 && errno == EINTR) continue;
+#endif
+        if (n < 0) throw std::runtime_error("Failed to read theme input: " + std::string(std::strerror(errno)));
+        if (n == 0) break;
+        stream.write(std::string_view(buffer.get(), static_cast<size_t>(n)));
+    }
+    stream.finish();
+}
+
+// Maps the file and themes it chunk_size bytes at a time, so pages are read straight from
+// the page cache rather than copied into a buffer; falls back to read() where mmap is missing
+inline void apply_theme_file(const std::string& path, const ThemeStream::Sink& sink, size_t chunk_size = 1024 * 1024) {
+#if defined(_WIN32) || defined(_WIN64)
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Failed to open file for theming: " + path);
+    ThemeStream stream(sink);
+    std::unique_ptr<char[]> buffer(new char[chunk_size]);
+    while (in.read(buffer.get(), static_cast<std::streamsize>(chunk_size)) || in.gcount() > 0) {
+        stream.write(std::string_view(buffer.get(), static_cast<size_t>(in.gcount())));
+    }
+    stream.finish();
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Failed to open file for theming: " + path);
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        // Pipes, devices and empty files have nothing to map
+        try {
+            apply_theme_fd(fd, sink, chunk_size);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        return;
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) throw std::runtime_error("Failed to map file for theming: " + path);
+    ::madvise(data, size, MADV_SEQUENTIAL);
+    struct Unmap {
+        void* data;
+        size_t size;
+        ~Unmap() { ::munmap(data, size); }
+    } unmap{data, size};
+    ThemeStream stream(sink);
+    const char* p = static_cast<const char*>(data);
+    for (size_t offset = 0; offset < size; offset += chunk_size) {
+        stream.write(std::string_view(p + offset, std::min(chunk_size, size - offset)));
+    }
+    stream.finish();
+#endif
+}
+
+// One line of a compile-time theme: every character of `characters` (UTF-8) gets `color`,
+// as with insert_colormap(name, characters, color)
+struct ThemeEntry {
+    std::string_view characters;
+    std::string_view color;
+};
+
+namespace _internal {
+
+// Tables of a StaticTheme, laid out as ColorMapping lays out its own: a span per byte, the
+// escape of each span and the mapped code points in order
+template <size_t EntryCount, size_t ByteCount>
+struct StaticThemeTables {
+    std::array<uint16_t, 256> table{};
+    std::array<std::string_view, EntryCount + 1> spans{};
+    std::array<char32_t, ByteCount + 1> points{};
+    std::array<uint16_t, ByteCount + 1> point_spans{};
+    size_t point_count = 0;
+    ByteClass mapped{};
+};
+
+template <typename Entries>
+constexpr size_t static_theme_bytes(const Entries& entries) {
+    size_t bytes = 0;
+    for (const ThemeEntry& entry : entries) bytes += entry.characters.size();
+    return bytes;
+}
+
+// Later entries override earlier ones and equal colours share a span, exactly as inserting
+// the entries into a ColorMapping in order would
+template <typename Tables, typename Entries>
+constexpr Tables build_static_theme(const Entries& entries) {
+    Tables t{};
+    size_t index = 0;
+    for (const ThemeEntry& entry : entries) {
+        uint16_t span = static_cast<uint16_t>(++index);
+        for (size_t i = 1; i < index; ++i) {
+            if (t.spans[i] == entry.color) {
+                span = static_cast<uint16_t>(i);
+                break;
+            }
+        }
+        t.spans[span] = entry.color;
+        const char* p = entry.characters.data();
+        const char* end = p + entry.characters.size();
+        while (p != end) {
+            char32_t cp = 0;
+            size_t length = static_cast<unsigned char>(*p) < 0x80 ? 0 : decode_utf8(p, end, cp);
+            if (length == 0) {
+                t.table[static_cast<unsigned char>(*p++)] = span;
+                continue;
+            }
+            size_t k = 0;
+            while (k < t.point_count && t.points[k] != cp) ++k;
+            if (k == t.point_count) t.points[t.point_count++] = cp;
+            t.point_spans[k] = span;
+            p += length;
+        }
+    }
+    for (size_t i = 1; i < t.point_count; ++i) {
+        for (size_t j = i; j > 0 && t.points[j - 1] > t.points[j]; --j) {
+            char32_t cp = t.points[j];
+            uint16_t span = t.point_spans[j];
+            t.points[j] = t.points[j - 1];
+            t.point_spans[j] = t.point_spans[j - 1];
+            t.points[j - 1] = cp;
+            t.point_spans[j - 1] = span;
+        }
+    }
+    for (size_t i = 0; i < t.point_count; ++i) {
+        char32_t cp = t.points[i];
+        unsigned char lead = static_cast<unsigned char>(cp < 0x800 ? 0xC0 | (cp >> 6) : cp < 0x10000 ? 0xE0 | (cp >> 12) : 0xF0 | (cp >> 18));
+        t.table[lead] = wide_span;
+    }
+    for (int b = 0; b < 256; ++b) {
+        if (t.table[b] != 0) t.mapped.add(static_cast<unsigned char>(b));
+    }
+    return t;
+}
+
+} // namespace _internal
+
+// A theme fixed at compile time. Entries is a constexpr array of ThemeEntry; its tables are
+// built by the compiler, so apply() needs no ThemeManager, no map lookups and no setup, and
+// gives the same output as a ColorMapping with the same entries inserted:
+//
+//   inline constexpr colorterm::ThemeEntry log_theme[] = {{"[]", "\033[36m"}, {"│─", "\033[90m"}};
+//   std::cout << colorterm::StaticTheme<log_theme>::apply(line);
+template <const auto& Entries>
+class StaticTheme {
+public:
+    using Tables = _internal::StaticThemeTables<std::size(Entries), _internal::static_theme_bytes(Entries)>;
+    static constexpr Tables tables = _internal::build_static_theme<Tables>(Entries);
+
+    static std::string apply(std::string_view text) {
+        std::string out;
+        apply_to(out, text);
+        return out;
+    }
+
+    // Appends the coloured text to out
+    static void apply_to(std::string& out, std::string_view text) {
+        out.reserve(out.size() + text.size() + text.size() / 2 + 16);
+        const char* begin = text.data();
+        const char* end = begin + text.size();
+        // ColorMapping colours the text before and after the first ':' separately, so a run
+        // of one colour is broken there too
+        const char* colon = static_cast<const char*>(std::memchr(begin, ':', text.size()));
+        if (colon == nullptr) colon = end;
+        apply_span(out, begin, colon);
+        apply_span(out, colon, end);
+    }
+
+    static constexpr const std::string_view* color_of(char character) {
+        uint16_t span = tables.table[static_cast<unsigned char>(character)];
+        return span == 0 || span == _internal::wide_span ? nullptr : &tables.spans[span];
+    }
+
+private:
+    static uint16_t span_at(const char* p, const char* end, size_t& length) {
+        uint16_t span = tables.table[static_cast<unsigned char>(*p)];
+        length = 1;
+        if (span != _internal::wide_span) return span;
+        char32_t cp;
+        size_t decoded = _internal::decode_utf8(p, end, cp);
+        if (decoded == 0) return 0;
+        length = decoded;
+        const char32_t* first = tables.points.data();
+        const char32_t* last = first + tables.point_count;
+        const char32_t* it = std::lower_bound(first, last, cp);
+        return it != last && *it == cp ? tables.point_spans[static_cast<size_t>(it - first)] : 0;
+    }
+
+    static void apply_span(std::string& out, const char* p, const char* end) {
+        _internal::apply_color_spans(out, p, end, tables.table, tables.mapped, tables.spans,
+                                     [end](const char* at, size_t& length) { return span_at(at, end, length); });
+    }
+};
+
+// Colour of a log highlighter token class in the current theme: timestamp, debug, info,
+// warning, error, key, string, number, ip or uuid. An empty code leaves the class uncoloured.
+inline void set_highlight_color(const std::string& role, const std::string& colorCode) {
+    _internal::ThemeManager::instance().set_highlight_color(role, colorCode);
+}
+
+// Colours timestamps, levels, keys, strings, numbers, IPs and UUIDs in log text with the
+// current theme's highlight colours; unchanged while the colormap is disabled
+inline std::string highlight_log(std::string_view text) {
+    auto theme = _internal::ThemeManager::instance().current();
+    if (theme == nullptr) return std::string(text);
+    return _internal::LogHighlighter(*theme).apply(text);
+}
+
+// Highlights in until end of file, a chunk at a time; lines are never split between calls
+inline void highlight_log(std::istream& in, std::ostream& out, size_t chunk_size = 64 * 1024) {
+    auto theme = _internal::ThemeManager::instance().current();
+    std::string pending;
+    std::string colored;
+    std::unique_ptr<char[]> buffer(new char[chunk_size]);
+    auto flush = [&](std::string_view text) {
+        if (theme == nullptr) {
+            out.write(text.data(), static_cast<std::streamsize>(text.size()));
+            return;
+        }
+        colored.clear();
+        _internal::LogHighlighter(*theme).apply_to(colored, text);
+        out.write(colored.data(), static_cast<std::streamsize>(colored.size()));
+    };
+    while (in.read(buffer.get(), static_cast<std::streamsize>(chunk_size)) || in.gcount() > 0) {
+        pending.append(buffer.get(), static_cast<size_t>(in.gcount()));
+        size_t newline = pending.rfind('\n');
+        if (newline == std::string::npos) continue;
+        flush(std::string_view(pending).substr(0, newline + 1));
+        pending.erase(0, newline + 1);
+    }
+    if (in.bad()) throw std::runtime_error("Failed to read log input stream");
+    flush(pending);
+}
+
 std::unordered_map<char, std::string> inspect_theme() {
     return _internal::ThemeManager::instance().inspect();
 }
@@ -1511,6 +6850,11 @@ const std::string* inspect_colormap_color(char character) {
     return _internal::ThemeManager::instance().inspect_color(character);
 }
 
+// Colour of any character, ASCII or not, e.g. U'\u2502'
+inline const std::string* inspect_code_point_color(char32_t cp) {
+    return _internal::ThemeManager::instance().inspect_code_point_color(cp);
+}
+
 const std::string* inspect_key_color(const std::string& key) {
     return _internal::ThemeManager::instance().inspect_key_color(key);
 }
@@ -1900,6 +7244,228 @@ DEFINE_COLOR_FUNCTION(bg_reset, "\033[49m");
 
 namespace colorterm {
 
+// Double-buffered grid of cells (glyph, fg, bg, attrs) stored as struct-of-arrays.
+// render() diffs the back buffer against what was last presented and emits only the
+// changed cells, moving the cursor and switching SGR state as little as possible.
+class Canvas {
+public:
+    enum Attr : uint8_t {
+        attr_none = 0,
+        attr_bold = 1 << 0,
+        attr_faint = 1 << 1,
+        attr_italic = 1 << 2,
+        attr_underline = 1 << 3,
+        attr_blink = 1 << 4,
+        attr_reverse = 1 << 5,
+        attr_strikethrough = 1 << 6
+    };
+
+    // Packed 0x00RRGGBB, or default_color for the terminal's own fg/bg
+    static constexpr uint32_t default_color = 0xFF000000u;
+    static constexpr char32_t upper_half_block = U'\u2580';
+
+    static constexpr uint32_t pack(int r, int g, int b) {
+        return (static_cast<uint32_t>(r & 0xFF) << 16) | (static_cast<uint32_t>(g & 0xFF) << 8) | static_cast<uint32_t>(b & 0xFF);
+    }
+    static constexpr uint32_t pack(_internal::RGB color) { return pack(color.r, color.g, color.b); }
+
+    explicit Canvas(int width = 0, int height = 0) { resize(width, height); }
+
+    void resize(int width, int height) {
+        width_ = std::max(width, 0);
+        height_ = std::max(height, 0);
+        size_t cells = static_cast<size_t>(width_) * static_cast<size_t>(height_);
+        back_.assign(cells);
+        front_.assign(cells);
+        invalidate();
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    // Forget what is on screen so the next render() repaints every cell
+    void invalidate() {
+        std::fill(front_.glyph.begin(), front_.glyph.end(), invalid_glyph);
+        cursor_known_ = false;
+        pen_known_ = false;
+    }
+
+    void clear(uint32_t fg = default_color, uint32_t bg = default_color) {
+        std::fill(back_.glyph.begin(), back_.glyph.end(), U' ');
+        std::fill(back_.fg.begin(), back_.fg.end(), fg);
+        std::fill(back_.bg.begin(), back_.bg.end(), bg);
+        std::fill(back_.attrs.begin(), back_.attrs.end(), attr_none);
+    }
+
+    void set(int x, int y, char32_t glyph, uint32_t fg = default_color, uint32_t bg = default_color, uint8_t attrs = attr_none) {
+        if (x < 0 || y < 0 || x >= width_ || y >= height_) return;
+        size_t i = index(x, y);
+        back_.glyph[i] = glyph;
+        back_.fg[i] = fg;
+        back_.bg[i] = bg;
+        back_.attrs[i] = attrs;
+    }
+
+    // Writes single-byte text starting at (x, y), clipped to the row
+    void put_text(int x, int y, std::string_view text, uint32_t fg = default_color, uint32_t bg = default_color, uint8_t attrs = attr_none) {
+        for (char ch : text) {
+            set(x++, y, static_cast<unsigned char>(ch), fg, bg, attrs);
+        }
+    }
+
+    // Draws an RGB pixel grid using upper half blocks: each cell shows two vertically stacked pixels
+    void draw_pixels(const _internal::RGB* pixels, int pixel_width, int pixel_height, int x = 0, int y = 0) {
+        for (int py = 0; py < pixel_height; py += 2) {
+            const _internal::RGB* top = pixels + static_cast<size_t>(py) * pixel_width;
+            const _internal::RGB* bottom = (py + 1 < pixel_height) ? top + pixel_width : nullptr;
+            for (int px = 0; px < pixel_width; ++px) {
+                set(x + px, y + py / 2, upper_half_block, pack(top[px]), bottom ? pack(bottom[px]) : default_color);
+            }
+        }
+    }
+
+    void draw_pixels(const std::vector<_internal::RGB>& pixels, int pixel_width, int x = 0, int y = 0) {
+        if (pixel_width <= 0) return;
+        draw_pixels(pixels.data(), pixel_width, static_cast<int>(pixels.size() / pixel_width), x, y);
+    }
+
+    // Builds the escape stream that turns the presented frame into the back buffer and
+    // marks the back buffer as presented. The returned buffer is reused between frames.
+    const std::string& render() {
+        frame_.clear();
+        for (int y = 0; y < height_; ++y) {
+            for (int x = 0; x < width_; ++x) {
+                size_t i = index(x, y);
+                if (back_.glyph[i] == front_.glyph[i] && back_.fg[i] == front_.fg[i] &&
+                    back_.bg[i] == front_.bg[i] && back_.attrs[i] == front_.attrs[i]) {
+                    continue;
+                }
+                move_cursor(x, y);
+                transition_pen(back_.fg[i], back_.bg[i], back_.attrs[i]);
+                _internal::append_utf8(frame_, back_.glyph[i]);
+                // The terminal may defer wrapping after the last column, so stop trusting the cursor there
+                cursor_known_ = x + 1 < width_;
+                cursor_x_ = x + 1;
+                front_.glyph[i] = back_.glyph[i];
+                front_.fg[i] = back_.fg[i];
+                front_.bg[i] = back_.bg[i];
+                front_.attrs[i] = back_.attrs[i];
+            }
+        }
+        // Leave the terminal on default colours, unless the pen is known to be there already
+        bool pen_default = pen_known_ && pen_fg_ == default_color && pen_bg_ == default_color && pen_attrs_ == attr_none;
+        if (!frame_.empty() && !pen_default && CHECK_COLOR_AND_THEME(frame_)) {
+            frame_.append(reset_def.code);
+            pen_fg_ = default_color;
+            pen_bg_ = default_color;
+            pen_attrs_ = attr_none;
+            pen_known_ = true;
+        }
+        return frame_;
+    }
+
+    std::ostream& present(std::ostream& stream) {
+        const std::string& frame = render();
+        stream.write(frame.data(), static_cast<std::streamsize>(frame.size()));
+        return stream.flush();
+    }
+
+private:
+    static constexpr char32_t invalid_glyph = 0xFFFFFFFFu;
+
+    struct Buffer {
+        std::vector<char32_t> glyph;
+        std::vector<uint32_t> fg;
+        std::vector<uint32_t> bg;
+        std::vector<uint8_t> attrs;
+
+        void assign(size_t cells) {
+            glyph.assign(cells, U' ');
+            fg.assign(cells, default_color);
+            bg.assign(cells, default_color);
+            attrs.assign(cells, attr_none);
+        }
+    };
+
+    size_t index(int x, int y) const { return static_cast<size_t>(y) * width_ + x; }
+
+    void move_cursor(int x, int y) {
+        if (cursor_known_ && cursor_y_ == y && cursor_x_ == x) return;
+        if (cursor_known_ && cursor_y_ == y && cursor_x_ < x) {
+            frame_.append("\033[");
+            _internal::append_uint(frame_, static_cast<uint32_t>(x - cursor_x_));
+            frame_.push_back('C');
+        } else {
+            frame_.append("\033[");
+            _internal::append_uint(frame_, static_cast<uint32_t>(y + 1));
+            frame_.push_back(';');
+            _internal::append_uint(frame_, static_cast<uint32_t>(x + 1));
+            frame_.push_back('H');
+        }
+        cursor_known_ = true;
+        cursor_x_ = x;
+        cursor_y_ = y;
+    }
+
+    void transition_pen(uint32_t fg, uint32_t bg, uint8_t attrs) {
+        if (!CHECK_COLOR_AND_THEME(frame_)) return;
+        // SGR can only clear attributes wholesale, so dropping any of them costs a reset
+        if (!pen_known_ || (pen_attrs_ & ~attrs) != 0) {
+            frame_.append(reset_def.code);
+            pen_fg_ = default_color;
+            pen_bg_ = default_color;
+            pen_attrs_ = attr_none;
+            pen_known_ = true;
+        }
+        uint8_t added = attrs & ~pen_attrs_;
+        if (added & attr_bold) frame_.append(bold_def.code);
+        if (added & attr_faint) frame_.append(faint_def.code);
+        if (added & attr_italic) frame_.append(italic_def.code);
+        if (added & attr_underline) frame_.append(underline_def.code);
+        if (added & attr_blink) frame_.append(blink_slow_def.code);
+        if (added & attr_reverse) frame_.append(reverse_def.code);
+        if (added & attr_strikethrough) frame_.append(strikethrough_def.code);
+        pen_attrs_ = attrs;
+
+        _internal::StringWriter writer{frame_};
+        if (fg != pen_fg_) {
+            if (fg == default_color) {
+                frame_.append(default_foreground_def.code);
+            } else {
+                APPLY_RGB_COLOR_MACRO(writer, static_cast<int>((fg >> 16) & 0xFF), static_cast<int>((fg >> 8) & 0xFF), static_cast<int>(fg & 0xFF), '3');
+            }
+            pen_fg_ = fg;
+        }
+        if (bg != pen_bg_) {
+            if (bg == default_color) {
+                frame_.append(default_background_def.code);
+            } else {
+                APPLY_RGB_COLOR_MACRO(writer, static_cast<int>((bg >> 16) & 0xFF), static_cast<int>((bg >> 8) & 0xFF), static_cast<int>(bg & 0xFF), '4');
+            }
+            pen_bg_ = bg;
+        }
+    }
+
+    int width_ = 0;
+    int height_ = 0;
+    Buffer back_;
+    Buffer front_;
+    std::string frame_;
+
+    bool cursor_known_ = false;
+    int cursor_x_ = 0;
+    int cursor_y_ = 0;
+
+    bool pen_known_ = false;
+    uint32_t pen_fg_ = default_color;
+    uint32_t pen_bg_ = default_color;
+    uint8_t pen_attrs_ = attr_none;
+};
+
+} // namespace colorterm
+
+namespace colorterm {
+
 enum class OutputFormat { PLAIN_TEXT, JSON, XML, YAML, HTML, CSV };
 
 inline std::string format_to_string(OutputFormat format) {
@@ -1991,7 +7557,7 @@ inline std::enable_if_t<has_custom_json_format<T>::value> json_format(std::ostre
 }
 
 template <typename T>
-inline std::enable_if_t<!has_custom_json_format<T>::value> json_format(std::ostream& stream, const T& data) {
+inline std::enable_if_t<!has_custom_json_format<T>::value> json_format(std::ostream& stream, const T&) {
     stream << "{\"unsupported_type\": \"No custom JSON format available.\"}";
 }
 
@@ -2001,7 +7567,7 @@ inline std::enable_if_t<has_custom_xml_format<T>::value> xml_format(std::ostream
 }
 
 template <typename T>
-inline std::enable_if_t<!has_custom_xml_format<T>::value> xml_format(std::ostream& stream, const T& data) {
+inline std::enable_if_t<!has_custom_xml_format<T>::value> xml_format(std::ostream& stream, const T&) {
     stream << "<unsupported_type>No custom XML format available.</unsupported_type>";
 }
 
@@ -2011,7 +7577,7 @@ inline std::enable_if_t<has_custom_yaml_format<T>::value> yaml_format(std::ostre
 }
 
 template <typename T>
-inline std::enable_if_t<!has_custom_yaml_format<T>::value> yaml_format(std::ostream& stream, const T& data) {
+inline std::enable_if_t<!has_custom_yaml_format<T>::value> yaml_format(std::ostream& stream, const T&) {
     stream << "unsupported_type: No custom YAML format available.\n";
 }
 
@@ -2021,7 +7587,7 @@ inline std::enable_if_t<has_custom_plain_text_format<T>::value> plain_text_forma
 }
 
 template <typename T>
-inline std::enable_if_t<!has_custom_plain_text_format<T>::value> plain_text_format(std::ostream& stream, const T& data) {
+inline std::enable_if_t<!has_custom_plain_text_format<T>::value> plain_text_format(std::ostream& stream, const T&) {
     stream << "No custom plain text format available.";
 }
 
@@ -2031,7 +7597,7 @@ inline std::enable_if_t<has_custom_html_format<T>::value> html_format(std::ostre
 }
 
 template <typename T>
-inline std::enable_if_t<!has_custom_html_format<T>::value> html_format(std::ostream& stream, const T& data) {
+inline std::enable_if_t<!has_custom_html_format<T>::value> html_format(std::ostream& stream, const T&) {
     stream << "<html><body><p>No custom HTML format available.</p></body></html>";
 }
 
@@ -2041,7 +7607,7 @@ inline std::enable_if_t<has_custom_csv_format<T>::value> csv_format(std::ostream
 }
 
 template <typename T>
-inline std::enable_if_t<!has_custom_csv_format<T>::value> csv_format(std::ostream& stream, const T& data) {
+inline std::enable_if_t<!has_custom_csv_format<T>::value> csv_format(std::ostream& stream, const T&) {
     stream << "key,value\nNo custom CSV format available,";
 }
 
@@ -2217,6 +7783,96 @@ inline void reset_output_format() {
     set_output_format(OutputFormat::PLAIN_TEXT);
 }
 
+// Logger metrics through the custom format hooks, e.g. apply_output_format(stream, Logger::metrics(), OutputFormat::JSON)
+inline void custom_json_format(std::ostream& stream, const LogMetrics& metrics) {
+    stream << "{\n \"messages\": {";
+    for (size_t i = 0; i < metrics.messages.size(); ++i) {
+        stream << (i ? ", " : "") << "\"" << _internal::log_level_name(static_cast<LogLevel>(i)) << "\": " << metrics.messages[i];
+    }
+    stream << "},\n \"bytes_written\": " << metrics.bytes_written
+           << ",\n \"dropped\": " << metrics.dropped
+           << ",\n \"suppressed\": " << metrics.suppressed
+           << ",\n \"mutex_waits\": " << metrics.mutex_waits
+           << ",\n \"mutex_wait_ns\": " << metrics.mutex_wait_ns
+           << ",\n \"calls\": " << metrics.calls
+           << ",\n \"latency_ns\": {\"p50\": " << metrics.latency_p50_ns << ", \"p90\": " << metrics.latency_p90_ns
+           << ", \"p99\": " << metrics.latency_p99_ns << ", \"p999\": " << metrics.latency_p999_ns << ", \"max\": " << metrics.latency_max_ns << "},\n \"latency_histogram\": [";
+    for (size_t i = 0; i < metrics.latency_histogram.size(); ++i) {
+        stream << (i ? ", " : "") << "[" << metrics.latency_histogram[i].first << ", " << metrics.latency_histogram[i].second << "]";
+    }
+    stream << "]\n}\n";
+}
+
+inline void custom_csv_format(std::ostream& stream, const LogMetrics& metrics) {
+    stream << "metric,value\n";
+    for (size_t i = 0; i < metrics.messages.size(); ++i) {
+        stream << "messages_" << _internal::log_level_name(static_cast<LogLevel>(i)) << "," << metrics.messages[i] << "\n";
+    }
+    stream << "bytes_written," << metrics.bytes_written << "\n"
+           << "dropped," << metrics.dropped << "\n"
+           << "suppressed," << metrics.suppressed << "\n"
+           << "mutex_waits," << metrics.mutex_waits << "\n"
+           << "mutex_wait_ns," << metrics.mutex_wait_ns << "\n"
+           << "calls," << metrics.calls << "\n"
+           << "latency_p50_ns," << metrics.latency_p50_ns << "\n"
+           << "latency_p90_ns," << metrics.latency_p90_ns << "\n"
+           << "latency_p99_ns," << metrics.latency_p99_ns << "\n"
+           << "latency_p999_ns," << metrics.latency_p999_ns << "\n"
+           << "latency_max_ns," << metrics.latency_max_ns << "\n";
+}
+
+namespace _internal {
+
+// Background thread behind start_log_metrics_dump()
+class LogMetricsDumper {
+public:
+    ~LogMetricsDumper() { stop(); }
+
+    void start(std::ostream& stream, OutputFormat format, std::chrono::milliseconds interval) {
+        stop();
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = false;
+        worker_ = std::thread([this, &stream, format, interval] {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!cv_.wait_for(lock, interval, [this] { return stopping_; })) {
+                apply_output_format(stream, Logger::metrics(), format);
+                stream.flush();
+            }
+        });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        if (worker_.joinable()) worker_.join();
+    }
+
+private:
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+};
+
+inline LogMetricsDumper& log_metrics_dumper() {
+    static LogMetricsDumper dumper;
+    return dumper;
+}
+
+} // namespace _internal
+
+// Write Logger::metrics() to stream in the given format every interval
+inline void start_log_metrics_dump(std::ostream& stream, OutputFormat format = OutputFormat::JSON, std::chrono::milliseconds interval = std::chrono::milliseconds(10000)) {
+    _internal::log_metrics_dumper().start(stream, format, interval);
+}
+
+inline void stop_log_metrics_dump() {
+    _internal::log_metrics_dumper().stop();
+}
+
 } // namespace colorterm
 
 
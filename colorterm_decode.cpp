@@ -0,0 +1,60 @@
+/*
+(c) 2024 | Ben Gorlick | https://github.com/bgorlick/colorterm
+
+Renders a binary log written by `Logger::set_binary_output()` as coloured log text, with the
+same level labels and colours the `Logger` uses. Programs that customise them through `Config`
+can call `colorterm::decode_binary_log()` themselves after applying the same settings.
+
+Usage:
+g++ -std=c++17 -O3 -o colorterm_decode colorterm_decode.cpp
+./colorterm_decode [--no-color] [--us] [<binary log>]
+
+Arguments:
+
+<binary log>: File to decode; standard input when omitted.
+--no-color: Plain text output, e.g. for piping into grep.
+--us: Microsecond timestamps instead of milliseconds.
+*/
+
+#include "colorterm.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+int main(int argc, char* argv[]) {
+    bool colored = true;
+    colorterm::TimestampPrecision precision = colorterm::TimestampPrecision::milliseconds;
+    std::string input;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--no-color") {
+            colored = false;
+        } else if (arg == "--us") {
+            precision = colorterm::TimestampPrecision::microseconds;
+        } else if (!arg.empty() && arg[0] == '-') {
+            std::cerr << "Usage: " << argv[0] << " [--no-color] [--us] [<binary log>]\n";
+            return 1;
+        } else {
+            input = arg;
+        }
+    }
+
+    try {
+        std::ios::sync_with_stdio(false);
+        if (input.empty()) {
+            colorterm::decode_binary_log(std::cin, std::cout, colored, precision);
+        } else {
+            std::ifstream file(input, std::ios::binary);
+            if (!file) {
+                std::cerr << "Failed to open " << input << "\n";
+                return 1;
+            }
+            colorterm::decode_binary_log(file, std::cout, colored, precision);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}